@@ -1,3 +1,45 @@
 #!/bin/bash
 
-gcc -Wall -O3 -o decode6502 src/main.c src/em_6502.c
+# Usage:
+#   ./build.sh           build decode6502
+#   ./build.sh bench     build bench6502, the decoder micro-benchmarks
+#   ./build.sh gen       build gen6502, the synthetic capture generator
+#   ./build.sh check     build check6502 and compare the sync and sync-less
+#                        decoders, and decoding an archived capture, against
+#                        src/check.expected
+#   ./build.sh fx2pipe   build decode6502 with in-process fx2pipe capture
+#                        (needs libusb-0.1, fx2pipe/configure to have been
+#                        run and the firmware built in fx2pipe/firmware)
+
+if [ "$1" == "bench" ]; then
+   gcc -Wall -O3 -o bench6502 src/bench.c src/em_6502.c src/capture.c src/bus_gen.c -lpthread
+   exit $?
+fi
+
+if [ "$1" == "gen" ]; then
+   gcc -Wall -O3 -o gen6502 src/gen6502.c src/em_6502.c src/capture.c src/bus_gen.c
+   exit $?
+fi
+
+if [ "$1" == "check" ]; then
+   gcc -Wall -O3 -o check6502 src/check.c src/em_6502.c src/capture.c src/bus_gen.c -lpthread || exit $?
+   ./check6502 | diff -u src/check.expected -
+   exit $?
+fi
+
+if [ "$1" == "fx2pipe" ]; then
+   FX2=fx2pipe
+   OBJ=$(mktemp -d)
+   gcc -Wall -O3 -DFX2PIPE -c -o $OBJ/main.o src/main.c &&
+   gcc -Wall -O3 -c -o $OBJ/em_6502.o src/em_6502.c &&
+   gcc -Wall -O3 -c -o $OBJ/capture.o src/capture.c &&
+   g++ -Wall -O3 -D_GNU_SOURCE -fno-rtti -fno-exceptions -I$FX2 \
+      -o decode6502 $OBJ/main.o $OBJ/em_6502.o $OBJ/capture.o \
+      $FX2/fx2pipe/fx2capture.cc $FX2/fx2pipe/fx2pipe.cc $FX2/fx2pipe/args.cc \
+      $FX2/firmware/fx2pipe_static.cc $FX2/usb_io/*.cc -lusb -lpthread
+   STATUS=$?
+   rm -rf $OBJ
+   exit $STATUS
+fi
+
+gcc -Wall -O3 -o decode6502 src/main.c src/em_6502.c src/capture.c -lpthread
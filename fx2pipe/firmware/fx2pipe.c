@@ -52,6 +52,18 @@ typedef unsigned int uint16;  // int is 16 bit.
 	NOP
 
 
+// Status area read by the host (using the 0xA0 vendor request which is 
+// handled by the FX2 core even while we are running), right behind the 
+// config: 
+//  [0] StatusMagic once the firmware counts overflows (IN only)
+//  [1] reserved (0)
+//  [2] number of EP6 (and EP2 with 0x16) FIFO overflows, low byte
+//  [3] number of EP6 (and EP2 with 0x16) FIFO overflows, high byte
+// The host zeroes it together with the config download. 
+#define STATUS_ADR   0x1008
+#define StatusMagic  0xf1U
+
+
 // Initialize the FX2 in 16bit sync fifo mode. 
 static void Initialize(void)
 {
@@ -61,8 +73,9 @@ static void Initialize(void)
 	//       0x3000 but rather 0x1000 or so. 
 	//       Now we use 0x1000 to support both devices. 
 	__xdata char *cfg_data=(__xdata char*)0x1003;
-	// First cfg_data must be 21 or 12 to be considered valid. 
-	char cfg_data_ok = (cfg_data[0]==0x12U || cfg_data[0]==0x21U);
+	// First cfg_data must be 21, 12 or 16 to be considered valid. 
+	char cfg_data_ok = (cfg_data[0]==0x12U || cfg_data[0]==0x21U || 
+		cfg_data[0]==0x16U);
 	
 	SYNCDELAY;
 	
@@ -112,7 +125,10 @@ static void Initialize(void)
 	EP2FIFOCFG=0x00U;  SYNCDELAY;
 	OEA=0x00U;
 	
-	if(cfg_data[0]==0x12U) /* INPUT: USB->HOST */
+	// 0x16 is IN with 32 bit samples: The external master writes the 
+	// low word to EP6 (FIFOADR=10) and the high word to EP2 (FIFOADR=00) 
+	// and the host puts them back together. Both get the same config. 
+	if(cfg_data[0]==0x12U || cfg_data[0]==0x16U) /* INPUT: USB->HOST */
 	{
 		// Configure EP6 (IN): 
 		// EP6CFG: 
@@ -125,6 +141,12 @@ static void Initialize(void)
 		// Want: 1110 0010 (enabled, IN, BULK, double-buffered 512 bytes)
 		EP6CFG = cfg_data[2];  // bulk: 0xe2 double-buffered; 0xe3 triple-; 0xe0 quad
 		SYNCDELAY;
+		if(cfg_data[0]==0x16U)
+		{
+			// Quad buffering uses the EP4 and EP8 space which is free. 
+			EP2CFG = cfg_data[2];
+			SYNCDELAY;
+		}
 		
 		// To be sure, clear and reset all FIFOs although 
 		// this is probably not strictly required. 
@@ -156,6 +178,16 @@ static void Initialize(void)
 		EP6AUTOINLENL = 0x00; // LSB
 		SYNCDELAY;
 		
+		if(cfg_data[0]==0x16U)
+		{
+			EP2FIFOCFG = cfg_data[3];
+			SYNCDELAY;
+			EP2AUTOINLENH = 0x02; // MSB
+			SYNCDELAY;
+			EP2AUTOINLENL = 0x00; // LSB
+			SYNCDELAY;
+		}
+		
 // SPECIAL VOODOO: Set the IO pins on port A: 
 // 7, PKTEND, FIFOADR1, FIFOADR0, 3, SLOE, 1, 0
 // Z    1        1         0      Z   1    Z  Z
@@ -218,10 +250,42 @@ static void Initialize(void)
 
 void main()
 {
+	__xdata volatile uint8 *status=(__xdata uint8*)STATUS_ADR;
+	__xdata char *cfg_data=(__xdata char*)0x1003;
+	uint16 overflows=0;
+	uint8 was_full=0;
+	uint8 ep2_mask;
+	
 	Initialize();
 	
+	if(cfg_data[0]!=0x12U && cfg_data[0]!=0x16U)
+	{
+		for(;;)
+		{
+			// Do nothing. 
+		}
+	}
+	
+	status[1]=0;
+	status[2]=0;
+	status[3]=0;
+	status[0]=StatusMagic;
+	ep2_mask = cfg_data[0]==0x16U ? 0x01U : 0x00U;
+	
 	for(;;)
 	{
-		// Do nothing. 
+		// EP68FIFOFLGS bit0 = EP6FF: All EP6 buffers are full and data 
+		// written by the external master is dropped, i.e. the host did 
+		// not keep up. Count each time this happens. Same for EP2FF 
+		// in EP24FIFOFLGS with 32 bit samples. 
+		uint8 full=(EP68FIFOFLGS | (EP24FIFOFLGS & ep2_mask)) & 0x01U;
+		if(full && !was_full)
+		{
+			++overflows;
+			// High byte first; the host reads twice to catch tearing. 
+			status[3]=overflows>>8;
+			status[2]=overflows;
+		}
+		was_full=full;
 	}
 }
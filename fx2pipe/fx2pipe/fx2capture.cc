@@ -0,0 +1,72 @@
+/*
+ * fx2pipe/fx2capture.cc
+ * 
+ * In-process capture interface for linking fx2pipe into other programs. 
+ * 
+ * This file may be distributed and/or modified under the terms of the 
+ * GNU General Public License version 2 as published by the Free Software 
+ * Foundation. (See COPYING.GPL for details.)
+ * 
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ */
+
+#include "../oconfig.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "../fx2pipe/fx2pipe.h"
+#include "../fx2pipe/fx2capture.h"
+
+
+// When linked in-process, main.cc is not used. 
+volatile int caught_sigint=0;
+
+static void CaptureSigIntHandler(int)
+{
+	++caught_sigint;
+}
+
+
+int fx2_capture(int argc,char **argv,fx2_capture_sink sink,void *user)
+{
+	return(fx2_capture_gaps(argc,argv,sink,NULL,user));
+}
+
+
+int fx2_capture_gaps(int argc,char **argv,fx2_capture_sink sink,
+	fx2_capture_gap_sink gap_sink,void *user)
+{
+	FX2Pipe p;
+	
+	int rv=p.ParseArgs(argc,argv);
+	if(rv)
+	{  return(rv<0 ? 0 : 1);  }
+	
+	if(p.dir>0)
+	{
+		fprintf(stderr,"fx2pipe: in-process capture only supports "
+			"the IN direction\n");
+		return(1);
+	}
+	if(p.no_stdio)
+	{
+		fprintf(stderr,"fx2pipe: warning: no stdio mode set, "
+			"captured data is thrown away\n");
+	}
+	
+	p.data_sink=sink;
+	p.data_sink_user=user;
+	p.gap_sink=gap_sink;
+	
+	// Install signal handler for SIGINT. 
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler=&CaptureSigIntHandler;
+	sigaction(SIGINT,&sa,NULL);
+	
+	return(p.run());
+}
@@ -0,0 +1,71 @@
+/*
+ * fx2pipe/fx2capture.h
+ * 
+ * In-process capture interface for linking fx2pipe into other programs. 
+ * 
+ * This file may be distributed and/or modified under the terms of the 
+ * GNU General Public License version 2 as published by the Free Software 
+ * Foundation. (See COPYING.GPL for details.)
+ * 
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ */
+
+#ifndef _INCLUDE_FX2PIPE_FX2CAPTURE_H_
+#define _INCLUDE_FX2PIPE_FX2CAPTURE_H_ 1
+
+/* NOTE: This header has C linkage and may be included from C code. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \short Data sink for in-process captures. 
+ * 
+ * Called from the USB reaping code for every completed IN transfer with 
+ * the URB buffer in place, i.e. without any copy or pipe in between. 
+ * The buffer is only valid during the call. Return nonzero to stop the 
+ * capture. 
+ */
+typedef int (*fx2_capture_sink)(void *user,const void *buf,size_t len);
+
+/**
+ * \short Run an IN capture in-process. 
+ * 
+ * argc/argv hold fx2pipe command line arguments (argv[0] is ignored), 
+ * e.g. "-d=0", "-ifclk=x" or "-sim=PATH" to replay a capture file 
+ * through the simulated device backend. All data is passed to sink 
+ * instead of stdout. A SIGINT handler is installed to stop the capture. 
+ * 
+ * Returns 0 on success and nonzero on errors (like fx2pipe's exit code). 
+ */
+int fx2_capture(int argc,char **argv,fx2_capture_sink sink,void *user);
+
+/**
+ * \short Consumer for FIFO overflow records of in-process captures. 
+ * 
+ * Called (from the same thread as the data sink) when the FX2 reported 
+ * events FIFO overflows: Data is missing somewhere between the capture 
+ * byte offsets lo and hi (exclusive). hi may be beyond the data passed 
+ * to the data sink so far. 
+ */
+typedef void (*fx2_capture_gap_sink)(void *user,long long lo,long long hi,
+	int events);
+
+/**
+ * \short Like fx2_capture() but also report FIFO overflows to gap_sink. 
+ * 
+ * Both sinks get the same user pointer. 
+ */
+int fx2_capture_gaps(int argc,char **argv,fx2_capture_sink sink,
+	fx2_capture_gap_sink gap_sink,void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _INCLUDE_FX2PIPE_FX2CAPTURE_H_ */
@@ -15,11 +15,20 @@
  */
 
 #include "../fx2pipe/fx2pipe.h"
+#include "../../src/capture.h"
 //#include "../lib/databuffer.h"
 
 #include <stdio.h>
 #include <sched.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 //#include <unistd.h>
 //#include <time.h>
 //#include <sys/time.h>
@@ -37,6 +46,18 @@ int FX2Pipe::_ConnectAndInitUSB()
 	// Be sure: 
 	_CleanupUSB();
 	
+	if(sim_path)
+	{
+		WWUSBDevice::ErrorCode ec=WWUSBDevice::connect_sim(sim_path);
+		if(ec)
+		{
+			fprintf(stderr,"Failed to open simulated device \"%s\" (ec=%d)\n",
+				sim_path,ec);
+			return(1);
+		}
+		return(0);
+	}
+	
 	// Connect and init USB device. 
 // FIXME: Support bus/device. 
 	FX2USBDevice::ErrorCode ec=FX2USBDevice::connect(
@@ -79,6 +100,8 @@ int FX2Pipe::_SubmitOneURB()
 {
 	if(stdio_eof)
 	{  return(0);  }
+	if(wide)
+	{  return(_SubmitWidePair());  }
 	
 	size_t iobs=io_block_size;
 	if(transfer_limit>=0 && transfer_limit-submitted_bytes<int64(iobs))
@@ -93,18 +116,32 @@ int FX2Pipe::_SubmitOneURB()
 	{  return(0);  }
 	
 	MyURB *u = new MyURB(dir<0 ? 0x86U/*EP6 IN*/ : 0x02U/*EP2 OUT*/);
-// FIXME: In the OUT case we don't need to allocate buffers all the time 
-//        since the content is copied by the kernel upon submission time. 
-// FIXME: This means we don't need to zero out the buffer each time if 
-//        no_stdio is set. 
-	u->AllocBuffer(iobs);
+	// Use one of the preallocated buffers (from the stdio thread if 
+	// used: The ones the writer is done with or the ones already filled 
+	// from stdin by the reader). 
+	size_t len=iobs;
+	if(fill_ring)
+	{  u->buffer=_GetStdioBuf(&len);  }
+	else if(!(u->buffer=buf_pool.get()))
+	{  fprintf(stderr,"OOPS: URB buffer pool exhausted\n");  }
+	if(!u->buffer)
+	{  delete u;  return(stdio_eof==1 ? 0 : 1);  }
+	u->buffer_length=iobs;
 	
 	if(dir>0)  // Write out to USB. 
 	{
-		if(no_stdio)
+		if(fill_ring)
 		{
+			// Data was read ahead by the reader thread. 
+			if(len<iobs)
+			{  u->buffer_length=len;  }
+			u->actual_length=u->buffer_length;
+		}
+		else if(no_stdio)
+		{
+			// Pool buffers are zeroed upon allocation and nothing else 
+			// is ever written to them in this mode. 
 			u->actual_length=u->buffer_length;
-			memset(u->buffer,0,u->actual_length);
 			
 			//slurped_bytes+=u->buffer_length;
 		}
@@ -132,7 +169,7 @@ int FX2Pipe::_SubmitOneURB()
 						strerror(errno));
 					++x_errors;
 					
-					delete u;
+					DeleteURB(u);
 					return(1);
 				}
 				else if(!rd)
@@ -162,7 +199,67 @@ int FX2Pipe::_SubmitOneURB()
 		submitted_bytes+=u->buffer_length;
 	}
 	else
-	{  delete u;  }
+	{  DeleteURB(u);  }
+	
+	return(0);
+}
+
+
+int FX2Pipe::_SubmitWidePair()
+{
+	// Whole 32 bit samples only. 
+	size_t iobs=io_block_size;
+	if(transfer_limit>=0 && transfer_limit-submitted_bytes<int64(iobs))
+	{
+		assert(transfer_limit>=submitted_bytes);
+		iobs=(transfer_limit-submitted_bytes) & ~size_t(3);
+		
+		stdio_eof=2;
+	}
+	
+	if(!iobs)
+	{  return(0);  }
+	
+	// There are more slots than pairs can be pending. 
+	WidePair *p=NULL;
+	for(int i=0; i<wide_npairs && !p; i++)
+	{
+		if(!wide_pairs[i].refs)
+		{  p=&wide_pairs[i];  }
+	}
+	assert(p);
+	
+	size_t len=iobs;
+	if(fill_ring)
+	{  p->buf=_GetStdioBuf(&len);  }
+	else if(!(p->buf=(char*)buf_pool.get()))
+	{  fprintf(stderr,"OOPS: URB buffer pool exhausted\n");  }
+	if(!p->buf)
+	{  return(1);  }
+	p->half=iobs/2;
+	p->len[0]=p->len[1]=-1;
+	
+	// EP6 first: The external master starts each sample with it. 
+	for(int h=0; h<2; h++)
+	{
+		MyURB *u = new MyURB(h ? 0x82U/*EP2 IN*/ : 0x86U/*EP6 IN*/);
+		u->wide_slot=p-wide_pairs;
+		u->buffer=p->buf+h*p->half;
+		u->buffer_length=p->half;
+		
+		ErrorCode ec=SubmitURB(u);
+		if(ec)
+		{
+			fprintf(stderr,"OOPS: URB submission failed (ec=%d)\n",ec);
+			// Deleting the last URB of the pair gives back the buffer. 
+			++p->refs;
+			DeleteURB(u);
+			return(1);
+		}
+		++p->refs;
+	}
+	
+	submitted_bytes+=iobs;
 	
 	return(0);
 }
@@ -170,7 +267,7 @@ int FX2Pipe::_SubmitOneURB()
 
 int FX2Pipe::_SubmitInitialURBs()
 {
-	if(!udh)  return(2);
+	if(!IsConnected())  return(2);
 	
 	// We submit some URBs with specified iobs. 
 	
@@ -180,7 +277,8 @@ int FX2Pipe::_SubmitInitialURBs()
 	gettimeofday(&starttime,NULL);
 	last_update_time=starttime;
 	
-	for(int i=0; i<pipeline_size; i++)
+	// With -W, each iteration submits two URBs. 
+	while(npending<pipeline_size)
 	{
 		if(_SubmitOneURB())
 		{  return(1);  }
@@ -193,6 +291,191 @@ int FX2Pipe::_SubmitInitialURBs()
 }
 
 
+int FX2Pipe::_FillPipeline()
+{
+	while(npending<pipeline_size && !stdio_eof && !caught_sigint)
+	{
+		if(_SubmitOneURB())
+		{  return(1);  }
+	}
+	
+	return(0);
+}
+
+
+void FX2Pipe::_AutoTune()
+{
+	int stalls=stdio_stalls-auto_last_stalls;
+	auto_last_stalls=stdio_stalls;
+	
+	// Trouble: The device may have run out of URBs to fill. 
+	// Headroom: At most half of the pipeline completed between reaps. 
+	bool trouble=(auto_drained || auto_errors);
+	bool headroom=(!trouble && auto_max_batch*2<=pipeline_size);
+	auto_drained=0;
+	auto_max_batch=0;
+	auto_errors=0;
+	
+	int ps=pipeline_size;
+	uint bs=io_block_size;
+	if(stalls)
+	{
+		// The consumer is the bottleneck (backpressure); more or 
+		// larger URBs will not help with that. 
+		auto_calm=0;
+	}
+	else if(trouble)
+	{
+		// Larger blocks first: Less overhead per byte. Then more of them. 
+		auto_calm=0;
+		if(auto_block_size && bs<AutoBlockSizeMax)
+		{  bs = bs*2<AutoBlockSizeMax ? bs*2 : AutoBlockSizeMax;  }
+		else if(auto_pipeline && ps<AutoPipelineMax)
+		{  ps = ps*2<AutoPipelineMax ? ps*2 : AutoPipelineMax;  }
+		auto_floor_ps=ps;
+		auto_floor_bs=bs;
+	}
+	else if(!headroom)
+	{  auto_calm=0;  }
+	else if(++auto_calm>=AutoCalmTicks)
+	{
+		// Shrink in the opposite order to use less memory and to 
+		// deliver data in smaller chunks (lower latency). 
+		auto_calm=0;
+		if(auto_pipeline && ps/2>=auto_floor_ps && ps/2>=AutoPipelineMin)
+		{  ps/=2;  }
+		else if(auto_block_size && bs/2>=auto_floor_bs && 
+			bs/2>=AutoBlockSizeMin)
+		{  bs/=2;  }
+	}
+	
+	if(ps!=pipeline_size || bs!=io_block_size)
+	{
+		fprintf(stderr,"\nfx2pipe: auto: pipeline size %d -> %d, "
+			"block size %u -> %u\n",pipeline_size,ps,io_block_size,bs);
+		pipeline_size=ps;
+		io_block_size=bs;
+	}
+}
+
+
+void FX2Pipe::_StartGapDetection()
+{
+	if(gaps_path)
+	{
+		gaps_file=fopen(gaps_path,"w");
+		if(!gaps_file)
+		{  fprintf(stderr,"fx2pipe: cannot open %s: %s\n",gaps_path,
+			strerror(errno));  ++x_errors;  }
+		else
+		{  fprintf(gaps_file,"# fx2pipe FIFO overflows: lo hi events\n"
+			"# (data missing somewhere in IN byte offsets lo..hi-1)\n");  }
+	}
+	
+	uchar st[4];
+	if(ReadRAM(FirmwareStatusAdr,st,sizeof(st)) || st[0]!=FirmwareStatusMagic)
+	{
+		fprintf(stderr,"fx2pipe: no FIFO overflow detection "
+			"(not supported by firmware or device)\n");
+		return;
+	}
+	gap_last_count=st[2] | (st[3]<<8);
+	gap_lo=transferred_bytes;
+	gap_events=0;
+	
+	gap_fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+	if(gap_fd>=0)
+	{
+		struct itimerspec its;
+		its.it_interval.tv_sec=0;
+		its.it_interval.tv_nsec=GapPollMsec*1000000L;
+		its.it_value=its.it_interval;
+		if(timerfd_settime(gap_fd,0,&its,NULL) || 
+		   AddPollFD(gap_fd,EPOLLIN))
+		{  close(gap_fd);  gap_fd=-1;  }
+	}
+	if(gap_fd<0)
+	{  fprintf(stderr,"fx2pipe: no FIFO overflow detection: %s\n",
+		strerror(errno));  }
+}
+
+
+void FX2Pipe::_StopGapDetection()
+{
+	if(gap_fd>=0)
+	{
+		// Overflows after the end of the data are of no interest. 
+		if(!stdio_eof)
+		{  _PollGaps();  }
+		if(gap_events)
+		{  fprintf(stderr,"fx2pipe: %d FIFO overflows detected\n",
+			gap_events);  }
+		RemovePollFD(gap_fd);
+		close(gap_fd);  gap_fd=-1;
+	}
+	if(gaps_file)
+	{
+		if(fclose(gaps_file))
+		{  fprintf(stderr,"fx2pipe: writing %s: %s\n",gaps_path,
+			strerror(errno));  ++x_errors;  }
+		gaps_file=NULL;
+	}
+}
+
+
+int FX2Pipe::_ReadOverflowCount(uint16 *count)
+{
+	// The firmware updates the two bytes non-atomically; read until 
+	// two reads agree. 
+	uint16 last=0;
+	for(int i=0; i<4; i++)
+	{
+		uchar st[4];
+		if(ReadRAM(FirmwareStatusAdr,st,sizeof(st)))
+		{  return(1);  }
+		uint16 c=st[2] | (st[3]<<8);
+		if(i && c==last)
+		{  *count=c;  return(0);  }
+		last=c;
+	}
+	return(1);
+}
+
+
+void FX2Pipe::_PollGaps()
+{
+	// Once we stopped submitting URBs, the FIFO runs full anyways. 
+	uint16 count;
+	if(stdio_eof || _ReadOverflowCount(&count))
+	{  return;  }
+	
+	if(count!=gap_last_count)
+	{
+		int events=uint16(count-gap_last_count);
+		gap_last_count=count;
+		gap_events+=events;
+		
+		// The overflow happened after the data reaped at the last poll 
+		// was captured. The data lost would have ended up in the URBs 
+		// submitted by now or in the FIFO content going into later ones. 
+		int64 hi=submitted_bytes+(wide ? 2 : 1)*FifoBytes;
+		fprintf(stderr,"\nfx2pipe: %d FIFO overflow%s between byte %lld "
+			"and %lld\n",events,events==1 ? "" : "s",
+			(long long)gap_lo,(long long)hi);
+		if(gaps_file)
+		{
+			fprintf(gaps_file,"%lld %lld %d\n",
+				(long long)gap_lo,(long long)hi,events);
+			fflush(gaps_file);
+		}
+		if(gap_sink)
+		{  gap_sink(data_sink_user,gap_lo,hi,events);  }
+	}
+	
+	gap_lo=transferred_bytes;
+}
+
+
 void FX2Pipe::_CancelAllPendingDataURBs()
 {
 	for(URB *_u=pending.last(); _u; )
@@ -210,6 +493,693 @@ void FX2Pipe::_CancelAllPendingDataURBs()
 }
 
 
+int FX2Pipe::_StartStdioThread()
+{
+	int nbufs=buf_pool.size();
+	
+	stdio_stop=0;
+	if(dir>0 && pipe(stop_pipe))
+	{
+		fprintf(stderr,"Failed to create pipe: %s\n",strerror(errno));
+		return(1);
+	}
+	
+	// One more for the stop marker. 
+	fill_ring=new TLSPSCRing<StdioBuf>(nbufs+1);
+	free_ring=new TLSPSCRing<StdioBuf>(nbufs);
+	sem_init(&fill_sem,0,0);
+	sem_init(&free_sem,0,nbufs);
+	for(int i=0; i<nbufs; i++)
+	{
+		StdioBuf wb={(char*)buf_pool.get(),0};
+		free_ring->push(wb);
+	}
+	stdio_error=0;
+	stdio_stalls=0;
+	
+	held_size=nbufs+1;
+	held_buf=new char*[held_size];
+	held_end=new int64[held_size];
+	held_get=held_put=0;
+	spliced_pages=0;
+
+	// SIGINT must be delivered to the reaping thread to interrupt it, 
+	// so block it in the stdio thread (which inherits our mask). 
+	sigset_t sigs,oldsigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs,SIGINT);
+	pthread_sigmask(SIG_BLOCK,&sigs,&oldsigs);
+	int rv=pthread_create(&stdio_thread,NULL,
+		dir<0 ? &_WriterThread : &_ReaderThread,this);
+	pthread_sigmask(SIG_SETMASK,&oldsigs,NULL);
+	if(rv)
+	{
+		fprintf(stderr,"Failed to create stdio thread: %s\n",strerror(rv));
+		delete fill_ring;  fill_ring=NULL;
+		_StopStdioThread();
+		return(1);
+	}
+	
+	return(0);
+}
+
+
+void FX2Pipe::_StopStdioThread()
+{
+	if(fill_ring)
+	{
+		if(dir<0)
+		{
+			// Let the writer write out everything queued and exit. 
+			StdioBuf wb={NULL,0};
+			_PushStdioBuf(fill_ring,&fill_sem,wb);
+		}
+		else
+		{
+			// Wake up the reader if waiting for a buffer or for stdin. 
+			stdio_stop=1;
+			sem_post(&free_sem);
+			while(write(stop_pipe[1],"",1)<0 && errno==EINTR);
+		}
+		pthread_join(stdio_thread,NULL);
+		
+		if(stdio_error==1)
+		{  ++x_errors;  }
+		if(stdio_stalls)
+		{  fprintf(stderr,"fx2pipe: waited %d times for %s\n",stdio_stalls,
+			dir<0 ? "stdout writer" : "stdin reader");  }
+		
+		delete fill_ring;  fill_ring=NULL;
+	}
+	if(stop_pipe[0]>=0)
+	{
+		close(stop_pipe[0]);  stop_pipe[0]=-1;
+		close(stop_pipe[1]);  stop_pipe[1]=-1;
+	}
+	if(free_ring)
+	{
+		delete free_ring;  free_ring=NULL;
+		sem_destroy(&fill_sem);
+		sem_destroy(&free_sem);
+	}
+	if(held_buf)
+	{
+		delete[] held_buf;  held_buf=NULL;
+		delete[] held_end;  held_end=NULL;
+	}
+	if(out_pipe[0]>=0)
+	{
+		close(out_pipe[0]);  out_pipe[0]=-1;
+		close(out_pipe[1]);  out_pipe[1]=-1;
+	}
+	if(out_fd!=1)
+	{  close(out_fd);  out_fd=1;  }
+	if(batch_iov)
+	{
+		delete[] batch_buf;  batch_buf=NULL;
+		delete[] batch_iov;  batch_iov=NULL;
+	}
+	if(bounce_buf)
+	{  free(bounce_buf);  bounce_buf=NULL;  }
+}
+
+
+void FX2Pipe::_PushStdioBuf(TLSPSCRing<StdioBuf> *ring,sem_t *sem,
+	const StdioBuf &wb)
+{
+	// The rings can hold all pool buffers, so this should never have 
+	// to wait. Should it be full anyway, wait for the other side to 
+	// make room (it drains the ring even after an error): dropping 
+	// the buffer would lose its data and leak a pool slot. 
+	while(ring->push(wb))
+	{  sched_yield();  }
+	sem_post(sem);
+}
+
+
+char *FX2Pipe::_GetStdioBuf(size_t *len)
+{
+	// IN: Get a free buffer back from the writer. 
+	// OUT: Get a buffer filled by the reader. 
+	TLSPSCRing<StdioBuf> *ring = dir<0 ? free_ring : fill_ring;
+	sem_t *sem = dir<0 ? &free_sem : &fill_sem;
+	if(sem_trywait(sem))
+	{
+		// Writer is ring_size blocks behind / reader did not keep up. 
+		++stdio_stalls;
+		while(sem_wait(sem))
+		{
+			if(errno!=EINTR || caught_sigint)
+			{  return(NULL);  }
+		}
+	}
+	
+	StdioBuf wb;
+	int rv=ring->pop(&wb);
+	assert(!rv);
+	if(dir>0)
+	{
+		if(!wb.buf)
+		{  stdio_eof=1;  }
+		*len=wb.len;
+	}
+	return(wb.buf);
+}
+
+
+int FX2Pipe::_SetupOutput()
+{
+	out_mode=OMWrite;
+	out_fd=1;
+	if(out_path)
+	{  return(_OpenOutFile());  }
+	
+	struct stat st;
+	if(fstat(1,&st))  return(0);
+	if(S_ISFIFO(st.st_mode))
+	{
+		int sz=fcntl(1,F_GETPIPE_SZ);
+		if(sz>0)
+		{
+			long pagesize=sysconf(_SC_PAGESIZE);
+			pipe_pages=(sz+pagesize-1)/pagesize;
+			out_mode=OMVmsplice;
+		}
+	}
+	else if(S_ISREG(st.st_mode) && !(fcntl(1,F_GETFL) & O_APPEND))
+	{
+		// splice() does not work on files opened for appending. 
+		if(!pipe(out_pipe))
+		{  out_mode=OMSplice;  }
+	}
+	return(0);
+}
+
+
+int FX2Pipe::_OpenOutFile()
+{
+	direct_align=sysconf(_SC_PAGESIZE);
+	out_fd=open(out_path,O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,0666);
+	if(out_fd<0 && errno==EINVAL)
+	{
+		// File system without O_DIRECT support. 
+		direct_align=0;
+		out_fd=open(out_path,O_WRONLY | O_CREAT | O_TRUNC,0666);
+		if(out_fd>=0)
+		{  fprintf(stderr,"fx2pipe: no O_DIRECT support for \"%s\"; "
+			"dropping written data from page cache instead\n",out_path);  }
+	}
+	if(out_fd<0)
+	{
+		fprintf(stderr,"fx2pipe: cannot open \"%s\": %s\n",
+			out_path,strerror(errno));
+		out_fd=1;
+		return(1);
+	}
+	
+	// Write in batches of about 1 MByte. 
+	batch_max=(1<<20)/io_block_size;
+	if(batch_max<1)  batch_max=1;
+	if(batch_max>IOV_MAX)  batch_max=IOV_MAX;
+	batch_buf=new char*[batch_max];
+	batch_iov=new struct iovec[batch_max];
+	batch_n=0;
+	bounce_len=0;
+	out_off=0;
+	
+	out_mode=OMDirect;
+	return(0);
+}
+
+
+int FX2Pipe::_WriteHeader()
+{
+	// The format is that of decode6502's capture files (src/capture.h). 
+	// Only what we know is filled in, the pin mapping, cpu and machine 
+	// are left to the decoder's command line. For O_DIRECT, the header 
+	// is padded to keep the samples aligned. 
+	size_t len=CAPTURE_HEADER_SIZE;
+	if(out_mode==OMDirect && direct_align>len)
+	{  len=direct_align;  }
+	void *ptr=NULL;
+	if(posix_memalign(&ptr,direct_align ? direct_align : 16,len))
+	{
+		fprintf(stderr,"fx2pipe: header allocation failure\n");
+		return(1);
+	}
+	uchar *hdr=(uchar*)ptr;
+	memset(hdr,0,len);
+	memcpy(hdr,CAPTURE_MAGIC,CAPTURE_MAGIC_LEN);
+	hdr[CAPTURE_OFS_SIZE]=len&0xffU;
+	hdr[CAPTURE_OFS_SIZE+1]=(len>>8)&0xffU;
+	hdr[CAPTURE_OFS_VERSION]=CAPTURE_VERSION;
+	hdr[CAPTURE_OFS_WIDTH]=wide ? 32 : 16;
+	hdr[CAPTURE_OFS_ENCODING]=rle ? CAPTURE_ENC_RLE : CAPTURE_ENC_SAMPLES;
+	memset(hdr+CAPTURE_OFS_PINS,0xfe,CAPTURE_NUM_PINS);
+	hdr[CAPTURE_OFS_CPU]=0xffU;
+	hdr[CAPTURE_OFS_MACHINE]=0xffU;
+	for(int i=0; i<4; i++)
+	{  hdr[CAPTURE_OFS_RATE+i]=(sample_rate>>(8*i))&0xffU;  }
+	
+	int rv=0;
+	if(out_mode==OMDirect)
+	{
+		struct iovec iov={hdr,len};
+		rv=_DirectWritev(&iov,1);
+	}
+	else
+	{
+		for(size_t done=0; done<len && !rv; )
+		{
+			ssize_t wr=write(out_fd,hdr+done,len-done);
+			if(wr<0 && errno==EINTR)  continue;
+			if(wr<=0)
+			{
+				fprintf(stderr,"fx2pipe: write error: %s\n",
+					wr<0 ? strerror(errno) : "short write");
+				rv=1;
+			}
+			else
+			{  done+=wr;  }
+		}
+	}
+	free(ptr);
+	return(rv);
+}
+
+
+int FX2Pipe::_DirectWritev(struct iovec *iov,int n)
+{
+	int64 start=out_off;
+	int rv=0;
+	while(n)
+	{
+		ssize_t wr=writev(out_fd,iov,n);
+		if(wr<=0)
+		{
+			if(wr<0 && errno==EINTR)  continue;
+			fprintf(stderr,"fx2pipe: write error: %s\n",
+				wr<0 ? strerror(errno) : "short write");
+			rv=1;
+			break;
+		}
+		out_off+=wr;
+		
+		// Skip what got written. 
+		while(n && size_t(wr)>=iov->iov_len)
+		{  wr-=iov->iov_len;  ++iov;  --n;  }
+		if(n)
+		{
+			iov->iov_base=(char*)iov->iov_base+wr;
+			iov->iov_len-=wr;
+		}
+	}
+	
+	if(!direct_align && out_off>start)
+	{
+		// Without O_DIRECT, at least keep the page cache from filling up. 
+		sync_file_range(out_fd,start,out_off-start,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | 
+			SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(out_fd,start,out_off-start,POSIX_FADV_DONTNEED);
+	}
+	
+	return(rv);
+}
+
+
+int FX2Pipe::_DirectFlush()
+{
+	int rv=0;
+	if(batch_n)
+	{
+		rv=_DirectWritev(batch_iov,batch_n);
+		for(int i=0; i<batch_n; i++)
+		{  _ReleaseWriterBuf(batch_buf[i],-1);  }
+		batch_n=0;
+	}
+	return(rv);
+}
+
+
+int FX2Pipe::_DirectOut(char *buf,size_t len)
+{
+	int rv=0;
+	if(!bounce_buf && (!direct_align || !(len%direct_align)))
+	{
+		// Write straight from the (page-aligned) URB buffers. 
+		batch_buf[batch_n]=buf;
+		batch_iov[batch_n].iov_base=buf;
+		batch_iov[batch_n].iov_len=len;
+		if(++batch_n>=batch_max)
+		{  rv=_DirectFlush();  }
+		return(rv);
+	}
+	
+	// After a short block, the file offset is no longer aligned so 
+	// from now on we need to copy through an aligned bounce buffer. 
+	if(!bounce_buf)
+	{
+		rv=_DirectFlush();
+		bounce_size=(size_t(batch_max)*io_block_size+direct_align-1)/
+			direct_align*direct_align;
+		void *ptr=NULL;
+		if(posix_memalign(&ptr,direct_align,bounce_size))
+		{
+			fprintf(stderr,"fx2pipe: bounce buffer allocation failure\n");
+			_ReleaseWriterBuf(buf,-1);
+			return(1);
+		}
+		bounce_buf=(char*)ptr;
+		bounce_len=0;
+	}
+	
+	const char *src=buf;
+	while(len && !rv)
+	{
+		size_t n=bounce_size-bounce_len;
+		if(n>len)  n=len;
+		memcpy(bounce_buf+bounce_len,src,n);
+		bounce_len+=n;
+		src+=n;
+		len-=n;
+		if(bounce_len==bounce_size)
+		{
+			struct iovec iov={bounce_buf,bounce_len};
+			rv=_DirectWritev(&iov,1);
+			bounce_len=0;
+		}
+	}
+	_ReleaseWriterBuf(buf,-1);
+	return(rv);
+}
+
+
+int FX2Pipe::_DirectFinish()
+{
+	int rv=_DirectFlush();
+	if(bounce_len && !rv)
+	{
+		// Whole blocks still with O_DIRECT, the rest without. 
+		size_t whole=bounce_len/direct_align*direct_align;
+		struct iovec iov={bounce_buf,whole};
+		if(whole)
+		{  rv=_DirectWritev(&iov,1);  }
+		if(!rv && bounce_len>whole)
+		{
+			fcntl(out_fd,F_SETFL,fcntl(out_fd,F_GETFL) & ~O_DIRECT);
+			iov.iov_base=bounce_buf+whole;
+			iov.iov_len=bounce_len-whole;
+			rv=_DirectWritev(&iov,1);
+		}
+		bounce_len=0;
+	}
+	return(rv);
+}
+
+
+int FX2Pipe::_SpliceToFile(size_t len)
+{
+	while(len)
+	{
+		ssize_t sp=splice(out_pipe[0],NULL,1,NULL,len,SPLICE_F_MOVE);
+		if(sp>0)
+		{  len-=sp;  continue;  }
+		if(sp<0 && errno==EINTR)  continue;
+		if(sp<0 && errno!=EINVAL)
+		{
+			fprintf(stderr,"fx2pipe: write error: %s\n",strerror(errno));
+			return(1);
+		}
+		
+		// Not supported by the file system: Fall back to write() 
+		// for the rest, including what is still in the pipe. 
+		fprintf(stderr,"fx2pipe: cannot splice to stdout, using write()\n");
+		out_mode=OMWrite;
+		char tmp[4096];
+		while(len)
+		{
+			ssize_t rd=read(out_pipe[0],tmp,len<sizeof(tmp) ? len : sizeof(tmp));
+			if(rd<0 && errno==EINTR)  continue;
+			if(rd<=0)  return(1);
+			len-=rd;
+			struct iovec iov={tmp,size_t(rd)};
+			if(_WriteOut(&iov,1))  return(1);
+		}
+	}
+	return(0);
+}
+
+
+int FX2Pipe::_WriteOut(struct iovec *iov,int n)
+{
+	long pagesize=sysconf(_SC_PAGESIZE);
+	while(n)
+	{
+		// Skip buffers already written (and empty ones). 
+		if(!iov->iov_len)
+		{  ++iov;  --n;  continue;  }
+		
+		int niov = n<IOV_MAX ? n : IOV_MAX;
+		ssize_t wr;
+		if(out_mode==OMWrite)
+		{  wr=writev(1,iov,niov);  }
+		else
+		{
+			// Map the pages into the pipe instead of copying them. 
+			// No SPLICE_F_GIFT: The buffers are reused, so they stay 
+			// ours and are only held until the reader consumed them. 
+			wr=vmsplice(out_mode==OMSplice ? out_pipe[1] : 1,iov,niov,0);
+			if(wr<0 && (errno==EFAULT || errno==EINVAL))
+			{
+				// Should not happen with heap buffers; fall back quietly. 
+				out_mode=OMWrite;
+				continue;
+			}
+			if(wr>0 && out_mode==OMSplice && _SpliceToFile(wr))
+			{  return(1);  }
+		}
+		
+		if(wr>0)
+		{
+			// Count the pipe slots (pages) used up. For write(), the 
+			// data may be merged into a partial page. 
+			if(out_mode!=OMVmsplice)
+			{  spliced_pages+=wr/pagesize;  }
+			while(wr)
+			{
+				size_t done = size_t(wr)<iov->iov_len ? wr : iov->iov_len;
+				char *buf=(char*)iov->iov_base;
+				if(out_mode==OMVmsplice)
+				{  spliced_pages+=((unsigned long)buf+done+pagesize-1)/pagesize - 
+					(unsigned long)buf/pagesize;  }
+				iov->iov_base=buf+done;
+				iov->iov_len-=done;
+				wr-=done;
+				if(!iov->iov_len)
+				{  ++iov;  --n;  }
+			}
+		}
+		else if(wr<0)
+		{
+			if(errno==EINTR)
+			{
+				// Only the reaping thread (synchronous stdio) gets SIGINT. 
+				if(caught_sigint)  return(2);
+				continue;
+			}
+			if(errno==EAGAIN)  continue;  // <-- SHOULD NOT HAPPEN!
+			fprintf(stderr,"fx2pipe: write error: %s\n",
+				strerror(errno));
+			return(1);
+		}
+		else if(!wr)
+		{
+			fprintf(stderr,"fx2pipe: EOF on stdout\n");
+			return(2);
+		}
+	}
+	return(0);
+}
+
+
+void FX2Pipe::_ReleaseWriterBuf(char *buf,int64 spliced_end)
+{
+	if(spliced_end>=0 && out_mode==OMVmsplice && !stdio_error)
+	{
+		// The pipe references the buffer pages until they are read; 
+		// that is certainly done once pipe_pages more pages went in. 
+		held_buf[held_put]=buf;
+		held_end[held_put]=spliced_end;
+		if(++held_put>=held_size)  held_put=0;
+		buf=NULL;
+	}
+	
+	while(held_get!=held_put && 
+		(stdio_error || spliced_pages-held_end[held_get]>=pipe_pages))
+	{
+		StdioBuf wb={held_buf[held_get],0};
+		if(++held_get>=held_size)  held_get=0;
+		_PushStdioBuf(free_ring,&free_sem,wb);
+	}
+	
+	if(buf)
+	{
+		StdioBuf wb={buf,0};
+		_PushStdioBuf(free_ring,&free_sem,wb);
+	}
+}
+
+
+void FX2Pipe::_WriterLoop()
+{
+	// Buffers written together using one writev()/vmsplice(). 
+	StdioBuf wbs[WriterBatchMax];
+	struct iovec iov[WriterBatchMax];
+	
+	bool done=0;
+	while(!done)
+	{
+		while(sem_wait(&fill_sem) && errno==EINTR);
+		
+		// Collect what is queued up to now. 
+		int n=0;
+		for(;;)
+		{
+			StdioBuf wb;
+			int rv=fill_ring->pop(&wb);
+			assert(!rv);
+			if(!wb.buf)
+			{  done=1;  break;  }
+			
+			if(out_mode==OMDirect)
+			{
+				// _DirectOut() batches itself and takes care of giving 
+				// back the buffer. 
+				if(wb.len && !stdio_error)
+				{  stdio_error=_DirectOut(wb.buf,wb.len);  }
+				else
+				{  _ReleaseWriterBuf(wb.buf,-1);  }
+			}
+			else
+			{
+				wbs[n]=wb;
+				iov[n].iov_base=wb.buf;
+				iov[n].iov_len=wb.len;
+				++n;
+			}
+			
+			if(n>=WriterBatchMax || sem_trywait(&fill_sem))
+			{  break;  }
+		}
+		
+		// After an error, just give back the buffers. 
+		int64 spliced_end=spliced_pages;
+		if(n && !stdio_error)
+		{  stdio_error=_WriteOut(iov,n);  }
+		
+		// Each buffer can be reused once pipe_pages pages after its 
+		// own end went into the pipe, not only after the whole batch. 
+		long pagesize=sysconf(_SC_PAGESIZE);
+		for(int i=0; i<n; i++)
+		{
+			unsigned long start=(unsigned long)wbs[i].buf;
+			spliced_end+=(start+wbs[i].len+pagesize-1)/pagesize - 
+				start/pagesize;
+			_ReleaseWriterBuf(wbs[i].buf,wbs[i].len ? spliced_end : -1);
+		}
+	}
+	
+	if(out_mode==OMDirect && !stdio_error)
+	{  stdio_error=_DirectFinish();  }
+}
+
+
+void *FX2Pipe::_WriterThread(void *arg)
+{
+	((FX2Pipe*)arg)->_WriterLoop();
+	return(NULL);
+}
+
+
+size_t FX2Pipe::_ReadIn(char *buf,size_t len)
+{
+	size_t got=0;
+	while(got<len && !stdio_stop)
+	{
+		// Wait for data but keep an eye on the stop pipe. 
+		struct pollfd pfd[2];
+		pfd[0].fd=0;             pfd[0].events=POLLIN;  pfd[0].revents=0;
+		pfd[1].fd=stop_pipe[0];  pfd[1].events=POLLIN;  pfd[1].revents=0;
+		if(poll(pfd,2,-1)<0)
+		{
+			if(errno==EINTR)  continue;
+			break;
+		}
+		if(pfd[1].revents)  break;
+		
+		ssize_t rd=read(0,buf+got,len-got);
+		if(rd>0)
+		{  got+=rd;  }
+		else if(rd<0)
+		{
+			if(errno==EINTR)  continue;
+			if(errno==EAGAIN)  continue;  // <-- SHOULD NOT HAPPEN!
+			fprintf(stderr,"fx2pipe: read error: %s\n",
+				strerror(errno));
+			stdio_error=1;
+			break;
+		}
+		else
+		{  break;  }  // EOF
+	}
+	return(got);
+}
+
+
+void FX2Pipe::_ReaderLoop()
+{
+	int64 total=0;
+	for(;;)
+	{
+		while(sem_wait(&free_sem) && errno==EINTR);
+		if(stdio_stop)  break;
+		
+		StdioBuf wb;
+		int rv=free_ring->pop(&wb);
+		assert(!rv);
+		
+		// Do not read beyond the transfer limit. 
+		size_t want=io_block_size;
+		if(transfer_limit>=0 && transfer_limit-total<int64(want))
+		{  want=transfer_limit-total;  }
+		
+		wb.len=_ReadIn(wb.buf,want);
+		total+=wb.len;
+		if(stdio_stop)  break;
+		if(wb.len)
+		{
+			_PushStdioBuf(fill_ring,&fill_sem,wb);
+		}
+		if(wb.len<io_block_size)
+		{
+			// EOF, error or transfer limit reached. 
+			wb.buf=NULL;
+			wb.len=0;
+			_PushStdioBuf(fill_ring,&fill_sem,wb);
+			break;
+		}
+	}
+}
+
+
+void *FX2Pipe::_ReaderThread(void *arg)
+{
+	((FX2Pipe*)arg)->_ReaderLoop();
+	return(NULL);
+}
+
+
 void FX2Pipe::_DisplayTransferStatistics(const timeval *endtime,int final)
 {
 	long long msec = 
@@ -254,8 +1224,92 @@ int FX2Pipe::run()
 	if(_ConnectAndInitUSB())
 	{  ++x_errors;  return(1);  }
 	
-	if(_SubmitInitialURBs())
+	// Allocate all data buffers up front. One more than the pipeline 
+	// size as a spare (URBs are resubmitted only after the reaped ones 
+	// got deleted). 
+	// Prefer usbfs memory so that the kernel does not copy the data. 
+	int use_stdio_thread=(!no_stdio && !data_sink && 
+		(ring_size>0 || out_path));
+	// ps=auto and bs=auto need buffers for the largest settings. 
+	int max_ps = auto_pipeline ? AutoPipelineMax : pipeline_size;
+	uint max_bs = auto_block_size ? AutoBlockSizeMax : io_block_size;
+	// -R encodes each block in place, which may double it. 
+	uint buf_size = rle ? 2*max_bs : max_bs;
+	int nbufs=max_ps+1;
+	if(use_stdio_thread && dir>0)
+	{  nbufs+=ring_size;  }
+	else if(use_stdio_thread)
+	{
+		if(_SetupOutput())
+		{  ++x_errors;  return(1);  }
+		nbufs+=ring_size;
+		// Buffers are written in batches. 
+		if(out_mode==OMDirect)
+		{  nbufs+=batch_max;  }
+		// Buffers spliced into a pipe cannot be reused immediately. 
+		if(out_mode==OMVmsplice)
+		{
+			long pagesize=sysconf(_SC_PAGESIZE);
+			int buf_pages=(buf_size+pagesize-1)/pagesize;
+			nbufs+=pipe_pages/buf_pages+2;
+		}
+	}
+	// O_DIRECT cannot write from usbfs mapped memory (EFAULT). 
+	bool map_bufs = !(out_mode==OMDirect && direct_align);
+	if(buf_pool.alloc(nbufs,buf_size,map_bufs ? this : NULL))
 	{  ++x_errors;  return(1);  }
+	fprintf(stderr,"Using %d %s URB buffers\n",buf_pool.size(),
+		buf_pool.IsMapped() ? "usbfs mapped (zero-copy)" : "heap");
+	// Either way one copy is saved on the way into stdout: usbfs mapped 
+	// buffers save the kernel's copy from the URB into our buffer (and 
+	// are written with write()), heap buffers save write()'s copy into 
+	// the pipe (vmsplice()). vmsplice() cannot take the usbfs (PFN) 
+	// pages, so only use it with heap buffers. 
+	if(buf_pool.IsMapped() && (out_mode==OMVmsplice || out_mode==OMSplice))
+	{  out_mode=OMWrite;  }
+
+	// -W needs firmware which sets up EP2 as IN for config 0x16. Older
+	// firmware idles on it without publishing the status magic, and
+	// the EP2 URBs would never complete. (No firmware when simulating.)
+	if(wide && !sim_path)
+	{
+		uchar st[4];
+		if(ReadRAM(FirmwareStatusAdr,st,sizeof(st)) ||
+		   st[0]!=FirmwareStatusMagic)
+		{
+			fprintf(stderr,"fx2pipe: -W needs firmware supporting 32 bit "
+				"samples: build fx2pipe/firmware and load it with -fw=PATH\n");
+			++x_errors;  return(1);
+		}
+	}
+
+	if(header && dir<0 && !data_sink && _WriteHeader())
+	{  ++x_errors;  return(1);  }
+	if(use_stdio_thread && _StartStdioThread())
+	{  ++x_errors;  return(1);  }
+	if(dir<0 && !use_stdio_thread && !no_stdio && !data_sink)
+	{
+		// Synchronous stdio: up to one pipeline of reaped buffers. 
+		reap_buf=new char*[max_ps];
+		reap_iov=new struct iovec[max_ps];
+	}
+	if(wide)
+	{
+		// A pair is in use while one of its URBs is pending. 
+		wide_npairs=max_ps+2;
+		wide_pairs=new WidePair[wide_npairs];
+		memset(wide_pairs,0,wide_npairs*sizeof(WidePair));
+		wide_tmp=new char[max_bs];
+	}
+	if(rle)
+	{  rle_tmp=new char[buf_size];  }
+	
+	// Take the overflow counter baseline before the data starts. 
+	if(dir<0)
+	{  _StartGapDetection();  }
+	
+	if(_SubmitInitialURBs())
+	{  ++x_errors;  _StopGapDetection();  return(1);  }
 	
 	// Set scheduler. 
 	if(schedule_policy!=SCHED_OTHER)
@@ -273,6 +1327,21 @@ int FX2Pipe::run()
 		}
 	}
 	
+	// Update the status display 4 times a second from the event loop. 
+	stats_fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+	if(stats_fd>=0)
+	{
+		struct itimerspec its;
+		its.it_interval.tv_sec=0;
+		its.it_interval.tv_nsec=250000000;
+		its.it_value=its.it_interval;
+		if(timerfd_settime(stats_fd,0,&its,NULL) || 
+		   AddPollFD(stats_fd,EPOLLIN))
+		{  close(stats_fd);  stats_fd=-1;  }
+	}
+	if(stats_fd<0)
+	{  fprintf(stderr,"fx2pipe: no status display: %s\n",strerror(errno));  }
+	
 	int must_break_loop=0;  // 2 -> disconnect or other severe error.
 	while(!must_break_loop)
 	{
@@ -280,6 +1349,7 @@ int FX2Pipe::run()
 		switch(ec)
 		{
 			case ECTimeout:
+			case ECInterrupted:
 				break;
 			case ECUserQuit:
 				must_break_loop=1;
@@ -330,9 +1400,40 @@ int FX2Pipe::run()
 	
 	fprintf(stderr,"IO loop exited\n");
 	
+	// Data of the last batch if the loop was left in the middle of it. 
+	_WriteReaped();
+	
+	_StopGapDetection();
+	
+	if(stats_fd>=0)
+	{
+		RemovePollFD(stats_fd);
+		close(stats_fd);  stats_fd=-1;
+	}
 	_CleanupUSB();
+	_StopStdioThread();
+	if(reap_buf)
+	{
+		delete[] reap_buf;  reap_buf=NULL;
+		delete[] reap_iov;  reap_iov=NULL;
+	}
+	if(wide_pairs)
+	{
+		delete[] wide_pairs;  wide_pairs=NULL;
+		delete[] wide_tmp;  wide_tmp=NULL;
+	}
+	if(rle_tmp)
+	{  delete[] rle_tmp;  rle_tmp=NULL;  }
+	buf_pool.release();
 	
 	_DisplayTransferStatistics(&endtime,1);
+	if(rle)
+	{  fprintf(stderr,"fx2pipe: run-length encoded to %lld bytes (%.1f%%)\n",
+		(long long)rle_bytes,
+		transferred_bytes ? 100.0*rle_bytes/transferred_bytes : 0.0);  }
+	if(auto_pipeline || auto_block_size)
+	{  fprintf(stderr,"fx2pipe: auto settings: ps=%d bs=%u\n",
+		pipeline_size,io_block_size);  }
 	
 	return(x_errors ? 1 : 0);
 }
@@ -355,6 +1456,9 @@ WWUSBDevice::ErrorCode FX2Pipe::URBNotify(URB *_u)
 	if(u->cancelled)
 	{  return(ECSuccess);  }
 	
+	if(u->status)
+	{  ++auto_errors;  }
+	
 	if(u->status==-EPROTO)
 	{
 		if(++successive_error_urbs>pipeline_size+4)
@@ -373,47 +1477,17 @@ WWUSBDevice::ErrorCode FX2Pipe::URBNotify(URB *_u)
 	{
 		if(dir<0)  // Read in from USB. 
 		{
-			// In benchmarking mode, don't do anything actually. 
-			// Otherwise, write to stdout. 
-			if(no_stdio)
-			{
-				//slurped_bytes+=u->actual_length;
-				transferred_bytes+=u->actual_length;
-			}
+			ErrorCode ec;
+			if(u->wide_slot>=0)
+			{  ec=_WideReaped(u);  }
 			else
 			{
-				const char *raw_buf = (const char*)u->buffer;
-				size_t raw_size = u->actual_length;
-				
-				//slurped_bytes+=u->actual_length;
-				
-				while(raw_size && !caught_sigint)
-				{
-					ssize_t wr=write(1,raw_buf,raw_size);
-					if(wr>0)
-					{
-						assert(size_t(wr)<=raw_size);
-						raw_size-=wr;
-						raw_buf+=wr;
-						
-						transferred_bytes+=wr;
-					}
-					else if(wr<0)
-					{
-						if(errno==EINTR)  continue;
-						if(errno==EAGAIN)  continue;  // <-- SHOULD NOT HAPPEN!
-						fprintf(stderr,"fx2pipe: write error: %s\n",
-							strerror(errno));
-						++x_errors;
-						return(ECUserQuit);
-					}
-					else if(!wr)
-					{
-						fprintf(stderr,"fx2pipe: EOF on stdout\n");
-						return(ECUserQuit);
-					}
-				}
+				char *buf=(char*)u->buffer;
+				u->buffer=NULL;
+				ec=_DeliverIn(buf,u->actual_length);
 			}
+			if(ec)
+			{  return(ec);  }
 		}
 		else //if(dir>0)  // Write out to USB. 
 		{
@@ -424,24 +1498,214 @@ WWUSBDevice::ErrorCode FX2Pipe::URBNotify(URB *_u)
 		//write(2,".",1);
 	}
 	
+	if(caught_sigint)
+	{  return(ECUserQuit);  }
+	
+	// For each reaped URB, we submit a new one to keep things running; 
+	// done for the complete batch in URBBatchNotify(). 
+	++batch_reaped;
+	
+	return(ECSuccess);
+}
+
+
+// Encode the n samples at in as (sample, run length - 1) pairs of the 
+// same type at out. Runs longer than the type can count are split. 
+template<typename T>static size_t RLEncodeSamples(const T *in,size_t n,T *out)
+{
+	const size_t max_run=size_t(T(~T(0)))+1;
+	const T *end=in+n;
+	T *o=out;
+	while(in<end)
+	{
+		T s=*in;
+		const T *run=in++;
+		const T *run_end=size_t(end-run)>max_run ? run+max_run : end;
+		while(in<run_end && *in==s)  ++in;
+		*o++=s;
+		*o++=T(in-run-1);
+	}
+	return((o-out)*sizeof(T));
+}
+
+
+size_t FX2Pipe::_RLEncode(char *buf,size_t len)
+{
+	// Blocks are encoded independently, so a run spanning two blocks 
+	// comes out as two runs. 
+	size_t olen;
+	if(wide)
+	{  olen=RLEncodeSamples((const uint32*)buf,len/4,(uint32*)rle_tmp);  }
+	else
+	{  olen=RLEncodeSamples((const uint16*)buf,len/2,(uint16*)rle_tmp);  }
+	memcpy(buf,rle_tmp,olen);
+	rle_bytes+=olen;
+	return(olen);
+}
+
+
+WWUSBDevice::ErrorCode FX2Pipe::_DeliverIn(char *buf,size_t len)
+{
+	// Statistics and gap offsets count the samples as read from USB. 
+	size_t raw_len=len;
+	if(rle)
+	{  len=_RLEncode(buf,len);  }
+	
+	// In benchmarking mode, don't do anything actually. 
+	// Otherwise, write to stdout. 
+	if(no_stdio)
+	{
+		//slurped_bytes+=len;
+		transferred_bytes+=raw_len;
+		buf_pool.put(buf);
+	}
+	else if(data_sink)
+	{
+		// In-process consumer: hand over the URB buffer in place. 
+		int rv=data_sink(data_sink_user,buf,len);
+		buf_pool.put(buf);
+		if(rv)
+		{  return(ECUserQuit);  }
+		transferred_bytes+=raw_len;
+	}
+	else if(fill_ring)
 	{
+		// Hand the buffer over to the writer thread which gives 
+		// it back via free_ring once written (or right away after 
+		// an error). 
+		StdioBuf wb={buf,stdio_error ? 0 : len};
+		_PushStdioBuf(fill_ring,&fill_sem,wb);
+		if(stdio_error)
+		{  return(ECUserQuit);  }
+		transferred_bytes+=raw_len;
+	}
+	else
+	{
+		// Written out with the rest of the batch in 
+		// URBBatchNotify(). 
+		reap_buf[reap_n]=buf;
+		reap_iov[reap_n].iov_base=buf;
+		reap_iov[reap_n].iov_len=len;
+		++reap_n;
+		reap_bytes+=raw_len;
+	}
+	
+	return(ECSuccess);
+}
+
+
+WWUSBDevice::ErrorCode FX2Pipe::_WideReaped(MyURB *u)
+{
+	WidePair *p=&wide_pairs[u->wide_slot];
+	p->len[u->endpoint==0x82U ? 1 : 0]=u->actual_length;
+	if(p->len[0]<0 || p->len[1]<0)
+	{  return(ECSuccess);  }
+	
+	// Both halves are in. The URB deleted last gives back the buffer 
+	// unless we hand it on. 
+	if(p->len[0]!=p->len[1])
+	{
+		// Short packet on one endpoint only: From here on, the words 
+		// no longer pair up. 
+		fprintf(stderr,"fx2pipe: got %d bytes from EP6 but %d from EP2; "
+			"samples out of step\n",p->len[0],p->len[1]);
+		return(ECUserQuitFatal);
+	}
+	
+	// Sample i is EP6 word i (low) followed by EP2 word i (high). 
+	char *buf=p->buf;
+	size_t nwords=p->len[0]/2;
+	const uint16 *lo=(const uint16*)buf;
+	const uint16 *hi=(const uint16*)(buf+p->half);
+	uint16 *out=(uint16*)wide_tmp;
+	for(size_t i=0; i<nwords; i++)
+	{
+		out[2*i]=lo[i];
+		out[2*i+1]=hi[i];
+	}
+	memcpy(buf,wide_tmp,nwords*4);
+	
+	p->buf=NULL;
+	return(_DeliverIn(buf,nwords*4));
+}
+
+
+int FX2Pipe::_WriteReaped()
+{
+	if(!reap_n)
+	{  return(0);  }
+	
+	int rv=_WriteOut(reap_iov,reap_n);
+	if(!rv)
+	{  transferred_bytes+=reap_bytes;  }
+	else if(rv==1)
+	{  ++x_errors;  }
+	
+	for(int i=0; i<reap_n; i++)
+	{  buf_pool.put(reap_buf[i]);  }
+	reap_n=0;
+	reap_bytes=0;
+	
+	return(rv);
+}
+
+
+WWUSBDevice::ErrorCode FX2Pipe::URBBatchNotify()
+{
+	// For ps=auto/bs=auto: See how far reaping lagged behind. If no 
+	// URB was left pending, the device possibly had to wait for us. 
+	if(batch_reaped>auto_max_batch)
+	{  auto_max_batch=batch_reaped;  }
+	if(batch_reaped && !npending)
+	{  ++auto_drained;  }
+	batch_reaped=0;
+	
+	if(_WriteReaped())
+	{  return(ECUserQuit);  }
+	
+	// Refill the pipeline. The reaped URBs are deleted by now, so their 
+	// buffers are available again. 
+	if(_FillPipeline())
+	{  return(ECUserQuit);  }
+	
+	return(ECSuccess);
+}
+
+
+WWUSBDevice::ErrorCode FX2Pipe::FDNotify(int fd,unsigned int)
+{
+	if(fd==stats_fd)
+	{
+		uint64 expirations;
+		while(read(stats_fd,&expirations,sizeof(expirations))<0 && 
+			errno==EINTR);
+		
 		timeval curr_time;
 		gettimeofday(&curr_time,NULL);
-		long msec = 1000L*(curr_time.tv_sec-last_update_time.tv_sec) + 
-			(curr_time.tv_usec-last_update_time.tv_usec+500)/1000;
-		if(msec>250)
+		_DisplayTransferStatistics(&curr_time,0);
+		last_update_time=curr_time;
+		last_update_transferred=transferred_bytes;
+		
+		if(auto_pipeline || auto_block_size)
 		{
-			_DisplayTransferStatistics(&curr_time,0);
-			last_update_time=curr_time;
-			last_update_transferred=transferred_bytes;
+			_AutoTune();
+			// Get a grown pipeline going right away. 
+			if(_FillPipeline())
+			{  return(ECUserQuit);  }
 		}
 	}
 	
-	if(caught_sigint)
-	{  return(ECUserQuit);  }
+	else if(fd==gap_fd)
+	{
+		uint64 expirations;
+		while(read(gap_fd,&expirations,sizeof(expirations))<0 && 
+			errno==EINTR);
+		_PollGaps();
+	}
 	
-	// For each reaped URB, we submit a new one to keep things running. 
-	if(_SubmitOneURB())
+	// Also catches a SIGINT which came in just before ProcessEvents() 
+	// started waiting. 
+	if(caught_sigint)
 	{  return(ECUserQuit);  }
 	
 	return(ECSuccess);
@@ -451,6 +1715,34 @@ WWUSBDevice::ErrorCode FX2Pipe::URBNotify(URB *_u)
 void FX2Pipe::DeleteURB(URB *_u)
 {
 	MyURB *u=static_cast<MyURB*>(_u);
+	if(u->wide_slot>=0)
+	{
+		// -W: The buffer belongs to the pair. The last URB of it gives 
+		// it back if it was not handed on. 
+		WidePair *p=&wide_pairs[u->wide_slot];
+		u->buffer = --p->refs ? NULL : p->buf;
+		if(!p->refs)
+		{  p->buf=NULL;  }
+	}
+	if(fill_ring && u->buffer && dir>0)
+	{
+		// Give the buffer back to the reader to fill it again. 
+		StdioBuf wb={(char*)u->buffer,0};
+		u->buffer=NULL;
+		_PushStdioBuf(free_ring,&free_sem,wb);
+	}
+	else if(fill_ring && u->buffer)
+	{
+		// Pool buffer: Give it back via the writer. 
+		StdioBuf wb={(char*)u->buffer,0};
+		u->buffer=NULL;
+		_PushStdioBuf(fill_ring,&fill_sem,wb);
+	}
+	else if(u->buffer)
+	{
+		buf_pool.put(u->buffer);
+		u->buffer=NULL;
+	}
 	delete u;
 }
 
@@ -462,49 +1754,102 @@ FX2Pipe::FX2Pipe() :
 	//slurped_bytes(0),
 	submitted_bytes(0),
 	last_update_transferred(0),
+	stats_fd(-1),
 	transferred_bytes(0),
+	rle_bytes(0),
 	stdio_eof(0),
+	batch_reaped(0),
+	reap_buf(NULL),
+	reap_iov(NULL),
+	reap_n(0),
+	reap_bytes(0),
+	fill_ring(NULL),
+	free_ring(NULL),
+	stdio_error(0),
+	stdio_stop(0),
+	stdio_stalls(0),
+	out_mode(OMWrite),
+	out_fd(1),
+	pipe_pages(0),
+	spliced_pages(0),
+	held_buf(NULL),
+	held_end(NULL),
+	held_get(0),
+	held_put(0),
+	held_size(0),
+	batch_buf(NULL),
+	batch_iov(NULL),
+	batch_n(0),
+	batch_max(0),
+	direct_align(0),
+	bounce_buf(NULL),
+	bounce_len(0),
+	bounce_size(0),
+	out_off(0),
+	auto_drained(0),
+	auto_max_batch(0),
+	auto_errors(0),
+	auto_calm(0),
+	auto_last_stalls(0),
+	auto_floor_ps(AutoPipelineMin),
+	auto_floor_bs(AutoBlockSizeMin),
+	gap_fd(-1),
+	gap_last_count(0),
+	gap_lo(0),
+	gap_events(0),
+	gaps_file(NULL),
+	wide_pairs(NULL),
+	wide_npairs(0),
+	wide_tmp(NULL),
+	rle_tmp(NULL),
 	n_th_usb_dev(0),
 	search_vid(-1),
 	search_pid(-1),
 	transfer_limit(-1),
 	io_block_size(16384),
 	pipeline_size(16),
+	auto_pipeline(0),
+	auto_block_size(0),
+	ring_size(64),
 	dir(-1),
+	wide(0),
+	rle(0),
+	header(0),
+	sample_rate(0),
 	no_stdio(0),
 	schedule_policy(SCHED_OTHER),
 	schedule_priority(0),
-	firmware_hex_path(NULL)
+	firmware_hex_path(NULL),
+	sim_path(NULL),
+	out_path(NULL),
+	data_sink(NULL),
+	data_sink_user(NULL),
+	gaps_path(NULL),
+	gap_sink(NULL)
 {
 	memset(&starttime,0,sizeof(starttime));
 	memset(&endtime,0,sizeof(endtime));
 	memset(&last_update_time,0,sizeof(last_update_time));
+	out_pipe[0]=out_pipe[1]=-1;
+	stop_pipe[0]=stop_pipe[1]=-1;
 }
 
 FX2Pipe::~FX2Pipe()
 {
 	_CleanupUSB();
+	_StopStdioThread();
 }
 
 //------------------------------------------------------------------------------
 
-void FX2Pipe::MyURB::AllocBuffer(size_t size)
-{
-	buffer=malloc(size);
-	if(!buffer)
-	{  fprintf(stderr,"URB buffer allocation failure (%u bytes)\n",size);
-		abort();  }
-	buffer_length=size;
-}
-
 FX2Pipe::MyURB::MyURB(uchar dir_ep,uchar _type) : 
-	FX2USBDevice::URB(dir_ep,_type)
+	FX2USBDevice::URB(dir_ep,_type),
+	wide_slot(-1)
 {
 }
 
 FX2Pipe::MyURB::~MyURB()
 {
-	if(buffer)
-	{  free(buffer);  buffer=NULL;  }
+	// The buffer belongs to buf_pool and was detached in DeleteURB(). 
 }
 
@@ -19,13 +19,17 @@
 
 #include "../oconfig.h"
 #include "../lib/linkedlist.h"
+#include "../lib/spscring.h"
 #include "../usb_io/fx2usb.h"
 #include "../usb_io/urbcache.h"
+#include "../usb_io/bufpool.h"
 
 #include <sys/time.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 
-// This is defined somewhere in main.cc
+// This is defined somewhere in main.cc (or fx2capture.cc for in-process use)
 extern volatile int caught_sigint;
 // Builtin firmware from ../firmware/fx2pipe_static.cc: 
 extern const char *fx2pipe_static_firmware[];
@@ -35,6 +39,11 @@ extern const char *fx2pipe_static_firmware[];
  * \author Wolfgang Wieser ] wwieser (a) gmx <*> de [
  * 
  * Not C++-safe. Not thread-safe. 
+ * 
+ * Reaped IN data is written to stdout by a separate writer thread 
+ * and OUT data is read ahead from stdin by a separate reader thread 
+ * (see ring_size) so that slow stdio does not hold up reaping and 
+ * resubmission of URBs. 
  */
 class FX2Pipe : public FX2USBDevice
 {
@@ -45,8 +54,9 @@ class FX2Pipe : public FX2USBDevice
 			/// URB cache against allocation overhead. 
 			static URBCache urb_cache;
 			
-			/// Allocate buffer and attach it. Must be done before submission. 
-			void AllocBuffer(size_t size);
+			/// -W: Index in wide_pairs of the block this URB reads one 
+			/// half of; -1 for normal URBs. 
+			int wide_slot;
 			
 			MyURB(uchar dir_ep,uchar _type=USBDEVFS_URB_TYPE_BULK);
 			~MyURB();
@@ -76,6 +86,9 @@ class FX2Pipe : public FX2USBDevice
 		timeval last_update_time;
 		/// Number of bytes transferred at last update. 
 		int64 last_update_transferred;
+		/// timerfd triggering the status display update from the 
+		/// event loop; -1 if none. 
+		int stats_fd;
 		
 		/// Submitted bytes: Number of bytes submitted but not all of them 
 		/// are yet transferred. 
@@ -83,10 +96,156 @@ class FX2Pipe : public FX2USBDevice
 		/// Transferred bytes: 
 		/// Number of bytes successfully transferred. 
 		int64 transferred_bytes;
+		/// -R: Number of run-length encoded bytes passed on. 
+		int64 rle_bytes;
 		
 		/// EOF on stdio (1) or transfer limit reached (2). 
 		int stdio_eof;
 		
+		/// Data buffers for all URBs (and the stdio thread). 
+		URBBufferPool buf_pool;
+		
+		/// Number of URBs reaped in the current batch. 
+		int batch_reaped;
+		/// Without stdio thread: Buffers of the current batch of reaped 
+		/// IN URBs, written out together in URBBatchNotify(). 
+		char **reap_buf;
+		struct iovec *reap_iov;
+		int reap_n;
+		/// Number of bytes read from USB for the reap_buf batch. 
+		int64 reap_bytes;
+		
+		/// Buffer passed between reaping thread and stdio thread. 
+		struct StdioBuf
+		{
+			char *buf;    ///< Buffer from buf_pool; NULL to stop the writer 
+			              ///< or to signal EOF on stdin. 
+			size_t len;   ///< Number of data bytes; may be 0. 
+		};
+		/// Buffers filled with data: reaping thread -> writer thread (IN) 
+		/// or reader thread -> reaping thread (OUT). 
+		/// NULL if no stdio thread is used. 
+		TLSPSCRing<StdioBuf> *fill_ring;
+		/// Free buffers: the other way round. 
+		TLSPSCRing<StdioBuf> *free_ring;
+		/// Semaphores counting the entries in fill_ring and free_ring. 
+		sem_t fill_sem,free_sem;
+		/// The stdio thread (valid if fill_ring is set). 
+		pthread_t stdio_thread;
+		/// Set by the stdio thread on I/O error (1) or EOF on stdout (2). 
+		volatile int stdio_error;
+		/// Set to make the reader thread quit. 
+		volatile int stdio_stop;
+		/// Pipe to wake up the reader thread for stdio_stop. 
+		int stop_pipe[2];
+		/// Number of times the reaping thread had to wait for the 
+		/// stdio thread. 
+		int stdio_stalls;
+		
+		/// How the writer thread outputs the data. 
+		enum OutMode
+		{
+			OMWrite=0,   ///< Plain write() loop. 
+			OMVmsplice,  ///< stdout is a pipe: vmsplice() the buffers. 
+			OMSplice,    ///< stdout is a file: vmsplice() into out_pipe, 
+			             ///< then splice() on into the file. 
+			             ///< (Both only with heap buffers.) 
+			OMDirect     ///< Output file out_path: batched O_DIRECT writes. 
+		} out_mode;
+		/// File descriptor written to: 1 (stdout) or the out_path file. 
+		int out_fd;
+		/// Private pipe for OMSplice. 
+		int out_pipe[2];
+		/// OMVmsplice: Capacity of the stdout pipe in pages. 
+		int pipe_pages;
+		/// OMVmsplice: Total number of pages put into the stdout pipe. 
+		int64 spliced_pages;
+		/// OMVmsplice: Queue of buffers possibly still referenced by the 
+		/// stdout pipe (with spliced_pages after each of them). 
+		char **held_buf;
+		int64 *held_end;
+		int held_get,held_put,held_size;
+		
+		/// OMDirect: Buffers collected for the next writev(). 
+		char **batch_buf;
+		struct iovec *batch_iov;
+		int batch_n,batch_max;
+		/// OMDirect: Alignment (bytes) required for O_DIRECT; 0 if the 
+		/// file system does not support O_DIRECT. 
+		size_t direct_align;
+		/// OMDirect: Bounce buffer used once a block with a length which 
+		/// is not a multiple of direct_align came in; NULL until then. 
+		char *bounce_buf;
+		size_t bounce_len,bounce_size;
+		/// OMDirect: Current output file offset. 
+		int64 out_off;
+
+		/// ps=auto/bs=auto (see _AutoTune()): Batches reaped in the 
+		/// current interval which found the whole pipeline completed, 
+		/// i.e. the device may have run out of URBs. 
+		int auto_drained;
+		/// Largest batch reaped in the current interval. 
+		int auto_max_batch;
+		/// Number of reaped URBs with errors in the current interval. 
+		int auto_errors;
+		/// Number of intervals in a row with plenty of headroom. 
+		int auto_calm;
+		/// Value of stdio_stalls at the end of the last interval. 
+		int auto_last_stalls;
+		/// Settings which turned out to be needed; never shrink below. 
+		int auto_floor_ps;
+		uint auto_floor_bs;
+		
+		/// Bounds for ps=auto and bs=auto. 
+		static const int AutoPipelineMin=4,AutoPipelineMax=64;
+		static const uint AutoBlockSizeMin=1024,AutoBlockSizeMax=16384;
+		/// Intervals (250ms) with headroom before shrinking. 
+		static const int AutoCalmTicks=8;
+		
+		/// FIFO overflow detection: timerfd to poll the firmware status; 
+		/// -1 if not available. 
+		int gap_fd;
+		/// Overflow counter value seen at the last poll. 
+		uint16 gap_last_count;
+		/// Bytes reaped at the last poll. Overflows seen at the next 
+		/// poll happened after this data was captured. 
+		int64 gap_lo;
+		/// Total number of overflows. 
+		int gap_events;
+		/// Output for gaps_path or NULL. 
+		FILE *gaps_file;
+		
+		/// Firmware status area behind the config (firmware/fx2pipe.c). 
+		static const int FirmwareStatusAdr=0x1008;
+		static const uchar FirmwareStatusMagic=0xf1U;
+		/// Size of the EP6 FIFO (quad buffered 512 byte packets). 
+		static const int FifoBytes=2048;
+		/// Interval for polling the overflow counter. 
+		static const int GapPollMsec=10;
+		
+		/// -W: Block of 32 bit samples read as a pair of URBs, EP6 with 
+		/// the low and EP2 with the high 16 bits, each into one half of 
+		/// the buffer. Both endpoints complete in order, and so do the 
+		/// pairs. 
+		struct WidePair
+		{
+			char *buf;    ///< Pool buffer; NULL once handed on. 
+			size_t half;  ///< Offset of the EP2 half in buf. 
+			int len[2];   ///< Bytes received on EP6, EP2; -1 if pending. 
+			int refs;     ///< Number of URBs not yet deleted; 0 = free. 
+		};
+		WidePair *wide_pairs;
+		int wide_npairs;
+		/// -W: Scratch buffer for interleaving a block. 
+		char *wide_tmp;
+		/// -R: Scratch buffer for encoding a block; twice the block 
+		/// size (as are the pool buffers) since a block of samples 
+		/// which all differ doubles in size. 
+		char *rle_tmp;
+		
+		/// Max number of buffers the writer thread writes at once. 
+		static const int WriterBatchMax=64;
+		
 		/// See FirwareConfig. 
 		static const int FirmwareConfigAdr=0x1003;
 		
@@ -99,16 +258,101 @@ class FX2Pipe : public FX2USBDevice
 		/// Counterpart of ConnectAndInitUSB: cleanup. 
 		void _CleanupUSB();
 		
-		/// Submit one URB. 0 on success; 1 on failure. 
+		/// Submit one URB (a pair of them for -W). 0 on success; 
+		/// 1 on failure. 
 		int _SubmitOneURB();
+		/// -W part of _SubmitOneURB(). 
+		int _SubmitWidePair();
 		/// Submit a bunch of URBs initially to fill the pipeline. 
 		int _SubmitInitialURBs();
+		/// Submit URBs until pipeline_size are pending. 0 on success. 
+		int _FillPipeline();
+		/// Called periodically to adapt pipeline_size / io_block_size 
+		/// for ps=auto / bs=auto. 
+		void _AutoTune();
+		/// Set up FIFO overflow detection if the firmware supports it 
+		/// and open gaps_path. 
+		void _StartGapDetection();
+		/// Counterpart of _StartGapDetection(). 
+		void _StopGapDetection();
+		/// Read the firmware overflow counter. Returns 0 on success. 
+		int _ReadOverflowCount(uint16 *count);
+		/// Poll the overflow counter and report new overflows. 
+		void _PollGaps();
 		/// Cancel all the pending osci data URBs. 
 		void _CancelAllPendingDataURBs();
 		
+		/// Start the stdout writer (IN) or stdin reader (OUT) thread 
+		/// taking over all buffers of buf_pool. 
+		int _StartStdioThread();
+		/// Flush pending data and stop the stdio thread. 
+		/// Safe to be called several times. 
+		void _StopStdioThread();
+		/// Queue a buffer on fill_ring or free_ring and post sem. 
+		void _PushStdioBuf(TLSPSCRing<StdioBuf> *ring,sem_t *sem,
+			const StdioBuf &wb);
+		/// Get a free buffer (IN) or a buffer filled from stdin (OUT) from 
+		/// the stdio thread; waits if none is available. Returns NULL 
+		/// if interrupted or (OUT) on EOF (see stdio_eof). 
+		char *_GetStdioBuf(size_t *len);
+		/// Decide on out_mode depending on what stdout is (or open 
+		/// out_path). Returns 0 on success. 
+		int _SetupOutput();
+		/// Write the n buffers in iov (which gets modified) to stdout 
+		/// according to out_mode, as few syscalls as possible. Used by 
+		/// the writer thread and for synchronous stdio. 
+		/// Returns 0 on success, 1 on error and 2 on EOF or SIGINT. 
+		int _WriteOut(struct iovec *iov,int n);
+		/// Pass on a buffer of reaped IN data (stdout, data_sink, ...), 
+		/// taking it over. With -R, the data is run-length encoded 
+		/// first. 
+		ErrorCode _DeliverIn(char *buf,size_t len);
+		/// -R: Run-length encode the len bytes of samples in buf in 
+		/// place. Returns the new length. 
+		size_t _RLEncode(char *buf,size_t len);
+		/// -W: Record a reaped half of a block; once both are in, 
+		/// interleave them and pass on the block. 
+		ErrorCode _WideReaped(MyURB *u);
+		/// Without stdio thread: Write out and release reap_buf. 
+		/// Returns like _WriteOut(). 
+		int _WriteReaped();
+		/// Writer thread: Move len bytes from out_pipe into stdout. 
+		int _SpliceToFile(size_t len);
+		/// Open out_path for OMDirect. 0 on success. 
+		int _OpenOutFile();
+		/// -H: Write the capture file header to the output. 0 on success. 
+		int _WriteHeader();
+		/// Writer thread: Queue (or copy) a buffer for OMDirect output; 
+		/// this also takes care of giving back the buffer. 
+		int _DirectOut(char *buf,size_t len);
+		/// Writer thread: Write out the batch_iov buffers. 
+		int _DirectFlush();
+		/// Writer thread: writev() the complete iov array to out_fd. 
+		int _DirectWritev(struct iovec *iov,int n);
+		/// Writer thread: Write out everything left at the end. 
+		int _DirectFinish();
+		/// Writer thread: Give back a buffer. If it was spliced into the 
+		/// stdout pipe (spliced_end>=0 is the value of spliced_pages 
+		/// including it), this is delayed until the pipe cannot reference 
+		/// it any more. 
+		void _ReleaseWriterBuf(char *buf,int64 spliced_end);
+		/// Writer thread main loop. 
+		void _WriterLoop();
+		static void *_WriterThread(void *arg);
+		/// Reader thread: Fill buffer from stdin. Returns number of bytes 
+		/// read; less than len only on EOF, error or stdio_stop. 
+		size_t _ReadIn(char *buf,size_t len);
+		/// Reader thread main loop. 
+		void _ReaderLoop();
+		static void *_ReaderThread(void *arg);
+		
 		/// Overriding virtual from WWUSBDevice. 
 		ErrorCode URBNotify(URB *u);
 		/// Overriding virtual from WWUSBDevice. 
+		ErrorCode URBBatchNotify();
+		/// Overriding virtual from WWUSBDevice. 
+		ErrorCode FDNotify(int fd,unsigned int events);
+		/// Overriding virtual from WWUSBDevice. 
 		void DeleteURB(URB *u);
 		
 	public:
@@ -126,9 +370,26 @@ class FX2Pipe : public FX2USBDevice
 		uint io_block_size;
 		/// Pipeline size (number of URBs). 
 		int pipeline_size;
+		/// ps=auto, bs=auto: Adapt pipeline_size, io_block_size while 
+		/// running, starting with the values above. 
+		int auto_pipeline,auto_block_size;
+		/// Number of blocks the stdout writer thread may lag behind (IN) 
+		/// or the stdin reader thread may read ahead (OUT); 0 to do 
+		/// stdio synchronously when reaping/submitting URBs. 
+		int ring_size;
 		
 		/// Direction: -1 -> IN (default); +1 -> OUT
 		int dir;
+		/// IN with 32 bit samples from two endpoints (-W): the external 
+		/// master writes the low word to EP6 and the high word to EP2 
+		/// for each sample. 
+		int wide;
+		/// Run-length encode IN samples (-R). 
+		int rle;
+		/// Start the IN data with a capture file header (-H). 
+		int header;
+		/// Sample rate in Hz for the header; 0 if unknown. 
+		uint32 sample_rate;
 		
 		/// Don't use stdio but throw away data / write NUL data. 
 		int no_stdio;
@@ -141,14 +402,48 @@ class FX2Pipe : public FX2USBDevice
 		/// Path to firmware IHX file. NULL for builtin firmware. 
 		const char *firmware_hex_path;
 		
+		/// Capture file to replay through a simulated device instead of 
+		/// using USB; NULL for real hardware. 
+		const char *sim_path;
+		
+		/// File to write IN data to (using O_DIRECT, bypassing the page 
+		/// cache) instead of stdout; NULL for stdout. 
+		const char *out_path;
+
+		/**
+		 * \short In-process consumer for IN data. 
+		 * 
+		 * If set, this is called from URBNotify() with the reaped URB 
+		 * buffer in place instead of writing the data to stdout. The 
+		 * buffer is only valid during the call. A nonzero return value 
+		 * stops the transfer. 
+		 */
+		int (*data_sink)(void *user,const void *buf,size_t len);
+		/// User pointer passed to data_sink (and gap_sink). 
+		void *data_sink_user;
+		
+		/// File to write FIFO overflow records to (see _PollGaps()); 
+		/// NULL for none. 
+		const char *gaps_path;
+		/**
+		 * \short In-process consumer for FIFO overflow records. 
+		 * 
+		 * If set, this is called (from the same thread as data_sink) 
+		 * when the FX2 reported events FIFO overflows. Data is missing 
+		 * somewhere between IN stream byte offsets lo and hi. Note 
+		 * that hi may be beyond the data passed to data_sink so far. 
+		 */
+		void (*gap_sink)(void *user,long long lo,long long hi,int events);
+		
 		/// This is at address FirmwareConfigAdr in the FX2. 
 		struct FirwareConfig
 		{
-			uchar FC_DIR;         // [0] 0x12 or 0x21
+			uchar FC_DIR;         // [0] 0x12, 0x16 (-W) or 0x21
 			uchar FC_IFCONFIG;    // [1]
 			uchar FC_EPCFG;       // [2]
 			uchar FC_EPFIFOCFG;   // [3]
 			uchar FC_CPUCS;       // [4]
+			uchar FC_STATUS[4];   // [5..8] zeroed; see FirmwareStatusAdr
 		}__attribute__((__packed__)) fc;
 		
 	private:
@@ -160,6 +455,14 @@ class FX2Pipe : public FX2USBDevice
 		FX2Pipe();
 		~FX2Pipe();
 		
+		/**
+		 * \short Set up the config from fx2pipe command line arguments. 
+		 * 
+		 * Errors are written to stderr. Returns 0 on success, 1 on errors 
+		 * and -1 if only help or version information was requested. 
+		 */
+		int ParseArgs(int argc,char **arg);
+		
 		/// Actually run the IO code...
 		int run();
 };
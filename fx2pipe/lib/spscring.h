@@ -0,0 +1,101 @@
+/*
+ * lib/spscring.h
+ * 
+ * Lock-free single producer / single consumer ring buffer template. 
+ * 
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation. (See COPYING.GPL for details.)
+ * 
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ */
+
+#ifndef _TemplateLibrary_SPSCRing_H_
+#define _TemplateLibrary_SPSCRing_H_ 1
+
+#include "../oconfig.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+
+/**
+ * \short Lock-free single producer / single consumer ring buffer. 
+ * 
+ * Exactly one thread may call push() and exactly one (other) thread
+ * may call pop(). Neither of them ever blocks; waiting for space or
+ * data is left to the user (e.g. using a semaphore). 
+ * 
+ * The capacity is rounded up to the next power of two. T should be
+ * a plain data type since entries are copied by assignment and never
+ * destroyed. 
+ * 
+ * Not C++-safe (copying). 
+ */
+template<typename T>class TLSPSCRing
+{
+	private:
+		/// Entry array; size mask+1. 
+		T *ent;
+		/// Capacity minus one. 
+		size_t mask;
+		
+		/// Next index to be read. Written by consumer only. 
+		/// Kept in its own cache line to avoid false sharing. 
+		size_t tail __attribute__((__aligned__(64)));
+		/// Next index to be written. Written by producer only. 
+		size_t head __attribute__((__aligned__(64)));
+		
+		/// Do not use. 
+		TLSPSCRing(const TLSPSCRing &);
+		/// Do not use. 
+		void operator=(const TLSPSCRing &);
+	public:
+		/// Create ring which can hold at least size entries. 
+		TLSPSCRing(size_t size) : tail(0),head(0)
+		{
+			for(mask=1; mask<size; mask<<=1);
+			ent=(T*)malloc(mask*sizeof(T));
+			if(!ent)  abort();
+			--mask;
+		}
+		~TLSPSCRing()
+			{  free(ent);  ent=NULL;  }
+		
+		/// Get capacity of the ring. 
+		inline size_t capacity() const
+			{  return(mask+1);  }
+		
+		/// Producer: append entry. Returns 0 on success, 1 if full. 
+		inline int push(T const &e)
+		{
+			size_t h=head;
+			if(h-__atomic_load_n(&tail,__ATOMIC_ACQUIRE)>mask)
+			{  return(1);  }
+			ent[h&mask]=e;
+			__atomic_store_n(&head,h+1,__ATOMIC_RELEASE);
+			return(0);
+		}
+		
+		/// Consumer: remove oldest entry. Returns 0 on success, 1 if empty. 
+		inline int pop(T *e)
+		{
+			size_t t=tail;
+			if(__atomic_load_n(&head,__ATOMIC_ACQUIRE)==t)
+			{  return(1);  }
+			*e=ent[t&mask];
+			__atomic_store_n(&tail,t+1,__ATOMIC_RELEASE);
+			return(0);
+		}
+		
+		/// Number of entries currently in the ring (snapshot only). 
+		inline size_t count() const
+		{
+			return(__atomic_load_n(&head,__ATOMIC_ACQUIRE)-
+				__atomic_load_n(&tail,__ATOMIC_ACQUIRE));
+		}
+};
+
+#endif  /* _TemplateLibrary_SPSCRing_H_ */
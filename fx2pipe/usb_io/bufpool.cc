@@ -0,0 +1,144 @@
+/*
+ * usb_io/bufpool.cc
+ * 
+ * URB data buffer pool class. 
+ * 
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation. (See COPYING.GPL for details.)
+ * 
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ */
+
+#include "bufpool.h"
+#include "wwusb.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <assert.h>
+
+
+int URBBufferPool::_MapBuffers(WWUSBDevice *dev)
+{
+	for(int i=0; i<nbufs; i++)
+	{
+		bufs[i]=(char*)dev->MapURBBuffer(stride);
+		if(!bufs[i])
+		{
+			// Not supported (or usbfs memory limit hit). 
+			while(i--)
+			{  munmap(bufs[i],stride);  }
+			return(1);
+		}
+		// Touch all pages now rather than during the transfer. 
+		memset(bufs[i],0,stride);
+	}
+	mapped=1;
+	return(0);
+}
+
+
+int URBBufferPool::_AllocSlab()
+{
+	size_t pagesize=sysconf(_SC_PAGESIZE);
+	slab_size=stride*nbufs;
+	
+	void *ptr=NULL;
+	if(posix_memalign(&ptr,pagesize,slab_size))
+	{
+		fprintf(stderr,"URB buffer pool allocation failure (%d*%u bytes)\n",
+			nbufs,(unsigned int)stride);
+		return(1);
+	}
+	slab=(char*)ptr;
+	// Touch all pages now rather than during the transfer. 
+	memset(slab,0,slab_size);
+	
+	if(mlock(slab,slab_size))
+	{  fprintf(stderr,"fx2pipe: cannot lock %u bytes of URB buffers in "
+		"memory: %s\n",(unsigned int)slab_size,strerror(errno));  }
+	else
+	{  locked=1;  }
+	
+	for(int i=0; i<nbufs; i++)
+	{  bufs[i]=slab+stride*i;  }
+	return(0);
+}
+
+
+int URBBufferPool::alloc(int n,size_t bufsize,WWUSBDevice *dev)
+{
+	release();
+	
+	assert(n>0 && bufsize>0);
+	
+	size_t pagesize=sysconf(_SC_PAGESIZE);
+	stride=(bufsize+pagesize-1)/pagesize*pagesize;
+	nbufs=n;
+	bufs=new char*[nbufs];
+	
+	// Fall back to heap memory if mapping is not possible. 
+	if((!dev || _MapBuffers(dev)) && _AllocSlab())
+	{
+		release();
+		return(1);
+	}
+	
+	freeq=new char*[nbufs+1];
+	freeq_get=freeq_put=0;
+	for(int i=0; i<nbufs; i++)
+	{  put(bufs[i]);  }
+	
+	return(0);
+}
+
+
+void URBBufferPool::release()
+{
+	if(mapped)
+	{
+		for(int i=0; i<nbufs; i++)
+		{  munmap(bufs[i],stride);  }
+		mapped=0;
+	}
+	if(slab)
+	{
+		if(locked)
+		{  munlock(slab,slab_size);  locked=0;  }
+		free(slab);
+		slab=NULL;
+	}
+	if(bufs)
+	{  delete[] bufs;  bufs=NULL;  }
+	if(freeq)
+	{  delete[] freeq;  freeq=NULL;  }
+	nbufs=0;
+	freeq_get=freeq_put=0;
+}
+
+
+URBBufferPool::URBBufferPool() :
+	slab(NULL),
+	slab_size(0),
+	bufs(NULL),
+	stride(0),
+	nbufs(0),
+	locked(0),
+	mapped(0),
+	freeq(NULL),
+	freeq_get(0),
+	freeq_put(0)
+{
+	// Nothing to do... 
+}
+
+URBBufferPool::~URBBufferPool()
+{
+	release();
+}
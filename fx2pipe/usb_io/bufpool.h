@@ -0,0 +1,114 @@
+/*
+ * usb_io/bufpool.h
+ * 
+ * URB data buffer pool class. 
+ * 
+ * This file may be distributed and/or modified under the terms of the
+ * GNU General Public License version 2 as published by the Free Software
+ * Foundation. (See COPYING.GPL for details.)
+ * 
+ * This file is provided AS IS with NO WARRANTY OF ANY KIND, INCLUDING THE
+ * WARRANTY OF DESIGN, MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ * 
+ */
+
+#ifndef _INCLUDE_FX2PIPE_USBIO_BUFPOOL_H_
+#define _INCLUDE_FX2PIPE_USBIO_BUFPOOL_H_ 1
+
+#include "../oconfig.h"
+
+#include <stdlib.h>
+
+class WWUSBDevice;
+
+
+/**
+ * \short Fixed pool of URB data buffers. 
+ * 
+ * If possible, the buffers are mapped from usbfs (see 
+ * WWUSBDevice::MapURBBuffer()) so that the kernel does not need to copy 
+ * the data. Otherwise, they are carved out of a single page-aligned 
+ * slab which is allocated (and locked into RAM using mlock() if 
+ * permitted). Either way this happens once before the transfer starts. 
+ * Buffers are handed out in the order in 
+ * which they were put back which, since URBs complete in submission 
+ * order, amounts to using them round-robin. No allocation takes place 
+ * per transfer. 
+ * 
+ * Not thread-safe. Not C++-safe. 
+ */
+class URBBufferPool
+{
+	private:
+		/// Slab holding all buffers; NULL if not allocated or mapped. 
+		char *slab;
+		/// Size of the slab in bytes. 
+		size_t slab_size;
+		/// All buffers (array of size nbufs). 
+		char **bufs;
+		/// Distance between buffers: buffer size rounded up to pages. 
+		size_t stride;
+		/// Number of buffers in the pool. 
+		int nbufs;
+		/// Set if the slab could be mlock()ed. 
+		int locked;
+		/// Set if the buffers are mapped from usbfs. 
+		int mapped;
+		
+		/// Queue of free buffers (array of nbufs+1 entries). 
+		char **freeq;
+		/// Read and write index into freeq. 
+		int freeq_get,freeq_put;
+		
+		/// Try to map all buffers from usbfs; 0 on success. 
+		int _MapBuffers(WWUSBDevice *dev);
+		/// Allocate the slab instead; 0 on success. 
+		int _AllocSlab();
+		
+		/// Do not use. 
+		void operator=(const URBBufferPool &);
+		/// Do not use. 
+		URBBufferPool(const URBBufferPool &);
+	public:
+		URBBufferPool();
+		~URBBufferPool();
+		
+		/**
+		 * \short Allocate the pool. 
+		 * 
+		 * Set up n buffers of at least bufsize bytes each, all of 
+		 * them initially free and zeroed. A previously allocated 
+		 * pool is released first. If dev is passed, the buffers are 
+		 * mapped from its usbfs file if the kernel supports that. 
+		 * Returns 0 on success, 1 on allocation failure. Failure 
+		 * to lock the pages in memory is reported to stderr but is 
+		 * not an error. 
+		 */
+		int alloc(int n,size_t bufsize,WWUSBDevice *dev=NULL);
+		/// Release all memory. Safe to be called several times. 
+		void release();
+		
+		/// Number of buffers in the pool; 0 if not allocated. 
+		inline int size() const
+			{  return(nbufs);  }
+		/// Are the buffers mapped from usbfs (zero-copy)? 
+		inline bool IsMapped() const
+			{  return(mapped);  }
+		
+		/// Get a free buffer or NULL if all are in use. 
+		inline void *get()
+		{
+			if(freeq_get==freeq_put)  return(NULL);
+			char *b=freeq[freeq_get];
+			if(++freeq_get>nbufs)  freeq_get=0;
+			return(b);
+		}
+		/// Give back a buffer obtained by get(). 
+		inline void put(void *b)
+		{
+			freeq[freeq_put]=(char*)b;
+			if(++freeq_put>nbufs)  freeq_put=0;
+		}
+};
+
+#endif  /* _INCLUDE_FX2PIPE_USBIO_BUFPOOL_H_ */
@@ -71,6 +71,27 @@ FX2USBDevice::ErrorCode FX2USBDevice::_DownloadFirmware(
 }
 
 
+FX2USBDevice::ErrorCode FX2USBDevice::ReadRAM(size_t adr,uchar *buf,
+	size_t len)
+{
+	if(!udh)
+	{  return(ECNotConnected);  }
+	
+	int rv=usb_control_msg(udh,0xc0,0xa0,
+		/*addr=*/adr,0,
+		/*buf=*/(char*)buf,/*size=*/len,
+		/*timeout=*/1000/*msec*/);
+	if(rv<0 || size_t(rv)!=len)
+	{
+		fprintf(stderr,"Reading %zu bytes at 0x%zx: %s\n",
+			len,adr,rv<0 ? usb_strerror() : "short read");
+		return(ECFailure);
+	}
+	
+	return(ECSuccess);
+}
+
+
 FX2USBDevice::ErrorCode FX2USBDevice::_connect(
 	struct usb_device *fx2_dev,
 	const char *firmware_path,const char **static_firmware,
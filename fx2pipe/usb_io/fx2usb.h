@@ -97,6 +97,16 @@ class FX2USBDevice : public WWUSBDevice
 			const char *bus,const char *dev,
 			const char *firmware_path,const char **static_firmware,
 			const char *cfg_buf,size_t cfg_len,size_t cfg_adr);
+		
+		/**
+		 * \short Read FX2 RAM while connected. 
+		 * 
+		 * Uses the 0xA0 vendor request on the control endpoint which is 
+		 * handled by the FX2 core, so this works with the firmware running 
+		 * and does not interfere with the bulk URBs. Not available for 
+		 * the simulated device (ECNotConnected). 
+		 */
+		ErrorCode ReadRAM(size_t adr,uchar *buf,size_t len);
 };
 
 #endif  /* _INCLUDE_USBIO_FX2USB_H_ */
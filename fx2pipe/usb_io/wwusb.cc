@@ -23,8 +23,11 @@
 
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 
 #include <assert.h>
 
@@ -118,7 +121,7 @@ WWUSBDevice::ErrorCode WWUSBDevice::_ErrorCodeRV(int e)
 
 WWUSBDevice::ErrorCode WWUSBDevice::_DoConnect(struct usb_device *d)
 {
-	if(udev || udh)
+	if(IsConnected())
 	{  return(ECConnected);  }
 	
 	udev=d;
@@ -134,7 +137,7 @@ WWUSBDevice::ErrorCode WWUSBDevice::_DoConnect(struct usb_device *d)
 
 WWUSBDevice::ErrorCode WWUSBDevice::connect(int vendor,int product,int nth)
 {
-	if(udev || udh)
+	if(udev || IsConnected())
 	{  return(ECConnected);  }
 	
 	struct usb_device *ud=USBFindDevice(vendor,product,nth);
@@ -147,7 +150,7 @@ WWUSBDevice::ErrorCode WWUSBDevice::connect(int vendor,int product,int nth)
 
 WWUSBDevice::ErrorCode WWUSBDevice::connect(const char *bus,const char *dev)
 {
-	if(udev || udh)
+	if(udev || IsConnected())
 	{  return(ECConnected);  }
 	
 	struct usb_device *ud=USBFindDevice(bus,dev);
@@ -158,8 +161,58 @@ WWUSBDevice::ErrorCode WWUSBDevice::connect(const char *bus,const char *dev)
 }
 
 
+WWUSBDevice::ErrorCode WWUSBDevice::connect_sim(const char *path)
+{
+	if(udev || IsConnected())
+	{  return(ECConnected);  }
+	
+	sim_fd=::open(path,O_RDONLY);
+	if(sim_fd<0)
+	{  return(_ErrorCodeRV(errno));  }
+	
+	return(ECSuccess);
+}
+
+
+void *WWUSBDevice::MapURBBuffer(size_t size)
+{
+	if(!IsConnected())
+	{  return(NULL);  }
+	
+	void *ptr;
+	if(sim_fd<0)
+	{
+		// usbfs hands out a new buffer for each mmap() call; the offset 
+		// must be 0. Old kernels fail with ENODEV. 
+		ptr=mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,
+			fd_from_usb_dev_handle(udh),0);
+	}
+	else
+	{
+		// Simulated device: Hand out consecutive pieces of a memory file. 
+		if(sim_mem_fd<0)
+		{
+			sim_mem_fd=memfd_create("fx2pipe-usbfs",0);
+			if(sim_mem_fd<0)
+			{  return(NULL);  }
+			sim_mem_size=0;
+		}
+		if(ftruncate(sim_mem_fd,sim_mem_size+size))
+		{  return(NULL);  }
+		ptr=mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,
+			sim_mem_fd,sim_mem_size);
+		if(ptr!=MAP_FAILED)
+		{  sim_mem_size+=size;  }
+	}
+	
+	return(ptr==MAP_FAILED ? NULL : ptr);
+}
+
+
 WWUSBDevice::ErrorCode WWUSBDevice::claim(int interface,int alt_interface)
 {
+	if(sim_fd>=0)
+	{  return(ECSuccess);  }
 	if(!udh)
 	{  return(ECNotConnected);  }
 	
@@ -207,9 +260,9 @@ void WWUSBDevice::CancelAllPendingURBs(bool also_delete)
 	
 	if(cnt)
 	{  fprintf(stderr,"Cancelled %d pending URBs (npending=%d)%s",
-		cnt,npending,(also_delete && udh) ? ", reaping..." : "\n");  }
+		cnt,npending,(also_delete && IsConnected()) ? ", reaping..." : "\n");  }
 	
-	if(also_delete && udh)
+	if(also_delete && IsConnected())
 	{
 		// Reap as much as we can. 
 		int nreap=0;
@@ -242,6 +295,14 @@ WWUSBDevice::ErrorCode WWUSBDevice::disconnect()
 	
 	if(udh)
 	{  ::usb_close(udh);  udh=NULL;  }
+	if(sim_fd>=0)
+	{  ::close(sim_fd);  sim_fd=-1;  }
+	// Mapped buffers stay valid until unmapped. 
+	if(sim_mem_fd>=0)
+	{  ::close(sim_mem_fd);  sim_mem_fd=-1;  }
+	// This also drops any fds added with AddPollFD(). 
+	if(epfd>=0)
+	{  ::close(epfd);  epfd=-1;  }
 	udev=NULL;
 	
 	return(ECSuccess);
@@ -256,9 +317,12 @@ WWUSBDevice::ErrorCode WWUSBDevice::_SubmitURB(URB *u)
 	
 	usbdevfs_urb *dev_u=u;
 	u->usercontext=u;  // <-- This is just some "magic" for checks...
-	int rv=ioctl(fd_from_usb_dev_handle(udh),USBDEVFS_SUBMITURB,dev_u);
-	if(rv<0)
-	{  return(_ErrorCodeRV(errno));  }
+	if(sim_fd<0)
+	{
+		int rv=ioctl(fd_from_usb_dev_handle(udh),USBDEVFS_SUBMITURB,dev_u);
+		if(rv<0)
+		{  return(_ErrorCodeRV(errno));  }
+	}
 	
 	pending.append(u);
 	++npending;
@@ -276,6 +340,14 @@ WWUSBDevice::ErrorCode WWUSBDevice::_CancelURB(URB *u)
 	
 	if(u->cancelled==2)  return(ECSuccess);
 	
+	if(sim_fd>=0)
+	{
+		// Simulated URBs are completed when reaped so they can always 
+		// be cancelled. 
+		u->cancelled=2;
+		return(ECSuccess);
+	}
+	
 	usbdevfs_urb *dev_u=u;
 	int rv=ioctl(fd_from_usb_dev_handle(udh),USBDEVFS_DISCARDURB,dev_u);
 	if(rv<0)
@@ -291,6 +363,9 @@ WWUSBDevice::ErrorCode WWUSBDevice::_CancelURB(URB *u)
 
 WWUSBDevice::URB *WWUSBDevice::_ReapURB(ErrorCode *ec_rv,bool may_wait)
 {
+	if(sim_fd>=0)
+	{  return(_SimReapURB(ec_rv));  }
+	
 	int fd=fd_from_usb_dev_handle(udh);
 	usbdevfs_urb *dev_u=NULL;
 	int reap_rv = may_wait ? 
@@ -342,6 +417,68 @@ WWUSBDevice::URB *WWUSBDevice::_ReapURB(ErrorCode *ec_rv,bool may_wait)
 }
 
 
+WWUSBDevice::URB *WWUSBDevice::_SimReapURB(ErrorCode *ec_rv)
+{
+	// The simulated device completes URBs strictly in submission order. 
+	URB *u=pending.first();
+	if(!u)
+	{
+		*ec_rv=ECNoURBAvail;
+		return(NULL);
+	}
+	
+	if(u->cancelled==2)
+	{
+		u->actual_length=0;
+		u->status=-ENOENT;
+	}
+	else if(u->dir()<0)
+	{
+		// IN: Fill the buffer from the replay file. 
+		char *buf=(char*)u->buffer;
+		size_t want=u->buffer_length;
+		u->actual_length=0;
+		while(want)
+		{
+			ssize_t rd=::read(sim_fd,buf,want);
+			if(rd>0)
+			{
+				want-=rd;
+				buf+=rd;
+				u->actual_length+=rd;
+			}
+			else if(rd<0 && errno==EINTR)
+			{  continue;  }
+			else
+			{  break;  }
+		}
+		if(!u->actual_length)
+		{
+			fprintf(stderr,"Simulated device: end of replay file\n");
+			*ec_rv=ECNotConnected;
+			return(NULL);
+		}
+		u->status=0;
+	}
+	else
+	{
+		// OUT: Data is simply thrown away. 
+		u->actual_length=u->buffer_length;
+		u->status=0;
+	}
+	
+	pending.dequeue(u);
+	--npending;  assert(npending>=0);
+	
+#if DEBUG_ASYNC_IO
+	fprintf(stderr,"R(%d) ",u->urb_serial);
+#endif
+	
+	*ec_rv=ECSuccess;
+	return(u);
+}
+
+
 WWUSBDevice::ErrorCode WWUSBDevice::_ResetEP(uchar dir_ep)
 {
 	unsigned int ep=dir_ep;
@@ -358,95 +495,159 @@ WWUSBDevice::ErrorCode WWUSBDevice::_ResetEP(uchar dir_ep)
 }
 
 
-WWUSBDevice::ErrorCode WWUSBDevice::ProcessEvents(int max_delay)
+int WWUSBDevice::_EpollFD()
 {
-	if(!udh)
+	if(epfd>=0 || !IsConnected())
+	{  return(epfd);  }
+	
+	epfd=::epoll_create1(EPOLL_CLOEXEC);
+	if(epfd<0)
+	{
+		fprintf(stderr,"epoll_create: %s\n",strerror(errno));
+		return(-1);
+	}
+	
+	// usbfs signals completed URBs as writable. The simulated device 
+	// is not pollable; it is always ready. 
+	if(sim_fd<0)
+	{
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.events=EPOLLOUT;
+		ev.data.fd=fd_from_usb_dev_handle(udh);
+		if(::epoll_ctl(epfd,EPOLL_CTL_ADD,ev.data.fd,&ev))
+		{
+			fprintf(stderr,"epoll_ctl(usbfs): %s\n",strerror(errno));
+			::close(epfd);  epfd=-1;
+		}
+	}
+	
+	return(epfd);
+}
+
+
+WWUSBDevice::ErrorCode WWUSBDevice::AddPollFD(int fd,unsigned int events)
+{
+	if(!IsConnected())
 	{  return(ECNotConnected);  }
+	if(_EpollFD()<0)
+	{  return(ECFailure);  }
+	
+	struct epoll_event ev;
+	memset(&ev,0,sizeof(ev));
+	ev.events=events;
+	ev.data.fd=fd;
+	if(::epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev))
+	{
+		int errn=errno;
+		fprintf(stderr,"epoll_ctl(%d): %s\n",fd,strerror(errn));
+		return(_ErrorCodeRV(errn));
+	}
 	
-	int fd=fd_from_usb_dev_handle(udh);
-	//fprintf(stderr,"fd=%d\n",fd);
+	return(ECSuccess);
+}
+
+
+WWUSBDevice::ErrorCode WWUSBDevice::RemovePollFD(int fd)
+{
+	if(epfd<0)
+	{  return(ECSuccess);  }
+	
+	if(::epoll_ctl(epfd,EPOLL_CTL_DEL,fd,NULL))
+	{  return(_ErrorCodeRV(errno));  }
+	
+	return(ECSuccess);
+}
+
+
+WWUSBDevice::ErrorCode WWUSBDevice::ProcessEvents(int max_delay)
+{
+	if(!IsConnected())
+	{  return(ECNotConnected);  }
 	
-	// First, see what we can get without waiting. 
-	bool gather_phase=1;
+	if(_EpollFD()<0)
+	{  return(ECFailure);  }
+	int usb_fd = sim_fd>=0 ? -1 : fd_from_usb_dev_handle(udh);
 	
-	ErrorCode ec=ECSuccess;
-	int errn=0;
 	for(;;)
 	{
 		if(!npending)
 		{  return(ECNoURBAvail);  }
 		
-//fprintf(stderr,"loop: gather_phase=%d\n",gather_phase);
-		usbdevfs_urb *dev_u=NULL;
-		bool may_wait;
-		if(gather_phase || max_delay==0)
-		{  may_wait=0;  }
-		else if(max_delay>0)
+		// First, reap everything we can get without waiting. At most 
+		// one pipeline's worth, so that the other events do not starve 
+		// while URBs complete as fast as they get resubmitted. 
+		int nreaped=0;
+		for(int max_reap=npending; nreaped<max_reap; nreaped++)
 		{
-			struct pollfd pfd[1];
-			pfd[0].fd=fd;
-			pfd[0].events=POLLIN|POLLHUP;
-			pfd[0].revents=0;
-			int poll_rv=::poll(pfd,1,max_delay);
-// FIXME!!! This does not work!!!!!!!!!!!!!!
-fprintf(stderr,"fd=%d, poll_rv=%d, revents=0x%x \n",
-	pfd[0].fd,poll_rv,pfd[0].revents);
-			if(poll_rv<0)
-			{
-				fprintf(stderr,"poll: rv=%d (%s)\n",poll_rv,strerror(errno));
-				// Actually, this may make the actual delay longer than 
-				// max_delay (e.g. by periodically sending a singal to 
-				// the process) but is not supposed to be a real problem. 
-				continue;  // FIXME: This may be dangerous (except for EINTR). 
-			}
-			else if(poll_rv==0)
+			ErrorCode ec=ECSuccess;
+			URB *u=_ReapURB(&ec,/*may_wait=*/0);
+			if(!u)
 			{
-				// Timeout. 
-				ec=ECTimeout;
-				break;
+				if(ec==ECNoURBAvail)
+				{  break;  }
+				return(ec);
 			}
-			else
-			{  may_wait=0;  }
+			
+			// Tell user. 
+			ErrorCode urv=URBNotify(u);
+			
+			// Now free the URB. 
+			DeleteURB(u);
+			
+			if(urv)
+			{  return(urv==ECUserQuitFatal ? ECUserQuitFatal : ECUserQuit);  }
 		}
-		else // max_delay<0. 
-		{  may_wait=1;  }
-		
-		URB *u=_ReapURB(&ec,may_wait);
-		if(!u)
+		if(nreaped)
 		{
-			if(ec==ECNoURBAvail)
-			{
-				// Currently no URB to reap available. 
-				if((max_delay>0 && !gather_phase) || 
-				   (max_delay==0 && gather_phase) )
-				{
-					ec=ECTimeout;
-					break;
-				}
-				gather_phase=0;
-				continue;
-			}
-			else if(ec==ECNotConnected)
-			{  return(ECNotConnected);  }
-			
-			gather_phase=0;
-			break;
+			// Let the user process the batch (e.g. resubmit URBs). 
+			ErrorCode urv=URBBatchNotify();
+			if(urv)
+			{  return(urv==ECUserQuitFatal ? ECUserQuitFatal : ECUserQuit);  }
 		}
 		
-		// Tell user. 
-		ErrorCode urv=URBNotify(u);
-		
-		// Now free the URB. 
-		DeleteURB(u);
+		// Then wait for the next event. If we just reaped something (or 
+		// for the simulated device), only pick up what is already there. 
+		int timeout = (nreaped || sim_fd>=0) ? 0 : max_delay;
+		struct epoll_event ev[16];
+		int nev=::epoll_wait(epfd,ev,16,timeout);
+		if(nev<0)
+		{
+			if(errno==EINTR)
+			{  return(ECInterrupted);  }
+			int errn=errno;
+			fprintf(stderr,"epoll_wait: %s\n",strerror(errn));
+			return(_ErrorCodeRV(errn));
+		}
+		if(!nev && !nreaped && sim_fd<0)
+		{  return(ECTimeout);  }
 		
-		if(urv)
+		for(int i=0; i<nev; i++)
 		{
-			ec = urv==ECUserQuitFatal ? ECUserQuitFatal : ECUserQuit;
-			break;
+			// URB completion (or disconnect which the next reap will 
+			// report) is handled at the top of the loop. 
+			if(ev[i].data.fd==usb_fd)
+			{  continue;  }
+			
+			ErrorCode urv=FDNotify(ev[i].data.fd,ev[i].events);
+			if(urv)
+			{  return(urv==ECUserQuitFatal ? ECUserQuitFatal : ECUserQuit);  }
 		}
 	}
-	
-	return(ec);
+}
+
+
+WWUSBDevice::ErrorCode WWUSBDevice::FDNotify(int,unsigned int)
+{
+	// Default implementation does nothing. 
+	return(ECSuccess);
+}
+
+
+WWUSBDevice::ErrorCode WWUSBDevice::URBBatchNotify()
+{
+	// Default implementation does nothing. 
+	return(ECSuccess);
 }
 
 
@@ -467,6 +668,10 @@ void WWUSBDevice::DeleteURB(URB *u)
 WWUSBDevice::WWUSBDevice() : 
 	udev(NULL),
 	udh(NULL),
+	sim_fd(-1),
+	sim_mem_fd(-1),
+	sim_mem_size(0),
+	epfd(-1),
 	pending(),
 	npending(0)
 {
@@ -84,6 +84,7 @@ class WWUSBDevice
 			ECUserQuit,       ///< Event loop left by user request. 
 			ECUserQuitFatal,  ///< Fatal version of ECUserQuit. 
 			ECNoURBAvail,     ///< Internally used by _ReapURB(). 
+			ECInterrupted,    ///< Waiting interrupted by a signal. 
 		};
 		
 		/**
@@ -167,6 +168,16 @@ class WWUSBDevice
 		struct usb_device *udev;
 		/// USB device handle from libusb. 
 		struct usb_dev_handle *udh;
+		/// Simulated device: file descriptor of the capture file replayed 
+		/// instead of talking to a device; -1 if not simulating. 
+		int sim_fd;
+		/// Simulated device: memory file standing in for the usbfs 
+		/// buffer memory (see MapURBBuffer()); -1 if not yet used. 
+		int sim_mem_fd;
+		/// Simulated device: current size of sim_mem_fd. 
+		off_t sim_mem_size;
+		/// epoll instance used by ProcessEvents(); -1 if not yet created. 
+		int epfd;
 		
 		/**
 		 * \short Notification of URB completion. 
@@ -183,6 +194,30 @@ class WWUSBDevice
 		 */
 		virtual ErrorCode URBNotify(URB *u);
 		
+		/**
+		 * \short Notification of the end of a batch of reaped URBs. 
+		 * 
+		 * ProcessEvents() reaps all URBs completed so far (calling 
+		 * URBNotify() for each of them) and then calls this once before 
+		 * waiting again. This is the place to do per-batch work like 
+		 * resubmitting the URBs or writing out their data in one go. 
+		 * The default implementation does nothing. 
+		 * 
+		 * Return value as for URBNotify(). 
+		 */
+		virtual ErrorCode URBBatchNotify();
+		
+		/**
+		 * \short Notification of an event on a file descriptor. 
+		 * 
+		 * Called from within ProcessEvents() when one of the file 
+		 * descriptors added with AddPollFD() becomes ready; events are 
+		 * the EPOLL* flags. The default implementation does nothing. 
+		 * 
+		 * Return value as for URBNotify(). 
+		 */
+		virtual ErrorCode FDNotify(int fd,unsigned int events);
+		
 		/// Delete an URB. Never uses delete directly; see URB for details. 
 		/// Default implementation will use operator delete directly. 
 		virtual void DeleteURB(URB *u);
@@ -256,6 +291,10 @@ class WWUSBDevice
 		/// Cancel the URB. This will NOT remove it from the pending list 
 		/// since cancelled URBs can still be reaped. 
 		ErrorCode _CancelURB(URB *u);
+		/// Simulated device version of _ReapURB(). 
+		URB *_SimReapURB(ErrorCode *ec_rv);
+		/// Get epfd, creating it (watching the usbfs fd) if needed. 
+		int _EpollFD();
 		
 	private:
 		/// Do not use. 
@@ -272,6 +311,10 @@ class WWUSBDevice
 		inline int NPending() const
 			{  return(npending);  }
 		
+		/// Connected to a (real or simulated) device?
+		inline bool IsConnected() const
+			{  return(udh || sim_fd>=0);  }
+		
 		/**
 		 * \short Connect to a (physical) USB device attached to the USB. 
 		 * 
@@ -299,6 +342,35 @@ class WWUSBDevice
 		ErrorCode connect(const char *bus,const char *dev);
 		/// \}
 		
+		/**
+		 * \short Connect to a simulated device. 
+		 * 
+		 * Instead of talking to hardware, IN URBs are filled from the 
+		 * file at path (one URB-sized chunk per URB, in submission order) 
+		 * when they are reaped and OUT URBs complete immediately. Once the 
+		 * file is exhausted, the device behaves as if it got unplugged 
+		 * (ECNotConnected). This is meant for testing the complete URB 
+		 * path without hardware. 
+		 */
+		ErrorCode connect_sim(const char *path);
+		
+		/**
+		 * \short Allocate URB buffer memory from usbfs. 
+		 * 
+		 * On kernels supporting it (Linux 4.6 and later), mapping the 
+		 * usbfs device file yields DMA-able memory which the host 
+		 * controller transfers bulk data to and from directly instead 
+		 * of the kernel copying it from/to user memory. 
+		 * 
+		 * The returned buffer of size bytes (a multiple of the page 
+		 * size) must be released using munmap(). Returns NULL if not 
+		 * connected or if not supported by the kernel. 
+		 * 
+		 * For a simulated device, the memory comes from an anonymous 
+		 * memory file standing in for usbfs. 
+		 */
+		void *MapURBBuffer(size_t size);
+		
 		/**
 		 * \short Claim interface. 
 		 * 
@@ -317,24 +389,41 @@ class WWUSBDevice
 		 */
 		ErrorCode disconnect();
 		
+		/**
+		 * \short Watch a file descriptor in ProcessEvents(). 
+		 * 
+		 * When fd gets ready for any of events (EPOLLIN, EPOLLOUT, ...; 
+		 * level-triggered unless EPOLLET is included), FDNotify() is 
+		 * called. This allows to handle timers (timerfd), signals 
+		 * (signalfd), pipes, etc. from the event loop. 
+		 * 
+		 * Only valid while connected; disconnect() drops all of them. 
+		 */
+		ErrorCode AddPollFD(int fd,unsigned int events);
+		/// Stop watching fd. 
+		ErrorCode RemovePollFD(int fd);
+		
 		/**
 		 * \short Main (event) loop. 
 		 * 
-		 * Call this to have URBs reaped (URBNotify()). 
+		 * Call this to have URBs reaped (URBNotify(), URBBatchNotify()) 
+		 * and file descriptors added by AddPollFD() serviced (FDNotify()). 
 		 * 
 		 * The loop will generally process as many URBs as possible. 
 		 * Exiting the event loop can be achieved by returning 1 in 
-		 * URBNotify(). 
+		 * URBNotify() or FDNotify(). 
 		 * If you set max_delay>=0, the function will also return as soon 
-		 * as an URB reap request will block for more than max_delay msec. 
+		 * as waiting for the next URB takes longer than max_delay msec. 
 		 * If max_delay<0, the function may block infinitely. 
+		 * Waiting is done using epoll and never inside a reap ioctl. 
 		 * 
 		 * NOTE: max_delay is the max delay between URBs, NOT the max. 
 		 *       total delay spent in the function. 
 		 * 
 		 * Return value: \n
-		 *   ECUserQuit: URBNotify() returned 1. \n
+		 *   ECUserQuit: URBNotify() or FDNotify() returned 1. \n
 		 *   ECTimeout: max_delay timeout. \n
+		 *   ECInterrupted: a signal arrived while waiting \n
 		 *   ECNotConnected: if disconnected in action \n
 		 *   ECNoURBAvail: no more pending URBs \n
 		 *   other errno codes
@@ -0,0 +1,210 @@
+// ====================================================================
+// decode6502 micro-benchmarks
+// ====================================================================
+//
+// Times each stage of the decoder on deterministic synthetic captures (see
+// bus_gen.h), for sync and sync-less decoding, with and without phi2, on the
+// 6502 and 65C02:
+//
+//   extract  the sample loop and pin extraction of decode_samples(), with
+//            the bus cycles discarded (rdy mapped to an always-low bit)
+//   cycles   the bus cycle decoders, fed directly, including analysis
+//   total    decode_samples() as a whole
+//   analyze  analyze_instruction() alone, without emulation
+//   emulate  the emulator alone
+//
+// Rates are in millions per second, and ns/unit is per instruction (per
+// cycle for extract). Output is discarded. Each figure is the best of several
+// runs, so they can be compared between builds on the same machine.
+//
+// Usage: bench6502 [CYCLES [RUNS]]
+
+// The decoder's internals are static, so include it whole
+#define main decode6502_main
+#include "main.c"
+#undef main
+
+#include "bus_gen.h"
+
+#define BENCH_CYCLES     (1 << 20)
+#define BENCH_RUNS       5
+#define BENCH_PROGRAM    1000
+#define BENCH_SEED       6502
+#define BENCH_OVERSAMPLE 4
+
+static int max_cycles = BENCH_CYCLES;
+static int runs = BENCH_RUNS;
+
+static bus_gen_cycle_t *cycles;
+static int num_cycles;
+static bus_gen_instr_t *instrs;
+static int num_instrs;
+static uint16_t *samples;
+static int num_samples;
+
+// Forget everything decoded so far
+static void reset_decoder() {
+   gap_count++;
+   sample_count = 0;
+   pc = -1;
+   em_invalidate();
+}
+
+static void stage_extract() {
+   int idx_rdy = arguments.idx_rdy;
+   arguments.idx_rdy = BUS_GEN_BIT_ZERO;
+   decode_samples(samples, num_samples);
+   arguments.idx_rdy = idx_rdy;
+}
+
+static void stage_cycles() {
+   for (int i = 0; i < num_cycles; i++) {
+      const bus_gen_cycle_t *c = &cycles[i];
+      if (arguments.idx_sync < 0) {
+         lookahead_decode_cycle_without_sync(c->data, -1, c->rnw, 1);
+      } else {
+         decode_cycle_with_sync(c->data, -1, c->rnw, c->sync, 1);
+      }
+   }
+}
+
+static void stage_total() {
+   decode_samples(samples, num_samples);
+}
+
+static void stage_analyze() {
+   int emulate = do_emulate;
+   do_emulate = 0;
+   for (int i = 0; i < num_instrs; i++) {
+      const bus_gen_instr_t *in = &instrs[i];
+      analyze_instruction(in->opcode, in->op1, in->op2, in->read_accumulator, in->write_accumulator, 0, in->cycles, 0, -1);
+   }
+   do_emulate = emulate;
+}
+
+static void stage_emulate() {
+   for (int i = 0; i < num_instrs; i++) {
+      const bus_gen_instr_t *in = &instrs[i];
+      InstrType *instr = &instr_table[in->opcode];
+      if (instr->emulate) {
+         // As analyze_instruction() picks the operand, for these instructions
+         if (instr->optype == WRITEOP) {
+            instr->emulate(in->write_accumulator & 0xff);
+         } else if (instr->mode == IMM) {
+            instr->emulate(in->op1);
+         } else {
+            instr->emulate(in->read_accumulator & 0xff);
+         }
+      }
+   }
+}
+
+// Run a stage, returning the best time (ns); *decoded is set to the number of
+// instructions it analyzed
+static long long run_stage(void (*stage)(), long long *decoded) {
+   long long best = LLONG_MAX;
+   set_quiet(1);
+   for (int i = 0; i < runs; i++) {
+      reset_decoder();
+      long long start_instr = instr_number;
+      long long start = time_ns();
+      stage();
+      long long elapsed = time_ns() - start;
+      if (elapsed < best) {
+         best = elapsed;
+      }
+      *decoded = instr_number - start_instr;
+   }
+   set_quiet(0);
+   return best > 0 ? best : 1;
+}
+
+// Print a rate in millions per second, or a dash if it does not apply
+static void print_rate(long long count, long long ns) {
+   if (count > 0) {
+      printf(" %10.2f", count * 1000.0 / ns);
+   } else {
+      printf(" %10s", "-");
+   }
+}
+
+static void report(const char *name, const char *stage, long long ns, long long nsamples, long long ncycles, long long ninstrs) {
+   printf("%-24s %-8s", name, stage);
+   print_rate(nsamples, ns);
+   print_rate(ncycles, ns);
+   print_rate(ninstrs, ns);
+   printf(" %10.2f\n", (double) ns / (ninstrs > 0 ? ninstrs : ncycles));
+}
+
+static void bench_cpu(int c02) {
+   const char *cpu = c02 ? "65C02" : "6502";
+   long long decoded;
+   char name[64];
+
+   arguments.c02 = c02;
+   em_init(c02, 0);
+   num_cycles = bus_gen_cycles(cycles, max_cycles, instrs, &num_instrs, BENCH_PROGRAM, BENCH_SEED);
+
+   long long ns = run_stage(stage_analyze, &decoded);
+   report(cpu, "analyze", ns, 0, 0, num_instrs);
+   ns = run_stage(stage_emulate, &decoded);
+   report(cpu, "emulate", ns, 0, 0, num_instrs);
+
+   for (int sync = 1; sync >= 0; sync--) {
+      for (int phi2 = 1; phi2 >= 0; phi2--) {
+         arguments.idx_sync = sync ? BUS_GEN_BIT_SYNC : -1;
+         arguments.idx_phi2 = phi2 ? BUS_GEN_BIT_PHI2 : -1;
+         do_emulate = !sync;
+         num_samples = bus_gen_samples(samples, NULL, cycles, num_cycles, phi2 ? BENCH_OVERSAMPLE : 0);
+         sprintf(name, "%s %s %s", cpu, sync ? "sync" : "sync-less", phi2 ? "phi2" : "no-phi2");
+
+         ns = run_stage(stage_extract, &decoded);
+         report(name, "extract", ns, num_samples, num_cycles, 0);
+         ns = run_stage(stage_cycles, &decoded);
+         report(name, "cycles", ns, 0, num_cycles, decoded);
+         ns = run_stage(stage_total, &decoded);
+         report(name, "total", ns, num_samples, num_cycles, decoded);
+         if (decoded < num_instrs - num_instrs / 100) {
+            printf("warning: only %lld of %d instructions decoded\n", decoded, num_instrs);
+         }
+      }
+   }
+}
+
+int main(int argc, char *argv[]) {
+   if (argc > 1) {
+      max_cycles = atoi(argv[1]);
+   }
+   if (argc > 2) {
+      runs = atoi(argv[2]);
+   }
+   if (max_cycles <= 0 || runs <= 0) {
+      fprintf(stderr, "usage: %s [CYCLES [RUNS]]\n", argv[0]);
+      return 2;
+   }
+
+   arguments.idx_data  = 0;
+   arguments.idx_rnw   = BUS_GEN_BIT_RNW;
+   arguments.idx_rdy   = BUS_GEN_BIT_RDY;
+   arguments.idx_rst   = BUS_GEN_BIT_RST;
+   arguments.idx_addr  = -1;
+   arguments.width     = 16;
+   arguments.machine   = MACHINE_DEFAULT;
+   arguments.range_hi  = LLONG_MAX;
+   sample_bytes = sizeof(uint16_t);
+   record_bytes = sizeof(uint16_t);
+
+   cycles = malloc(max_cycles * sizeof(bus_gen_cycle_t));
+   instrs = malloc(max_cycles / 2 * sizeof(bus_gen_instr_t));
+   samples = malloc(max_cycles * 2 * BENCH_OVERSAMPLE * sizeof(uint16_t));
+   if (!cycles || !instrs || !samples) {
+      perror("failed to allocate benchmark buffers");
+      return 2;
+   }
+
+   printf("decode6502 benchmark: %d cycles, best of %d runs\n\n", max_cycles, runs);
+   printf("%-24s %-8s %10s %10s %10s %10s\n", "capture", "stage", "Msample/s", "Mcycle/s", "Minstr/s", "ns/unit");
+   bench_cpu(0);
+   bench_cpu(1);
+   return 0;
+}
@@ -0,0 +1,780 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "em_6502.h"
+#include "bus_gen.h"
+
+// Instructions with a fixed cycle count and a simple bus pattern (the opcode
+// and operand fetches, then reads, with any write last), which are the same
+// on the 6502 and 65C02
+static const uint8_t opcodes[] = {
+   // Implied and accumulator
+   0xEA, 0xE8, 0xC8, 0xCA, 0x88, 0xAA, 0xA8, 0x8A, 0x98, 0x18, 0x38, 0xD8,
+   0xB8, 0x0A, 0x4A, 0x2A, 0x6A,
+   // Immediate
+   0xA9, 0xA2, 0xA0, 0x69, 0xE9, 0x29, 0x09, 0x49, 0xC9, 0xE0, 0xC0,
+   // Zero page
+   0xA5, 0xA6, 0xA4, 0x65, 0x25, 0x05, 0x45, 0xC5, 0x24, 0x85, 0x86, 0x84,
+   // Absolute
+   0xAD, 0xAE, 0xAC, 0x6D, 0x2D, 0x0D, 0x4D, 0xCD, 0x8D, 0x8E, 0x8C,
+   // Stack
+   0x48, 0x68
+};
+
+#define JMP_ABS 0x4C
+
+// The register an instruction writes, as far as the emulator knows, or -1
+static int written_value(int opcode) {
+   switch (opcode) {
+   case 0x85:
+   case 0x8D:
+   case 0x48:
+      return em_get_A();
+   case 0x86:
+   case 0x8E:
+      return em_get_X();
+   case 0x84:
+   case 0x8C:
+      return em_get_Y();
+   }
+   return -1;
+}
+
+static uint32_t next_random(uint32_t *state) {
+   *state = *state * 1103515245 + 12345;
+   return *state >> 16;
+}
+
+int bus_gen_cycles(bus_gen_cycle_t *cycles, int max_cycles, bus_gen_instr_t *instrs, int *num_instrs, int len, uint32_t seed) {
+   uint32_t state = seed;
+   int *program = malloc(len * 3 * sizeof(int));
+   if (!program) {
+      perror("failed to allocate program");
+      exit(1);
+   }
+
+   // The program: opcode and operand bytes of each instruction
+   for (int i = 0; i < len; i++) {
+      int opcode = (i == len - 1) ? JMP_ABS : opcodes[next_random(&state) % sizeof(opcodes)];
+      program[i * 3] = opcode;
+      program[i * 3 + 1] = (opcode == JMP_ABS) ? (BUS_GEN_ORIGIN & 0xff) : next_random(&state) & 0xff;
+      program[i * 3 + 2] = (opcode == JMP_ABS) ? (BUS_GEN_ORIGIN >> 8) : next_random(&state) & 0x7f;
+   }
+
+   // Run it, emulating each instruction so that stores write what the
+   // decoder's emulator expects
+   em_invalidate();
+   int num = 0;
+   int count = 0;
+   for (int i = 0; ; i = (i + 1) % len) {
+      const int *op = program + i * 3;
+      InstrType *instr = &instr_table[op[0]];
+      if (num + instr->cycles > max_cycles) {
+         break;
+      }
+      bus_gen_instr_t in = { op[0], 0, 0, 0, 0, instr->cycles };
+      for (int c = 0; c < instr->cycles; c++) {
+         bus_gen_cycle_t *cycle = &cycles[num++];
+         cycle->addr = 0;
+         cycle->sync = (c == 0);
+         cycle->rnw = 1;
+         cycle->rdy = 1;
+         cycle->rst = 1;
+         if (c < instr->len) {
+            // Opcode and operand fetches
+            cycle->data = op[c];
+         } else if (instr->optype == WRITEOP && c == instr->cycles - 1) {
+            int value = written_value(op[0]);
+            cycle->data = (value >= 0) ? value : next_random(&state) & 0xff;
+            cycle->rnw = 0;
+            in.write_accumulator = (in.write_accumulator << 8) | cycle->data;
+         } else {
+            cycle->data = next_random(&state) & 0xff;
+            in.read_accumulator = (in.read_accumulator << 8) | cycle->data;
+         }
+      }
+      if (instr->len > 1) {
+         in.op1 = op[1];
+      }
+      if (instr->len > 2) {
+         in.op2 = op[2];
+      }
+      if (instr->emulate) {
+         if (instr->optype == WRITEOP) {
+            instr->emulate(in.write_accumulator & 0xff);
+         } else if (instr->mode == IMM) {
+            instr->emulate(in.op1);
+         } else {
+            instr->emulate(in.read_accumulator & 0xff);
+         }
+      }
+      if (instrs) {
+         instrs[count] = in;
+      }
+      count++;
+   }
+   free(program);
+   *num_instrs = count;
+   return num;
+}
+
+// Store a sample of the given size (2 or 4 bytes) at ptr, returning the next
+static uint8_t *put_sample(uint8_t *ptr, int bytes, uint32_t sample) {
+   if (bytes == 2) {
+      uint16_t narrow = sample;
+      memcpy(ptr, &narrow, 2);
+   } else {
+      memcpy(ptr, &sample, 4);
+   }
+   return ptr + bytes;
+}
+
+// bus_gen_samples(), with samples of the given size, and the address bus
+// from bit addr_bit (-1 for none)
+static int make_samples(void *samples, int bytes, int addr_bit, const bus_gen_cycle_t *prev, const bus_gen_cycle_t *cycles, int num, int oversample) {
+   uint8_t *ptr = samples;
+   for (int i = 0; i < num; i++) {
+      const bus_gen_cycle_t *c = &cycles[i];
+      uint32_t pins = (c->rnw << BUS_GEN_BIT_RNW) | (c->sync << BUS_GEN_BIT_SYNC) | (c->rdy << BUS_GEN_BIT_RDY) | (c->rst << BUS_GEN_BIT_RST);
+      if (addr_bit >= 0) {
+         pins |= (uint32_t) c->addr << addr_bit;
+      }
+      if (oversample == 0) {
+         ptr = put_sample(ptr, bytes, pins | c->data);
+         continue;
+      }
+      // The previous cycle's data is held just after the falling edge
+      ptr = put_sample(ptr, bytes, pins | (prev ? prev->data : c->data));
+      prev = c;
+      for (int j = 1; j < oversample; j++) {
+         ptr = put_sample(ptr, bytes, pins | c->data);
+      }
+      for (int j = 0; j < oversample; j++) {
+         ptr = put_sample(ptr, bytes, pins | (1 << BUS_GEN_BIT_PHI2) | c->data);
+      }
+   }
+   return (ptr - (uint8_t *) samples) / bytes;
+}
+
+int bus_gen_samples(uint16_t *samples, const bus_gen_cycle_t *prev, const bus_gen_cycle_t *cycles, int num, int oversample) {
+   return make_samples(samples, sizeof(uint16_t), -1, prev, cycles, num, oversample);
+}
+
+int bus_gen_samples_addr(uint32_t *samples, const bus_gen_cycle_t *prev, const bus_gen_cycle_t *cycles, int num, int oversample) {
+   return make_samples(samples, sizeof(uint32_t), BUS_GEN_BIT_ADDR, prev, cycles, num, oversample);
+}
+
+// ====================================================================
+// Cycle level 6502/65C02 core
+// ====================================================================
+
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+
+// What an opcode does, from its mnemonic (the bit number of BBR, BBS, RMB
+// and SMB is kept separately)
+enum {
+   K_NONE,
+   // Reads
+   K_ADC, K_AND, K_BIT, K_CMP, K_CPX, K_CPY, K_EOR, K_LDA, K_LDX, K_LDY,
+   K_ORA, K_SBC, K_NOP,
+   // Stores
+   K_STA, K_STX, K_STY, K_STZ,
+   // Read-modify-writes
+   K_ASL, K_LSR, K_ROL, K_ROR, K_INC, K_DEC, K_TSB, K_TRB, K_RMB, K_SMB,
+   // Implied
+   K_CLC, K_CLD, K_CLI, K_CLV, K_SEC, K_SED, K_SEI, K_TAX, K_TAY, K_TSX,
+   K_TXA, K_TXS, K_TYA, K_INX, K_INY, K_DEX, K_DEY,
+   // Stack
+   K_PHA, K_PHP, K_PHX, K_PHY, K_PLA, K_PLP, K_PLX, K_PLY,
+   // Flow
+   K_BRK, K_JMP, K_JSR, K_RTI, K_RTS, K_BPL, K_BMI, K_BVC, K_BVS, K_BCC,
+   K_BCS, K_BNE, K_BEQ, K_BRA, K_BBR, K_BBS,
+   NUM_KINDS
+};
+
+static const char *kind_names[NUM_KINDS] = {
+   "",
+   "ADC", "AND", "BIT", "CMP", "CPX", "CPY", "EOR", "LDA", "LDX", "LDY",
+   "ORA", "SBC", "NOP",
+   "STA", "STX", "STY", "STZ",
+   "ASL", "LSR", "ROL", "ROR", "INC", "DEC", "TSB", "TRB", "RMB", "SMB",
+   "CLC", "CLD", "CLI", "CLV", "SEC", "SED", "SEI", "TAX", "TAY", "TSX",
+   "TXA", "TXS", "TYA", "INX", "INY", "DEX", "DEY",
+   "PHA", "PHP", "PHX", "PHY", "PLA", "PLP", "PLX", "PLY",
+   "BRK", "JMP", "JSR", "RTI", "RTS", "BPL", "BMI", "BVC", "BVS", "BCC",
+   "BCS", "BNE", "BEQ", "BRA", "BBR", "BBS"
+};
+
+#define IS_STORE(k) ((k) >= K_STA && (k) <= K_STZ)
+#define IS_RMW(k)   ((k) >= K_ASL && (k) <= K_SMB)
+
+// Whether an address is on the 1MHz bus of the BBC Master (FRED, JIM and
+// the slow parts of SHEILA)
+static int is_1mhz(int addr) {
+   return (addr >= 0xFC00 && addr <= 0xFDFF) ||
+      (addr >= 0xFE00 && addr <= 0xFE1F) ||
+      (addr >= 0xFE40 && addr <= 0xFE7F) ||
+      (addr >= 0xFE80 && addr <= 0xFE9F) ||
+      (addr >= 0xFEC0 && addr <= 0xFEDF);
+}
+
+// Output a bus cycle, preceded by any cycles with rdy low
+static void bus(bus_gen_cpu_t *cpu, int addr, int data, int rnw, int sync) {
+   bus_gen_cycle_t c = { addr & 0xffff, data, rnw, sync, 0, !cpu->rst };
+   int stretch = 0;
+   if (!cpu->rst) {
+      if (cpu->master && is_1mhz(c.addr)) {
+         // Aligned to the 1MHz clock, so one or two extra cycles
+         stretch = 1 + (cpu->cycles & 1);
+      } else if (cpu->rdy_percent && (rnw || cpu->c02) && next_random(&cpu->random) % 100 < cpu->rdy_percent) {
+         stretch = 1 + next_random(&cpu->random) % 3;
+      }
+   }
+   for (int i = 0; i < stretch; i++) {
+      cpu->emit(cpu->user, &c);
+   }
+   c.rdy = 1;
+   cpu->emit(cpu->user, &c);
+   cpu->cycles += stretch + 1;
+   cpu->bus_cycles++;
+}
+
+static int rd(bus_gen_cpu_t *cpu, int addr) {
+   int data = cpu->mem[addr & 0xffff];
+   bus(cpu, addr, data, 1, 0);
+   return data;
+}
+
+static void wr(bus_gen_cpu_t *cpu, int addr, int data) {
+   cpu->mem[addr & 0xffff] = data;
+   bus(cpu, addr, data, 0, 0);
+}
+
+static int fetch(bus_gen_cpu_t *cpu) {
+   int data = rd(cpu, cpu->pc);
+   cpu->pc = (cpu->pc + 1) & 0xffff;
+   return data;
+}
+
+static void push(bus_gen_cpu_t *cpu, int data) {
+   wr(cpu, 0x100 | cpu->s, data);
+   cpu->s = (cpu->s - 1) & 0xff;
+}
+
+static int pull(bus_gen_cpu_t *cpu) {
+   cpu->s = (cpu->s + 1) & 0xff;
+   return rd(cpu, 0x100 | cpu->s);
+}
+
+static void set_flag(bus_gen_cpu_t *cpu, int flag, int on) {
+   cpu->p = on ? (cpu->p | flag) : (cpu->p & ~flag);
+}
+
+static int set_nz(bus_gen_cpu_t *cpu, int value) {
+   value &= 0xff;
+   set_flag(cpu, FLAG_Z, value == 0);
+   set_flag(cpu, FLAG_N, value & 0x80);
+   return value;
+}
+
+static void compare(bus_gen_cpu_t *cpu, int reg, int value) {
+   set_nz(cpu, reg - value);
+   set_flag(cpu, FLAG_C, reg >= value);
+}
+
+// The same algorithms as em_6502.c, so the decoder's emulator agrees even
+// for invalid BCD
+static void adc(bus_gen_cpu_t *cpu, int operand) {
+   int a = cpu->a;
+   int c = cpu->p & FLAG_C;
+   if (cpu->p & FLAG_D) {
+      int al = (a & 0xF) + (operand & 0xF) + c;
+      int ah = 0;
+      set_flag(cpu, FLAG_Z, ((a + operand + c) & 0xff) == 0);
+      if (al > 9) {
+         al = (al - 10) & 0xF;
+         ah = 1;
+      }
+      ah += (a >> 4) + (operand >> 4);
+      set_flag(cpu, FLAG_N, ah & 8);
+      set_flag(cpu, FLAG_V, (((ah << 4) ^ a) & 128) && !((a ^ operand) & 128));
+      set_flag(cpu, FLAG_C, ah > 9);
+      if (ah > 9) {
+         ah = (ah - 10) & 0xF;
+      }
+      cpu->a = ((al & 0xF) | (ah << 4)) & 0xff;
+      if (cpu->c02) {
+         set_nz(cpu, cpu->a);
+      }
+   } else {
+      int tmp = a + operand + c;
+      set_flag(cpu, FLAG_C, tmp & 0x100);
+      set_flag(cpu, FLAG_V, !((a ^ operand) & 0x80) && ((a ^ tmp) & 0x80));
+      cpu->a = set_nz(cpu, tmp);
+   }
+}
+
+static void sbc(bus_gen_cpu_t *cpu, int operand) {
+   int a = cpu->a;
+   int borrow = (cpu->p & FLAG_C) ? 0 : 1;
+   int tmp = a - operand - borrow;
+   if ((cpu->p & FLAG_D) && cpu->c02) {
+      int al = (a & 15) - (operand & 15) - borrow;
+      set_flag(cpu, FLAG_C, !(tmp & 0x100));
+      set_flag(cpu, FLAG_V, ((a ^ operand) & 0x80) && ((a ^ tmp) & 0x80));
+      if (tmp < 0) {
+         tmp -= 0x60;
+      }
+      if (al < 0) {
+         tmp -= 0x06;
+      }
+      cpu->a = set_nz(cpu, tmp);
+   } else if (cpu->p & FLAG_D) {
+      int al = (a & 15) - (operand & 15) - borrow;
+      int ah = (a >> 4) - (operand >> 4);
+      set_flag(cpu, FLAG_Z, (tmp & 0xff) == 0);
+      set_flag(cpu, FLAG_N, tmp & 0x80);
+      set_flag(cpu, FLAG_V, ((a ^ operand) & 0x80) && ((a ^ tmp) & 0x80));
+      if (al & 16) {
+         al = (al - 6) & 0xF;
+         ah--;
+      }
+      set_flag(cpu, FLAG_C, !(ah & 16));
+      if (ah & 16) {
+         ah = (ah - 6) & 0xF;
+      }
+      cpu->a = (al & 0xF) | ((ah & 0xF) << 4);
+   } else {
+      set_flag(cpu, FLAG_C, !(tmp & 0x100));
+      set_flag(cpu, FLAG_V, ((a ^ operand) & 0x80) && ((a ^ tmp) & 0x80));
+      cpu->a = set_nz(cpu, tmp);
+   }
+}
+
+// Instructions that read an operand
+static void read_op(bus_gen_cpu_t *cpu, int kind, int operand, int immediate) {
+   switch (kind) {
+   case K_ADC: adc(cpu, operand); break;
+   case K_SBC: sbc(cpu, operand); break;
+   case K_AND: cpu->a = set_nz(cpu, cpu->a & operand); break;
+   case K_ORA: cpu->a = set_nz(cpu, cpu->a | operand); break;
+   case K_EOR: cpu->a = set_nz(cpu, cpu->a ^ operand); break;
+   case K_LDA: cpu->a = set_nz(cpu, operand); break;
+   case K_LDX: cpu->x = set_nz(cpu, operand); break;
+   case K_LDY: cpu->y = set_nz(cpu, operand); break;
+   case K_CMP: compare(cpu, cpu->a, operand); break;
+   case K_CPX: compare(cpu, cpu->x, operand); break;
+   case K_CPY: compare(cpu, cpu->y, operand); break;
+   case K_BIT:
+      set_flag(cpu, FLAG_Z, !(cpu->a & operand));
+      // BIT #imm only affects Z
+      if (!immediate) {
+         set_flag(cpu, FLAG_N, operand & 0x80);
+         set_flag(cpu, FLAG_V, operand & 0x40);
+      }
+      break;
+   }
+}
+
+// Read-modify-write instructions, returning the new value
+static int rmw_op(bus_gen_cpu_t *cpu, int kind, int bit, int value) {
+   int carry = cpu->p & FLAG_C;
+   switch (kind) {
+   case K_ASL:
+      set_flag(cpu, FLAG_C, value & 0x80);
+      return set_nz(cpu, value << 1);
+   case K_LSR:
+      set_flag(cpu, FLAG_C, value & 1);
+      return set_nz(cpu, value >> 1);
+   case K_ROL:
+      set_flag(cpu, FLAG_C, value & 0x80);
+      return set_nz(cpu, (value << 1) | carry);
+   case K_ROR:
+      set_flag(cpu, FLAG_C, value & 1);
+      return set_nz(cpu, (value >> 1) | (carry << 7));
+   case K_INC:
+      return set_nz(cpu, value + 1);
+   case K_DEC:
+      return set_nz(cpu, value - 1);
+   case K_TSB:
+      set_flag(cpu, FLAG_Z, !(cpu->a & value));
+      return value | cpu->a;
+   case K_TRB:
+      set_flag(cpu, FLAG_Z, !(cpu->a & value));
+      return value & ~cpu->a & 0xff;
+   case K_RMB:
+      return value & ~(1 << bit) & 0xff;
+   case K_SMB:
+      return value | (1 << bit);
+   }
+   return value;
+}
+
+static void implied_op(bus_gen_cpu_t *cpu, int kind) {
+   switch (kind) {
+   case K_CLC: cpu->p &= ~FLAG_C; break;
+   case K_CLD: cpu->p &= ~FLAG_D; break;
+   case K_CLI: cpu->p &= ~FLAG_I; break;
+   case K_CLV: cpu->p &= ~FLAG_V; break;
+   case K_SEC: cpu->p |= FLAG_C; break;
+   case K_SED: cpu->p |= FLAG_D; break;
+   case K_SEI: cpu->p |= FLAG_I; break;
+   case K_TAX: cpu->x = set_nz(cpu, cpu->a); break;
+   case K_TAY: cpu->y = set_nz(cpu, cpu->a); break;
+   case K_TSX: cpu->x = set_nz(cpu, cpu->s); break;
+   case K_TXA: cpu->a = set_nz(cpu, cpu->x); break;
+   case K_TXS: cpu->s = cpu->x; break;
+   case K_TYA: cpu->a = set_nz(cpu, cpu->y); break;
+   case K_INX: cpu->x = set_nz(cpu, cpu->x + 1); break;
+   case K_INY: cpu->y = set_nz(cpu, cpu->y + 1); break;
+   case K_DEX: cpu->x = set_nz(cpu, cpu->x - 1); break;
+   case K_DEY: cpu->y = set_nz(cpu, cpu->y - 1); break;
+   }
+}
+
+static int branch_taken(bus_gen_cpu_t *cpu, int kind) {
+   int p = cpu->p;
+   switch (kind) {
+   case K_BPL: return !(p & FLAG_N);
+   case K_BMI: return p & FLAG_N;
+   case K_BVC: return !(p & FLAG_V);
+   case K_BVS: return p & FLAG_V;
+   case K_BCC: return !(p & FLAG_C);
+   case K_BCS: return p & FLAG_C;
+   case K_BNE: return !(p & FLAG_Z);
+   case K_BEQ: return p & FLAG_Z;
+   }
+   return 1;
+}
+
+// The cycles of a branch after its offset has been fetched
+static void branch(bus_gen_cpu_t *cpu, int offset, int taken) {
+   if (taken) {
+      int target = (cpu->pc + (int8_t) offset) & 0xffff;
+      rd(cpu, cpu->pc);
+      if ((target ^ cpu->pc) & 0xff00) {
+         rd(cpu, (cpu->pc & 0xff00) | (target & 0xff));
+      }
+      cpu->pc = target;
+   }
+}
+
+// Push the return address and status, and jump through a vector
+static void interrupt(bus_gen_cpu_t *cpu, int vector, int brk) {
+   push(cpu, cpu->pc >> 8);
+   push(cpu, cpu->pc & 0xff);
+   push(cpu, cpu->p | FLAG_U | (brk ? FLAG_B : 0));
+   cpu->p |= FLAG_I;
+   if (cpu->c02) {
+      cpu->p &= ~FLAG_D;
+   }
+   int lo = rd(cpu, vector);
+   int hi = rd(cpu, vector + 1);
+   cpu->pc = lo | (hi << 8);
+}
+
+// The address of a memory operand, with the cycles before the access
+// itself; *dummy is set to the address a page crossing reads from, and
+// *crossed to whether one happens
+static int effective_address(bus_gen_cpu_t *cpu, AddrMode mode, int *dummy, int *crossed) {
+   int base = 0;
+   int index = 0;
+   int zp;
+   int lo;
+   *crossed = 0;
+   switch (mode) {
+   case ZP:
+      return fetch(cpu);
+   case ZPX:
+   case ZPY:
+      zp = fetch(cpu);
+      rd(cpu, zp);
+      return (zp + (mode == ZPX ? cpu->x : cpu->y)) & 0xff;
+   case ABS:
+      lo = fetch(cpu);
+      return lo | (fetch(cpu) << 8);
+   case ABSX:
+   case ABSY:
+      lo = fetch(cpu);
+      base = lo | (fetch(cpu) << 8);
+      index = (mode == ABSX) ? cpu->x : cpu->y;
+      break;
+   case INDX:
+      zp = fetch(cpu);
+      rd(cpu, zp);
+      zp = (zp + cpu->x) & 0xff;
+      lo = rd(cpu, zp);
+      return lo | (rd(cpu, (zp + 1) & 0xff) << 8);
+   case INDY:
+   case IND:
+      zp = fetch(cpu);
+      lo = rd(cpu, zp);
+      base = lo | (rd(cpu, (zp + 1) & 0xff) << 8);
+      index = (mode == INDY) ? cpu->y : 0;
+      break;
+   default:
+      return 0;
+   }
+   int addr = (base + index) & 0xffff;
+   *crossed = (addr ^ base) & 0xff00;
+   // On a page crossing the 65C02 re-reads the last operand byte instead of
+   // the wrong address
+   *dummy = (cpu->c02 && *crossed) ? ((cpu->pc - 1) & 0xffff) : ((base & 0xff00) | (addr & 0xff));
+   return addr;
+}
+
+// Instructions with a memory operand (other than jumps and BBR/BBS)
+static void memory_op(bus_gen_cpu_t *cpu, InstrType *instr, int kind, int bit) {
+   int dummy = 0;
+   int crossed;
+   int addr = effective_address(cpu, instr->mode, &dummy, &crossed);
+   int indexed = (instr->mode == ABSX || instr->mode == ABSY || instr->mode == INDY);
+   if (IS_STORE(kind)) {
+      if (indexed) {
+         rd(cpu, dummy);
+      }
+      int value = 0;
+      switch (kind) {
+      case K_STA: value = cpu->a; break;
+      case K_STX: value = cpu->x; break;
+      case K_STY: value = cpu->y; break;
+      }
+      wr(cpu, addr, value);
+   } else if (IS_RMW(kind)) {
+      // The 65C02 only takes the extra cycle of abs,X if the page is crossed,
+      // except for INC and DEC
+      if (indexed && (!cpu->c02 || crossed || kind == K_INC || kind == K_DEC)) {
+         rd(cpu, dummy);
+      }
+      int value = rd(cpu, addr);
+      // The 6502 writes the old value back, the 65C02 reads it again
+      if (cpu->c02) {
+         rd(cpu, addr);
+      } else {
+         wr(cpu, addr, value);
+      }
+      wr(cpu, addr, rmw_op(cpu, kind, bit, value));
+   } else {
+      if (indexed && crossed) {
+         rd(cpu, dummy);
+      }
+      int value = rd(cpu, addr);
+      if (cpu->c02 && instr->decimalcorrect && (cpu->p & FLAG_D)) {
+         rd(cpu, addr);
+      }
+      read_op(cpu, kind, value, 0);
+   }
+}
+
+void bus_gen_cpu_init(bus_gen_cpu_t *cpu, int c02, bus_gen_emit_t emit, void *user) {
+   memset(cpu, 0, sizeof(*cpu));
+   cpu->c02 = c02;
+   cpu->s = 0xff;
+   cpu->p = FLAG_I;
+   cpu->random = 1;
+   cpu->emit = emit;
+   cpu->user = user;
+   for (int opcode = 0; opcode < 256; opcode++) {
+      const char *mnemonic = instr_table[opcode].mnemonic;
+      for (int kind = 1; kind < NUM_KINDS; kind++) {
+         if (!strncmp(mnemonic, kind_names[kind], 3)) {
+            cpu->kind[opcode] = kind;
+            cpu->bit[opcode] = (mnemonic[3] >= '0' && mnemonic[3] <= '7') ? mnemonic[3] - '0' : 0;
+            break;
+         }
+      }
+   }
+}
+
+void bus_gen_cpu_randomize(bus_gen_cpu_t *cpu, uint32_t seed) {
+   int valid[256];
+   int num = 0;
+   for (int opcode = 0; opcode < 256; opcode++) {
+      // Not undocumented opcodes, WAI or STP, which are only NOPs here
+      if (cpu->kind[opcode] != K_NONE) {
+         valid[num++] = opcode;
+      }
+   }
+   for (int i = 0; i < 0x10000; i++) {
+      cpu->mem[i] = valid[next_random(&seed) % num];
+   }
+}
+
+void bus_gen_cpu_reset(bus_gen_cpu_t *cpu, int hold) {
+   cpu->rst = 1;
+   for (int i = 0; i < hold; i++) {
+      rd(cpu, cpu->pc);
+   }
+   cpu->rst = 0;
+   rd(cpu, cpu->pc);
+   rd(cpu, cpu->pc);
+   // Then an interrupt sequence with the writes suppressed
+   bus(cpu, cpu->pc, cpu->mem[cpu->pc], 1, 1);
+   rd(cpu, cpu->pc);
+   for (int i = 0; i < 3; i++) {
+      rd(cpu, 0x100 | cpu->s);
+      cpu->s = (cpu->s - 1) & 0xff;
+   }
+   cpu->p |= FLAG_I;
+   if (cpu->c02) {
+      cpu->p &= ~FLAG_D;
+   }
+   int lo = rd(cpu, 0xFFFC);
+   cpu->pc = lo | (rd(cpu, 0xFFFD) << 8);
+   cpu->irq = 0;
+   cpu->nmi = 0;
+}
+
+void bus_gen_cpu_step(bus_gen_cpu_t *cpu) {
+   int vector = 0;
+   if (cpu->nmi) {
+      cpu->nmi = 0;
+      vector = 0xFFFA;
+   } else if (cpu->irq && !(cpu->p & FLAG_I)) {
+      cpu->irq = 0;
+      vector = 0xFFFE;
+   }
+   if (vector) {
+      // The opcode is fetched but discarded
+      bus(cpu, cpu->pc, cpu->mem[cpu->pc], 1, 1);
+      rd(cpu, cpu->pc);
+      interrupt(cpu, vector, 0);
+      return;
+   }
+
+   long long start = cpu->bus_cycles;
+   int opcode = cpu->mem[cpu->pc];
+   bus(cpu, cpu->pc, opcode, 1, 1);
+   cpu->pc = (cpu->pc + 1) & 0xffff;
+
+   InstrType *instr = &instr_table[opcode];
+   int kind = cpu->kind[opcode];
+   int bit = cpu->bit[opcode];
+   int lo;
+   int hi;
+   int value;
+
+   switch (instr->mode) {
+   case IMP:
+   case IMPA:
+      if (instr->cycles == 1) {
+         // The 65C02's single cycle NOPs, and anything unsupported
+         break;
+      }
+      rd(cpu, cpu->pc);
+      switch (kind) {
+      case K_PHA: push(cpu, cpu->a); break;
+      case K_PHX: push(cpu, cpu->x); break;
+      case K_PHY: push(cpu, cpu->y); break;
+      case K_PHP: push(cpu, cpu->p | FLAG_U | FLAG_B); break;
+      case K_PLA:
+      case K_PLX:
+      case K_PLY:
+      case K_PLP:
+         rd(cpu, 0x100 | cpu->s);
+         value = pull(cpu);
+         if (kind == K_PLP) {
+            cpu->p = value & ~(FLAG_U | FLAG_B);
+         } else if (kind == K_PLA) {
+            cpu->a = set_nz(cpu, value);
+         } else if (kind == K_PLX) {
+            cpu->x = set_nz(cpu, value);
+         } else {
+            cpu->y = set_nz(cpu, value);
+         }
+         break;
+      case K_RTS:
+         rd(cpu, 0x100 | cpu->s);
+         lo = pull(cpu);
+         cpu->pc = lo | (pull(cpu) << 8);
+         fetch(cpu);
+         break;
+      case K_RTI:
+         rd(cpu, 0x100 | cpu->s);
+         cpu->p = pull(cpu) & ~(FLAG_U | FLAG_B);
+         lo = pull(cpu);
+         cpu->pc = lo | (pull(cpu) << 8);
+         break;
+      default:
+         if (instr->mode == IMPA) {
+            cpu->a = rmw_op(cpu, kind, bit, cpu->a);
+         } else {
+            implied_op(cpu, kind);
+         }
+         break;
+      }
+      break;
+   case IMM:
+      if (kind == K_BRK) {
+         // The signature byte is skipped
+         fetch(cpu);
+         interrupt(cpu, 0xFFFE, 1);
+         break;
+      }
+      value = fetch(cpu);
+      if (cpu->c02 && instr->decimalcorrect && (cpu->p & FLAG_D)) {
+         rd(cpu, cpu->pc);
+      }
+      read_op(cpu, kind, value, 1);
+      break;
+   case BRA:
+      value = fetch(cpu);
+      branch(cpu, value, branch_taken(cpu, kind));
+      break;
+   case ZPR:
+      lo = fetch(cpu);
+      value = rd(cpu, lo);
+      rd(cpu, lo);
+      branch(cpu, fetch(cpu), ((value >> bit) & 1) == (kind == K_BBS));
+      break;
+   case IND16:
+   case IND1X:
+      lo = fetch(cpu);
+      hi = fetch(cpu);
+      value = (lo | (hi << 8)) + (instr->mode == IND1X ? cpu->x : 0);
+      if (cpu->c02) {
+         rd(cpu, cpu->pc - 1);
+         lo = rd(cpu, value);
+         hi = rd(cpu, value + 1);
+      } else {
+         // The 6502 does not carry into the high byte of the pointer
+         lo = rd(cpu, value);
+         hi = rd(cpu, (value & 0xff00) | ((value + 1) & 0xff));
+      }
+      cpu->pc = lo | (hi << 8);
+      break;
+   case ABS:
+      if (kind == K_JMP) {
+         lo = fetch(cpu);
+         cpu->pc = lo | (fetch(cpu) << 8);
+         break;
+      } else if (kind == K_JSR) {
+         lo = fetch(cpu);
+         rd(cpu, 0x100 | cpu->s);
+         push(cpu, cpu->pc >> 8);
+         push(cpu, cpu->pc & 0xff);
+         cpu->pc = lo | (fetch(cpu) << 8);
+         break;
+      }
+      memory_op(cpu, instr, kind, bit);
+      break;
+   default:
+      memory_op(cpu, instr, kind, bit);
+      break;
+   }
+
+   // Pad the 65C02's longer NOPs to their cycle counts
+   if (kind == K_NOP || kind == K_NONE) {
+      while (cpu->bus_cycles - start < instr->cycles) {
+         rd(cpu, cpu->pc);
+      }
+   }
+}
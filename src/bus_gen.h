@@ -0,0 +1,133 @@
+#ifndef _INCLUDE_BUS_GEN_H
+#define _INCLUDE_BUS_GEN_H
+
+#include <inttypes.h>
+
+// ====================================================================
+// Synthetic bus cycle generator
+// ====================================================================
+//
+// bus_gen_cycles() generates the bus activity of a deterministic
+// pseudo-random program, for benchmarking without a capture. The program is a loop of simple
+// instructions (implied, immediate, zero page and absolute, plus stack
+// pushes and pulls) ending in a JMP back to the start, with no branches,
+// page crossings or decimal mode, so every instruction takes the number of
+// cycles in instr_table and both decoders can follow it. The instructions are
+// run through the emulator as they are generated, so that stores write the
+// register values it expects.
+//
+// bus_gen_cpu_*() run any program on a cycle level 6502/65C02 core instead,
+// for reproducible test captures (see gen6502.c).
+
+// The bit numbers used in generated samples (decode6502's defaults); bit 15
+// is always 0, so mapping rdy to it stops any cycle being decoded
+#define BUS_GEN_BIT_RNW    8
+#define BUS_GEN_BIT_SYNC   9
+#define BUS_GEN_BIT_RDY   10
+#define BUS_GEN_BIT_PHI2  11
+#define BUS_GEN_BIT_RST   14
+#define BUS_GEN_BIT_ZERO  15
+
+// The start bit of the address bus, in 32 bit samples
+#define BUS_GEN_BIT_ADDR  16
+
+// The start address of the program
+#define BUS_GEN_ORIGIN    0x1000
+
+// A bus cycle
+typedef struct {
+   uint16_t addr;
+   uint8_t data;
+   uint8_t rnw;
+   uint8_t sync;
+   uint8_t rdy;
+   uint8_t rst;
+} bus_gen_cycle_t;
+
+// An instruction, with the values analyze_instruction() is passed for it
+typedef struct {
+   int opcode;
+   int op1;
+   int op2;
+   int read_accumulator;
+   int write_accumulator;
+   int cycles;
+} bus_gen_instr_t;
+
+// Generate up to max_cycles cycles of the program (of len instructions) with
+// the given seed, using the current instr_table (so em_init() must have been
+// called), and leaving the emulator state at the end of the program. The
+// instructions are also stored in instrs if not NULL, which must have room
+// for max_cycles / 2 entries. Returns the number of cycles, which always ends
+// at the end of an instruction; *num_instrs is set to the number of
+// instructions.
+int bus_gen_cycles(bus_gen_cycle_t *cycles, int max_cycles, bus_gen_instr_t *instrs, int *num_instrs, int len, uint32_t seed);
+
+// Convert cycles to 16 bit samples, with oversample samples per phase of phi2
+// (at least 2), or with one sample per cycle and no phi2 if oversample is 0.
+// The data bus is valid from the second sample of each cycle until the first
+// of the next, as the beeb, master and elk sampling all need, so prev is the
+// cycle before (NULL if none). samples must have room for num * 2 *
+// oversample (or num) samples. Returns the number of samples.
+int bus_gen_samples(uint16_t *samples, const bus_gen_cycle_t *prev, const bus_gen_cycle_t *cycles, int num, int oversample);
+
+// As bus_gen_samples(), but 32 bit samples with the address bus as well,
+// from bit BUS_GEN_BIT_ADDR (as decode6502 --width=32 --addr=16)
+int bus_gen_samples_addr(uint32_t *samples, const bus_gen_cycle_t *prev, const bus_gen_cycle_t *cycles, int num, int oversample);
+
+// ====================================================================
+// Cycle level 6502/65C02 core
+// ====================================================================
+//
+// Executes the documented instructions with the bus cycles of the real CPU
+// (including dummy accesses), starting from instr_table's cycle counts, plus
+// page crossings, taken branches and the 65C02's decimal mode cycle.
+// Undocumented 6502 opcodes, and the 65C02's WAI and STP, take the cycles in
+// instr_table as if they were NOPs.
+
+typedef void (*bus_gen_emit_t)(void *user, const bus_gen_cycle_t *cycle);
+
+typedef struct {
+   uint8_t mem[0x10000];
+   int a;
+   int x;
+   int y;
+   int s;
+   int p;
+   int pc;
+   int c02;
+   // Interrupt inputs, pending until taken
+   int irq;
+   int nmi;
+   // Percentage of cycles (reads only on the 6502) held with rdy low
+   int rdy_percent;
+   // Stretch accesses to the 1MHz bus as the BBC Master does (with rdy low)
+   int master;
+   uint32_t random;
+   // Cycles output so far, including those with rdy low
+   long long cycles;
+   // Cycles output so far with rdy high
+   long long bus_cycles;
+   // The semantics of each opcode (internal)
+   uint8_t kind[256];
+   uint8_t bit[256];
+   int rst;
+   bus_gen_emit_t emit;
+   void *user;
+} bus_gen_cpu_t;
+
+// Set up the core for the current instr_table (so em_init() must have been
+// called) with zeroed memory; emit is called for every cycle
+void bus_gen_cpu_init(bus_gen_cpu_t *cpu, int c02, bus_gen_emit_t emit, void *user);
+
+// Fill memory with random valid opcodes (as operands too), so that wherever
+// execution goes it only meets instructions the core models exactly
+void bus_gen_cpu_randomize(bus_gen_cpu_t *cpu, uint32_t seed);
+
+// Hold reset low for hold cycles, then run the reset sequence
+void bus_gen_cpu_reset(bus_gen_cpu_t *cpu, int hold);
+
+// Execute one instruction, or take a pending interrupt
+void bus_gen_cpu_step(bus_gen_cpu_t *cpu);
+
+#endif
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "capture.h"
+
+static void put_le(uint8_t *buf, uint64_t value, int bytes) {
+   for (int i = 0; i < bytes; i++) {
+      buf[i] = value & 255;
+      value >>= 8;
+   }
+}
+
+static uint64_t get_le(const uint8_t *buf, int bytes) {
+   uint64_t value = 0;
+   for (int i = bytes - 1; i >= 0; i--) {
+      value = (value << 8) | buf[i];
+   }
+   return value;
+}
+
+// Read a sample (or run length) of the given width
+static inline uint64_t get_value(const uint8_t *ptr, int bytes) {
+   switch (bytes) {
+   case 2:
+      return *(const uint16_t *) ptr;
+   case 4:
+      return *(const uint32_t *) ptr;
+   default:
+      return *(const uint64_t *) ptr;
+   }
+}
+
+// Header byte for a pin
+static int field_byte(int value) {
+   if (value == CAPTURE_UNCONNECTED) {
+      return 0xff;
+   } else if (value == CAPTURE_UNSPECIFIED) {
+      return 0xfe;
+   }
+   return value;
+}
+
+int capture_is_header(const uint8_t *buf, int len) {
+   return len >= CAPTURE_MAGIC_LEN && !memcmp(buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+}
+
+int capture_header_size(const uint8_t *buf) {
+   int size = get_le(buf + CAPTURE_OFS_SIZE, 2);
+   int version = buf[CAPTURE_OFS_VERSION];
+   if (version < 1 || size < CAPTURE_HEADER_SIZE_V1 || (version >= 2 && size < CAPTURE_HEADER_SIZE)) {
+      fprintf(stderr, "capture header: unsupported version %d (size %d)\n", version, size);
+      return -1;
+   }
+   return size;
+}
+
+int capture_parse_header(const uint8_t *buf, capture_header_t *hdr) {
+   int version = buf[CAPTURE_OFS_VERSION];
+   hdr->width = buf[CAPTURE_OFS_WIDTH];
+   if (hdr->width != 16 && hdr->width != 32 && hdr->width != 64) {
+      fprintf(stderr, "capture header: bad sample width %d\n", hdr->width);
+      return -1;
+   }
+   hdr->encoding = buf[CAPTURE_OFS_ENCODING];
+   if (hdr->encoding != CAPTURE_ENC_SAMPLES && hdr->encoding != CAPTURE_ENC_RLE) {
+      fprintf(stderr, "capture header: unknown encoding %d\n", hdr->encoding);
+      return -1;
+   }
+   for (int i = 0; i < CAPTURE_NUM_PINS; i++) {
+      int bit = buf[CAPTURE_OFS_PINS + i];
+      if (bit == 0xff) {
+         hdr->pins[i] = CAPTURE_UNCONNECTED;
+      } else if (bit == 0xfe) {
+         hdr->pins[i] = CAPTURE_UNSPECIFIED;
+      } else if (bit < hdr->width) {
+         hdr->pins[i] = bit;
+      } else {
+         fprintf(stderr, "capture header: bad bit number %d\n", bit);
+         return -1;
+      }
+   }
+   hdr->cpu = CAPTURE_UNSPECIFIED;
+   hdr->machine = CAPTURE_UNSPECIFIED;
+   hdr->sample_rate = 0;
+   hdr->index_count = 0;
+   hdr->index_offset = 0;
+   if (version >= 2) {
+      if (buf[CAPTURE_OFS_CPU] <= CAPTURE_CPU_6502_UND) {
+         hdr->cpu = buf[CAPTURE_OFS_CPU];
+      }
+      if (buf[CAPTURE_OFS_MACHINE] != 0xff) {
+         hdr->machine = buf[CAPTURE_OFS_MACHINE];
+      }
+      hdr->sample_rate = get_le(buf + CAPTURE_OFS_RATE, 4);
+      hdr->index_count = get_le(buf + CAPTURE_OFS_INDEX_COUNT, 4);
+      hdr->index_offset = get_le(buf + CAPTURE_OFS_INDEX, 8);
+   }
+   return 0;
+}
+
+int capture_format_header(uint8_t *buf, const capture_header_t *hdr) {
+   memset(buf, 0, CAPTURE_HEADER_SIZE);
+   memcpy(buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+   put_le(buf + CAPTURE_OFS_SIZE, CAPTURE_HEADER_SIZE, 2);
+   buf[CAPTURE_OFS_VERSION] = CAPTURE_VERSION;
+   buf[CAPTURE_OFS_WIDTH] = hdr->width;
+   buf[CAPTURE_OFS_ENCODING] = hdr->encoding;
+   for (int i = 0; i < CAPTURE_NUM_PINS; i++) {
+      buf[CAPTURE_OFS_PINS + i] = field_byte(hdr->pins[i]);
+   }
+   // Unspecified is 0xff for these
+   buf[CAPTURE_OFS_CPU] = (hdr->cpu < 0) ? 0xff : hdr->cpu;
+   buf[CAPTURE_OFS_MACHINE] = (hdr->machine < 0) ? 0xff : hdr->machine;
+   put_le(buf + CAPTURE_OFS_RATE, hdr->sample_rate, 4);
+   put_le(buf + CAPTURE_OFS_INDEX_COUNT, hdr->index_count, 4);
+   put_le(buf + CAPTURE_OFS_INDEX, hdr->index_offset, 8);
+   return CAPTURE_HEADER_SIZE;
+}
+
+int capture_read_index(int fd, const capture_header_t *hdr, capture_index_t **index) {
+   *index = NULL;
+   if (!hdr->index_count) {
+      return 0;
+   }
+   size_t size = (size_t) hdr->index_count * CAPTURE_INDEX_ENTRY_SIZE;
+   uint8_t *buf = malloc(size);
+   *index = malloc(hdr->index_count * sizeof(capture_index_t));
+   if (!buf || !*index) {
+      perror("failed to allocate capture index");
+      exit(1);
+   }
+   if (pread(fd, buf, size, hdr->index_offset) != (ssize_t) size) {
+      fprintf(stderr, "capture index: truncated\n");
+      free(buf);
+      free(*index);
+      *index = NULL;
+      return -1;
+   }
+   for (int i = 0; i < hdr->index_count; i++) {
+      const uint8_t *entry = buf + i * CAPTURE_INDEX_ENTRY_SIZE;
+      capture_index_t *e = &(*index)[i];
+      e->sample = get_le(entry, 8);
+      e->offset = get_le(entry + 8, 8);
+      e->kind = get_le(entry + 16, 4);
+   }
+   free(buf);
+   return hdr->index_count;
+}
+
+int capture_writer_open(capture_writer_t *w, const char *filename, const capture_header_t *hdr) {
+   uint8_t buf[CAPTURE_HEADER_SIZE];
+   w->header = *hdr;
+   w->header.encoding = CAPTURE_ENC_RLE;
+   w->header.index_count = 0;
+   w->header.index_offset = 0;
+   w->sample_bytes = hdr->width / 8;
+   w->max_repeat = (w->sample_bytes == 8) ? UINT64_MAX : (1ULL << hdr->width) - 1;
+   w->pending = 0;
+   w->samples = 0;
+   w->offset = CAPTURE_HEADER_SIZE;
+   w->next_sync = 0;
+   w->index = NULL;
+   w->index_max = 0;
+   w->file = fopen(filename, "w");
+   if (w->file == NULL) {
+      perror("failed to create capture file");
+      return 1;
+   }
+   if (fwrite(buf, capture_format_header(buf, &w->header), 1, w->file) != 1) {
+      perror("failed to write capture file");
+      return 1;
+   }
+   return 0;
+}
+
+// Output the current run
+static void flush_run(capture_writer_t *w) {
+   // Little endian, like the samples themselves
+   uint64_t record[2] = { w->sample, w->repeat };
+   fwrite(&record[0], w->sample_bytes, 1, w->file);
+   fwrite(&record[1], w->sample_bytes, 1, w->file);
+   w->samples += w->repeat + 1;
+   w->offset += 2 * w->sample_bytes;
+}
+
+static void add_index(capture_writer_t *w, int kind) {
+   if (w->header.index_count == w->index_max) {
+      w->index_max = w->index_max ? w->index_max * 2 : 256;
+      w->index = realloc(w->index, w->index_max * sizeof(capture_index_t));
+      if (!w->index) {
+         perror("failed to allocate capture index");
+         exit(1);
+      }
+   }
+   capture_index_t *e = &w->index[w->header.index_count++];
+   e->sample = w->samples;
+   e->offset = w->offset;
+   e->kind = kind;
+}
+
+// Whether a pin is high in a sample (never if it is not connected)
+static inline int pin_high(const capture_writer_t *w, uint64_t sample, int pin) {
+   int bit = w->header.pins[pin];
+   return bit >= 0 && ((sample >> bit) & 1);
+}
+
+// Index the run about to start with sample, if it is a good place to start
+// decoding. Only run boundaries are checked, since every edge starts a run.
+static void check_index(capture_writer_t *w, uint64_t sample) {
+   uint64_t prev = w->sample;
+   int phi2 = w->header.pins[CAPTURE_PIN_PHI2];
+   if (pin_high(w, sample, CAPTURE_PIN_RST) && !pin_high(w, prev, CAPTURE_PIN_RST)) {
+      add_index(w, CAPTURE_INDEX_RESET);
+   } else if (w->samples >= w->next_sync && pin_high(w, sample, CAPTURE_PIN_SYNC) &&
+              (phi2 < 0 || (pin_high(w, sample, CAPTURE_PIN_PHI2) && !pin_high(w, prev, CAPTURE_PIN_PHI2)))) {
+      add_index(w, CAPTURE_INDEX_SYNC);
+      w->next_sync = w->samples + CAPTURE_INDEX_INTERVAL;
+   }
+}
+
+// Append a run of 1 + repeat samples
+static inline void add_run(capture_writer_t *w, uint64_t sample, uint64_t repeat) {
+   if (w->pending && sample == w->sample && repeat < w->max_repeat - w->repeat) {
+      w->repeat += repeat + 1;
+      return;
+   }
+   if (w->pending) {
+      flush_run(w);
+      if (sample != w->sample) {
+         check_index(w, sample);
+      }
+   }
+   w->sample = sample;
+   w->repeat = repeat;
+   w->pending = 1;
+}
+
+void capture_write_samples(capture_writer_t *w, const void *samples, int num) {
+   const uint8_t *ptr = samples;
+   while (num-- > 0) {
+      add_run(w, get_value(ptr, w->sample_bytes), 0);
+      ptr += w->sample_bytes;
+   }
+}
+
+void capture_write_runs(capture_writer_t *w, const void *records, int num) {
+   const uint8_t *ptr = records;
+   while (num-- > 0) {
+      add_run(w, get_value(ptr, w->sample_bytes), get_value(ptr + w->sample_bytes, w->sample_bytes));
+      ptr += 2 * w->sample_bytes;
+   }
+}
+
+// Append the index and point the header at it
+static void write_index(capture_writer_t *w) {
+   uint8_t buf[CAPTURE_HEADER_SIZE];
+   if (!w->header.index_count || fseek(w->file, 0, SEEK_CUR)) {
+      // Not seekable (e.g. a pipe), so there can be no index
+      return;
+   }
+   for (int i = 0; i < w->header.index_count; i++) {
+      uint8_t entry[CAPTURE_INDEX_ENTRY_SIZE];
+      memset(entry, 0, sizeof(entry));
+      put_le(entry, w->index[i].sample, 8);
+      put_le(entry + 8, w->index[i].offset, 8);
+      put_le(entry + 16, w->index[i].kind, 4);
+      fwrite(entry, sizeof(entry), 1, w->file);
+   }
+   w->header.index_offset = w->offset;
+   if (fseek(w->file, 0, SEEK_SET) == 0) {
+      fwrite(buf, capture_format_header(buf, &w->header), 1, w->file);
+   }
+}
+
+int capture_writer_close(capture_writer_t *w) {
+   if (w->pending) {
+      flush_run(w);
+   }
+   write_index(w);
+   free(w->index);
+   w->index = NULL;
+   if (ferror(w->file) | fclose(w->file)) {
+      perror("failed to write capture file");
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,172 @@
+#ifndef _INCLUDE_CAPTURE_H
+#define _INCLUDE_CAPTURE_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+// ====================================================================
+// Capture file format
+// ====================================================================
+//
+// A capture file is a stream of little endian samples of 16, 32 or 64 bits.
+// A plain capture (as written by fx2pipe) has no header: the sample width,
+// encoding and pin mapping must then be given on the command line.
+//
+// A capture may start with a header instead, which makes it self-describing:
+//
+//   offset  size  contents
+//        0     8  magic: "6502CAP" followed by 0x1a
+//        8     2  header size in bytes; the records start at this offset
+//       10     1  format version (2; version 1 has no fields from 20 on)
+//       11     1  sample width in bits (16, 32 or 64)
+//       12     1  encoding (0 = one record per sample, 1 = run-length)
+//       13     7  bit numbers of data, rnw, sync, rdy, phi2, rst and addr
+//                 (0xff if unconnected, 0xfe if not specified); data and
+//                 addr are the lowest of 8 and 16 consecutive bits
+//       20     1  cpu (0 = 6502, 1 = 65C02, 2 = 6502 with undocumented
+//                 opcodes, 0xff if not specified)
+//       21     1  machine (0 = default, 1 = master, 2 = elk, 0xff if not
+//                 specified)
+//       22     2  reserved (zero)
+//       24     4  sample rate in Hz (0 if unknown)
+//       28     4  number of index entries
+//       32     8  file offset of the index (0 if there is none)
+//       40     8  reserved (zero)
+//
+// All values are little endian. Readers must skip any bytes between the
+// fields they know and the header size, so that later versions can add
+// fields; fields not specified are left to the command line.
+//
+// With run-length encoding each record is a sample followed by the number of
+// further identical samples (the run length minus one), both of the sample
+// width. Runs are not necessarily maximal: two consecutive records may hold
+// the same sample, and a run too long for the count is split.
+//
+// The index is a sparse list of places where decoding can start, so tools can
+// seek into a capture (or split it up) without scanning it first. Each entry
+// is 24 bytes:
+//
+//   offset  size  contents
+//        0     8  sample number (counting from 0)
+//        8     8  file offset of the record starting with that sample
+//       16     4  kind (1 = the start of an instruction, i.e. SYNC high
+//                 after a rising edge of phi2; 2 = the end of a reset)
+//       20     4  reserved (zero)
+//
+// Every reset is indexed, instruction starts no more than one every
+// CAPTURE_INDEX_INTERVAL samples.
+
+#define CAPTURE_MAGIC        "6502CAP\x1a"
+#define CAPTURE_MAGIC_LEN    8
+#define CAPTURE_VERSION      2
+#define CAPTURE_HEADER_SIZE  48
+
+// Header field offsets
+#define CAPTURE_OFS_SIZE         8
+#define CAPTURE_OFS_VERSION     10
+#define CAPTURE_OFS_WIDTH       11
+#define CAPTURE_OFS_ENCODING    12
+#define CAPTURE_OFS_PINS        13
+#define CAPTURE_OFS_CPU         20
+#define CAPTURE_OFS_MACHINE     21
+#define CAPTURE_OFS_RATE        24
+#define CAPTURE_OFS_INDEX_COUNT 28
+#define CAPTURE_OFS_INDEX       32
+
+// Size of a version 1 header, and so the least to read to find the size
+#define CAPTURE_HEADER_SIZE_V1  24
+
+#define CAPTURE_ENC_SAMPLES  0
+#define CAPTURE_ENC_RLE      1
+
+#define CAPTURE_PIN_DATA     0
+#define CAPTURE_PIN_RNW      1
+#define CAPTURE_PIN_SYNC     2
+#define CAPTURE_PIN_RDY      3
+#define CAPTURE_PIN_PHI2     4
+#define CAPTURE_PIN_RST      5
+#define CAPTURE_PIN_ADDR     6
+#define CAPTURE_NUM_PINS     7
+
+// Pin (and other) values in capture_header_t
+#define CAPTURE_UNCONNECTED  -1
+#define CAPTURE_UNSPECIFIED  -2
+
+#define CAPTURE_CPU_6502     0
+#define CAPTURE_CPU_65C02    1
+#define CAPTURE_CPU_6502_UND 2
+
+#define CAPTURE_INDEX_ENTRY_SIZE  24
+#define CAPTURE_INDEX_SYNC        1
+#define CAPTURE_INDEX_RESET       2
+#define CAPTURE_INDEX_INTERVAL    (1 << 20)
+
+typedef struct {
+   int width;                   // sample width in bits
+   int encoding;                // CAPTURE_ENC_*
+   int pins[CAPTURE_NUM_PINS];  // bit numbers, or CAPTURE_UNCONNECTED/UNSPECIFIED
+   int cpu;                     // CAPTURE_CPU_*, or CAPTURE_UNSPECIFIED
+   int machine;                 // or CAPTURE_UNSPECIFIED
+   uint32_t sample_rate;        // Hz, 0 if unknown
+   uint32_t index_count;
+   uint64_t index_offset;
+} capture_header_t;
+
+// Check whether buf (len bytes) starts with the capture file magic
+int capture_is_header(const uint8_t *buf, int len);
+
+// Get the header size from the start of a header (CAPTURE_HEADER_SIZE_V1
+// bytes at buf); returns -1 (with a message) if it is invalid
+int capture_header_size(const uint8_t *buf);
+
+// Parse a whole header (of capture_header_size() bytes at buf); returns 0 on
+// success, or -1 (with a message) if it is invalid
+int capture_parse_header(const uint8_t *buf, capture_header_t *hdr);
+
+// Format a header into buf (CAPTURE_HEADER_SIZE bytes); returns its size
+int capture_format_header(uint8_t *buf, const capture_header_t *hdr);
+
+// An index entry
+typedef struct {
+   uint64_t sample;
+   uint64_t offset;
+   int kind;
+} capture_index_t;
+
+// Read the index of a capture file open on fd (hdr is its header) into a
+// new array at *index, without moving the file position; returns the number
+// of entries (0 if there is no index), or -1 (with a message) on error
+int capture_read_index(int fd, const capture_header_t *hdr, capture_index_t **index);
+
+// Writes a run-length encoded capture file, merging runs across calls, and
+// builds its index
+typedef struct {
+   FILE *file;
+   capture_header_t header;
+   int sample_bytes;
+   uint64_t sample;
+   uint64_t repeat;   // further samples in the current run
+   int pending;       // whether there is a current run
+   uint64_t max_repeat;
+   uint64_t samples;  // samples written before the current run
+   uint64_t offset;   // file offset of the current run
+   uint64_t next_sync;
+   capture_index_t *index;
+   int index_max;     // entries allocated; header.index_count are used
+} capture_writer_t;
+
+// Create FILE and write the header; the encoding and index fields of hdr are
+// ignored. Returns 0 on success
+int capture_writer_open(capture_writer_t *w, const char *filename, const capture_header_t *hdr);
+
+// Append num samples
+void capture_write_samples(capture_writer_t *w, const void *samples, int num);
+
+// Append num run-length encoded records
+void capture_write_runs(capture_writer_t *w, const void *records, int num);
+
+// Flush the final run, write the index (if the file is seekable, as the
+// header needs updating) and close the file. Returns 0 on success
+int capture_writer_close(capture_writer_t *w);
+
+#endif
@@ -0,0 +1,554 @@
+// ====================================================================
+// decode6502 regression check
+// ====================================================================
+//
+// Decodes a corpus of synthetic captures (see bus_gen.h) with both the sync
+// decoder and the sync-less one, and compares their output. The sync
+// decoder's output is the reference; for each capture it prints:
+//
+//   instrs   instructions in the reference
+//   lock     reference instructions before the sync-less decoder first
+//            matches it (for LOCK_RUN instructions in a row)
+//   diverge  times the sync-less decoder differs after locking
+//   lost     reference instructions not matched (lock plus the gaps)
+//   fail     "prediction failed" lines from each decoder
+//   archive  reference lines which differ when the capture is first written
+//            out as --archive does (run-length encoded, with an index) and
+//            that file is decoded instead
+//   index    entries in that file's index, and those which are not at the
+//            start of a record at their sample, with reset (or SYNC after a
+//            rising edge of phi2) there
+//
+// The corpus is deterministic, so the output only changes when decoding
+// does. "./build.sh check" compares it with src/check.expected.
+//
+// Usage: check6502 [CYCLES]
+
+// The decoder's internals are static, so include it whole
+#define main decode6502_main
+#include "main.c"
+#undef main
+
+#include <sys/wait.h>
+#include "bus_gen.h"
+
+#define CHECK_CYCLES 300000
+
+// Cycles reset is held low for
+#define RESET_HOLD 8
+
+// Lines that must match in a row to count as locked
+#define LOCK_RUN 8
+
+// How far ahead (in lines of each output) to look for the streams to match
+#define LOCK_WINDOW 64
+
+// A program with 1MHz bus accesses, page crossings, decimal arithmetic,
+// subroutines and an interrupt handler, run at BUS_GEN_ORIGIN
+static const uint8_t program[] = {
+   0xA2, 0xFF,             // 1000 LDX #&FF
+   0x9A,                   // 1002 TXS
+   0x58,                   // 1003 CLI
+   0xD8,                   // 1004 CLD
+   0xA0, 0x00,             // 1005 LDY #&00
+   0x8D, 0x00, 0xFC,       // 1007 STA &FC00
+   0xAD, 0x40, 0xFE,       // 100A LDA &FE40
+   0xB9, 0xF0, 0x20,       // 100D LDA &20F0,Y
+   0x99, 0x80, 0x21,       // 1010 STA &2180,Y
+   0x20, 0x40, 0x10,       // 1013 JSR &1040
+   0xF8,                   // 1016 SED
+   0x18,                   // 1017 CLC
+   0x69, 0x19,             // 1018 ADC #&19
+   0x38,                   // 101A SEC
+   0xE9, 0x07,             // 101B SBC #&07
+   0xD8,                   // 101D CLD
+   0xC8,                   // 101E INY
+   0xD0, 0xE6,             // 101F BNE &1007
+   0x4C, 0x07, 0x10,       // 1021 JMP &1007
+   [0x40] =
+   0x48,                   // 1040 PHA
+   0x8A,                   // 1041 TXA
+   0x48,                   // 1042 PHA
+   0x06, 0x80,             // 1043 ASL &80
+   0x26, 0x81,             // 1045 ROL &81
+   0xE6, 0x82,             // 1047 INC &82
+   0xA5, 0x82,             // 1049 LDA &82
+   0x29, 0x0F,             // 104B AND #&0F
+   0xAA,                   // 104D TAX
+   0xBD, 0xFE, 0x20,       // 104E LDA &20FE,X
+   0x9D, 0x00, 0xFE,       // 1051 STA &FE00,X
+   0x68,                   // 1054 PLA
+   0xAA,                   // 1055 TAX
+   0x68,                   // 1056 PLA
+   0x60,                   // 1057 RTS
+   [0x60] =
+   0x48,                   // 1060 PHA (IRQ and NMI)
+   0xA5, 0x80,             // 1061 LDA &80
+   0x68,                   // 1063 PLA
+   0x40                    // 1064 RTI
+};
+
+#define PROGRAM_IRQ (BUS_GEN_ORIGIN + 0x60)
+
+// Compares with the register unknown (A, X and Y are after reset) must
+// leave the flags unknown, rather than as they were
+static const uint8_t cmp_program[] = {
+   0x38,                   // 1000 SEC
+   0xC9, 0xFF,             // 1001 CMP #&FF
+   0x08,                   // 1003 PHP
+   0x38,                   // 1004 SEC
+   0xE0, 0xFF,             // 1005 CPX #&FF
+   0x08,                   // 1007 PHP
+   0x38,                   // 1008 SEC
+   0xC0, 0xFF,             // 1009 CPY #&FF
+   0x08,                   // 100B PHP
+   0x4C, 0x00, 0x10        // 100C JMP &1000
+};
+
+// The 6502 leaves D as it was on reset, so ADC after a reset must not be
+// emulated in binary mode
+static const uint8_t adc_program[] = {
+   0xAD, 0x30, 0x10,       // 1000 LDA &1030
+   0xD0, 0x07,             // 1003 BNE &100C
+   0xEE, 0x30, 0x10,       // 1005 INC &1030
+   0xF8,                   // 1008 SED
+   0x4C, 0x09, 0x10,       // 1009 JMP &1009 (until the next reset)
+   0x18,                   // 100C CLC
+   0xA9, 0x09,             // 100D LDA #&09
+   0x69, 0x01,             // 100F ADC #&01
+   0x85, 0x80,             // 1011 STA &80
+   0x4C, 0x0C, 0x10,       // 1014 JMP &100C
+   [0x30] =
+   0x00                    // 1030 set once D has been
+};
+
+// Opcode &80 is BRA only on the 65C02, on the 6502 it's NOP #imm
+static const uint8_t bra_program[] = {
+   0xA2, 0xFF,             // 1000 LDX #&FF
+   0x9A,                   // 1002 TXS
+   0x80, 0x10,             // 1003 NOP #&10
+   0x20, 0x20, 0x10,       // 1005 JSR &1020
+   0x4C, 0x03, 0x10,       // 1008 JMP &1003
+   [0x20] =
+   0x60                    // 1020 RTS
+};
+
+// Opcodes &xF are BBR/BBS only on the 65C02, on the 6502 &0F is SLO abs
+static const uint8_t bbr_program[] = {
+   0xA2, 0xFF,             // 1000 LDX #&FF
+   0x9A,                   // 1002 TXS
+   0x0F, 0x30, 0x10,       // 1003 SLO &1030
+   0x20, 0x20, 0x10,       // 1006 JSR &1020
+   0x4C, 0x03, 0x10,       // 1009 JMP &1003
+   [0x20] =
+   0x60                    // 1020 RTS
+};
+
+// Indexed reads crossing a page, where the 65C02's extra cycle re-reads an
+// operand byte at or above the low byte of the base, and reads which do not
+// cross but whose effective address is that operand byte
+static const uint8_t page_program[] = {
+   0xA2, 0xFF,             // 1000 LDX #&FF
+   0x9A,                   // 1002 TXS
+   0xA9, 0x01,             // 1003 LDA #&01
+   0x85, 0x70,             // 1005 STA &70
+   0xA9, 0x10,             // 1007 LDA #&10
+   0x85, 0x71,             // 1009 STA &71
+   0xA2, 0xFF,             // 100B LDX #&FF
+   0xBD, 0x01, 0x10,       // 100D LDA &1001,X (&1100)
+   0xA0, 0xFF,             // 1010 LDY #&FF
+   0xB1, 0x70,             // 1012 LDA (&70),Y (&1100)
+   0xA2, 0x11,             // 1014 LDX #&11
+   0xBD, 0x07, 0x10,       // 1016 LDA &1007,X (&1018)
+   0xA0, 0x1B,             // 1019 LDY #&1B
+   0xB1, 0x70,             // 101B LDA (&70),Y (&101C)
+   0x4C, 0x0B, 0x10        // 101D JMP &100B
+};
+
+typedef struct {
+   const char *name;
+   int c02;
+   int undocumented;
+   int oversample;   // 0 for no phi2
+   int rdy;          // percentage of cycles stretched
+   int master;
+   int rdy_pin;      // whether rdy is connected
+   int addr;         // whether addr is connected (32 bit samples)
+   uint32_t random;  // memory contents
+   const uint8_t *program;  // run rather than random memory, or NULL
+   int program_len;
+   int irq;          // IRQ, NMI and reset periods in cycles, or 0
+   int nmi;
+   int reset;
+} check_capture_t;
+
+#define RANDOM      NULL, 0
+#define PROGRAM(p)  p, sizeof(p)
+
+static const check_capture_t corpus[] = {
+   { "6502",                 0, 0, 4,  0, 0, 1, 0, 1, RANDOM,                 0,     0,      0 },
+   { "65C02",                1, 0, 4,  0, 0, 1, 0, 1, RANDOM,                 0,     0,      0 },
+   { "6502 no-phi2",         0, 0, 0,  0, 0, 1, 0, 7, RANDOM,                 0,     0,      0 },
+   { "65C02 no-phi2",        1, 0, 0,  0, 0, 1, 0, 7, RANDOM,                 0,     0,      0 },
+   { "6502 rdy",             0, 0, 4, 10, 0, 1, 0, 7, RANDOM,                 0,     0,      0 },
+   { "65C02 rdy",            1, 0, 4, 10, 0, 1, 0, 7, RANDOM,                 0,     0,      0 },
+   { "6502 irq/nmi",         0, 0, 4,  0, 0, 1, 0, 7, RANDOM,             20000, 70000,      0 },
+   { "65C02 irq/nmi",        1, 0, 4,  0, 0, 1, 0, 7, RANDOM,             20000, 70000,      0 },
+   { "6502 reset",           0, 0, 4,  0, 0, 1, 0, 7, RANDOM,                 0,     0, 100000 },
+   { "65C02 reset",          1, 0, 4,  0, 0, 1, 0, 7, RANDOM,                 0,     0, 100000 },
+   { "6502 program",         0, 0, 4,  5, 0, 1, 0, 1, PROGRAM(program),    3000, 10000,      0 },
+   { "65C02 program",        1, 0, 4,  5, 0, 1, 0, 1, PROGRAM(program),    3000, 10000,      0 },
+   { "65C02 master",         1, 0, 4,  0, 1, 1, 0, 1, PROGRAM(program),    3000,     0,      0 },
+   { "65C02 master no-rdy",  1, 0, 4,  0, 1, 0, 0, 1, PROGRAM(program),    3000,     0,      0 },
+   { "6502 cmp unknown",     0, 0, 4,  0, 0, 1, 0, 1, PROGRAM(cmp_program),   0,     0,      0 },
+   { "6502 adc unknown D",   0, 0, 4,  0, 0, 1, 0, 1, PROGRAM(adc_program),   0,     0,  20000 },
+   { "6502 opcode 80",       0, 1, 4,  0, 0, 1, 0, 1, PROGRAM(bra_program),   0,     0,      0 },
+   { "6502 opcode 0F",       0, 1, 4,  0, 0, 1, 0, 1, PROGRAM(bbr_program),   0,     0,      0 },
+   { "6502 addr",            0, 0, 4,  0, 0, 1, 1, 1, RANDOM,                 0,     0,      0 },
+   { "65C02 addr",           1, 0, 4,  0, 0, 1, 1, 1, RANDOM,                 0,     0,      0 },
+   { "6502 addr crossing",   0, 0, 4,  0, 0, 1, 1, 1, PROGRAM(page_program),  0,     0,      0 },
+   { "65C02 addr crossing",  1, 0, 4,  0, 0, 1, 1, 1, PROGRAM(page_program),  0,     0,      0 }
+};
+
+#define NUM_CAPTURES (sizeof(corpus) / sizeof(corpus[0]))
+
+static int max_cycles = CHECK_CYCLES;
+
+static bus_gen_cycle_t *cycles;
+static int num_cycles;
+static void *samples;
+static int num_samples;
+
+static bus_gen_cpu_t cpu;
+
+static void emit(void *user, const bus_gen_cycle_t *cycle) {
+   if (num_cycles < max_cycles) {
+      cycles[num_cycles++] = *cycle;
+   }
+}
+
+static void generate(const check_capture_t *c) {
+   em_init(c->c02, c->undocumented);
+   bus_gen_cpu_init(&cpu, c->c02, emit, NULL);
+   bus_gen_cpu_randomize(&cpu, c->random);
+   if (c->program) {
+      memcpy(cpu.mem + BUS_GEN_ORIGIN, c->program, c->program_len);
+      cpu.mem[0xFFFA] = cpu.mem[0xFFFE] = PROGRAM_IRQ & 0xff;
+      cpu.mem[0xFFFB] = cpu.mem[0xFFFF] = PROGRAM_IRQ >> 8;
+      cpu.mem[0xFFFC] = BUS_GEN_ORIGIN & 0xff;
+      cpu.mem[0xFFFD] = BUS_GEN_ORIGIN >> 8;
+   }
+   cpu.rdy_percent = c->rdy;
+   cpu.master = c->master;
+   num_cycles = 0;
+   // Each event happens at the first instruction boundary of its period
+   long long next_irq = c->irq ? c->irq : LLONG_MAX;
+   long long next_nmi = c->nmi ? c->nmi : LLONG_MAX;
+   long long next_reset = c->reset ? c->reset : LLONG_MAX;
+   bus_gen_cpu_reset(&cpu, RESET_HOLD);
+   while (cpu.cycles < max_cycles) {
+      if (cpu.cycles >= next_irq) {
+         cpu.irq = 1;
+         next_irq += c->irq;
+      }
+      if (cpu.cycles >= next_nmi) {
+         cpu.nmi = 1;
+         next_nmi += c->nmi;
+      }
+      if (cpu.cycles >= next_reset) {
+         bus_gen_cpu_reset(&cpu, RESET_HOLD);
+         next_reset += c->reset;
+      } else {
+         bus_gen_cpu_step(&cpu);
+      }
+   }
+   if (c->addr) {
+      num_samples = bus_gen_samples_addr(samples, NULL, cycles, num_cycles, c->oversample);
+   } else {
+      num_samples = bus_gen_samples(samples, NULL, cycles, num_cycles, c->oversample);
+   }
+}
+
+// Write the capture to path as --archive does, and decode that file the way
+// decode6502 reads a capture file
+static void decode_archived(const char *path) {
+   if (open_archive(path)) {
+      exit(2);
+   }
+   capture_write_samples(&archive, samples, num_samples);
+   archiving = 0;
+   if (capture_writer_close(&archive)) {
+      exit(2);
+   }
+   FILE *stream = fopen(path, "r");
+   if (!stream) {
+      perror("failed to open archive");
+      exit(2);
+   }
+   int len = read_header(fileno(stream));
+   if (len < 0) {
+      exit(2);
+   }
+   input_offset = data_start;
+   record_bytes = arguments.rle ? 2 * sample_bytes : sample_bytes;
+   decode(stream, len);
+   fclose(stream);
+}
+
+// Decode the capture in a child process, so every decode starts from the
+// decoder's initial state, with the output going to a temporary file; if
+// archive is given, via an archive written there
+static FILE *decode_capture(const check_capture_t *c, int sync, const char *archive) {
+   FILE *out = tmpfile();
+   if (!out) {
+      perror("failed to create temporary file");
+      exit(2);
+   }
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror("failed to fork");
+      exit(2);
+   }
+   if (pid == 0) {
+      dup2(fileno(out), 1);
+      arguments.c02 = c->c02;
+      arguments.undocumented = c->undocumented;
+      arguments.idx_sync = sync ? BUS_GEN_BIT_SYNC : -1;
+      arguments.idx_phi2 = c->oversample ? BUS_GEN_BIT_PHI2 : -1;
+      arguments.idx_rdy = c->rdy_pin ? BUS_GEN_BIT_RDY : -1;
+      arguments.machine = c->master ? MACHINE_MASTER : MACHINE_DEFAULT;
+      arguments.idx_addr = c->addr ? BUS_GEN_BIT_ADDR : -1;
+      arguments.width = c->addr ? 32 : 16;
+      sample_bytes = arguments.width / 8;
+      record_bytes = sample_bytes;
+      em_init(c->c02, c->undocumented);
+      if (archive) {
+         decode_archived(archive);
+      } else {
+         decode_samples(samples, num_samples);
+      }
+      fflush(stdout);
+      _exit(0);
+   }
+   int status;
+   if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "%s: %s decoder failed%s\n", c->name, sync ? "sync" : "sync-less", archive ? " on the archive" : "");
+      exit(2);
+   }
+   rewind(out);
+   return out;
+}
+
+typedef struct {
+   char **lines;
+   int num;
+   int fails;
+} trace_t;
+
+static void read_trace(FILE *file, trace_t *t) {
+   char *line = NULL;
+   size_t size = 0;
+   int max = 0;
+   t->lines = NULL;
+   t->num = 0;
+   t->fails = 0;
+   while (getline(&line, &size, file) > 0) {
+      if (strstr(line, "prediction failed")) {
+         t->fails++;
+      }
+      if (t->num == max) {
+         max = max ? max * 2 : 65536;
+         t->lines = realloc(t->lines, max * sizeof(char *));
+         if (!t->lines) {
+            perror("failed to allocate trace");
+            exit(2);
+         }
+      }
+      t->lines[t->num++] = line;
+      line = NULL;
+   }
+   free(line);
+   fclose(file);
+}
+
+static void free_trace(trace_t *t) {
+   for (int i = 0; i < t->num; i++) {
+      free(t->lines[i]);
+   }
+   free(t->lines);
+}
+
+// Whether the traces match for LOCK_RUN lines (or to the end of either)
+// from ref line i and test line j
+static int matches(const trace_t *ref, int i, const trace_t *test, int j) {
+   if (i >= ref->num || j >= test->num) {
+      return 0;
+   }
+   for (int k = 0; k < LOCK_RUN && i + k < ref->num && j + k < test->num; k++) {
+      if (strcmp(ref->lines[i + k], test->lines[j + k])) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Find the nearest place from (*i, *j) where the traces match, searching
+// further on in steps of LOCK_WINDOW; returns 0 if there is none
+static int find_lock(const trace_t *ref, int *i, const trace_t *test, int *j) {
+   while (*i < ref->num && *j < test->num) {
+      for (int d = 0; d < 2 * LOCK_WINDOW; d++) {
+         for (int a = 0; a <= d; a++) {
+            if (a < LOCK_WINDOW && d - a < LOCK_WINDOW && matches(ref, *i + a, test, *j + d - a)) {
+               *i += a;
+               *j += d - a;
+               return 1;
+            }
+         }
+      }
+      *i += LOCK_WINDOW;
+      *j += LOCK_WINDOW;
+   }
+   return 0;
+}
+
+// Check the index of the archive at path against its records (see
+// capture.h); returns the number of bad entries, and the number of entries
+// in *num
+static int check_index(const char *path, int *num) {
+   FILE *f = fopen(path, "r");
+   uint8_t buf[CAPTURE_HEADER_SIZE];
+   capture_header_t hdr;
+   capture_index_t *index;
+   if (!f || fread(buf, CAPTURE_HEADER_SIZE, 1, f) != 1 ||
+       capture_header_size(buf) != CAPTURE_HEADER_SIZE || capture_parse_header(buf, &hdr) ||
+       (*num = capture_read_index(fileno(f), &hdr, &index)) < 0) {
+      fprintf(stderr, "failed to read archive %s\n", path);
+      exit(2);
+   }
+   int bytes = hdr.width / 8;
+   int rst = hdr.pins[CAPTURE_PIN_RST];
+   int sync = hdr.pins[CAPTURE_PIN_SYNC];
+   int phi2 = hdr.pins[CAPTURE_PIN_PHI2];
+   uint64_t offset = CAPTURE_HEADER_SIZE;
+   uint64_t start = 0;
+   uint64_t prev = 0;
+   int bad = 0;
+   int i = 0;
+   // Walk the records up to the index, checking each entry at its record
+   while (i < *num && offset < hdr.index_offset) {
+      uint64_t record[2] = { 0, 0 };
+      if (fread(&record[0], bytes, 1, f) != 1 || fread(&record[1], bytes, 1, f) != 1) {
+         break;
+      }
+      while (i < *num && index[i].offset <= offset) {
+         const capture_index_t *e = &index[i++];
+         int ok = e->offset == offset && e->sample == start && offset > CAPTURE_HEADER_SIZE;
+         if (e->kind == CAPTURE_INDEX_RESET) {
+            ok = ok && rst >= 0 && ((record[0] >> rst) & 1) && !((prev >> rst) & 1);
+         } else if (e->kind == CAPTURE_INDEX_SYNC) {
+            ok = ok && sync >= 0 && ((record[0] >> sync) & 1) &&
+               (phi2 < 0 || (((record[0] >> phi2) & 1) && !((prev >> phi2) & 1)));
+         } else {
+            ok = 0;
+         }
+         bad += !ok;
+      }
+      prev = record[0];
+      start += record[1] + 1;
+      offset += 2 * bytes;
+   }
+   // Any entries left point past the records
+   bad += *num - i;
+   free(index);
+   fclose(f);
+   return bad;
+}
+
+static void check_capture(const check_capture_t *c) {
+   trace_t ref;
+   trace_t test;
+   trace_t archived;
+   char path[] = "/tmp/check6502-XXXXXX";
+   int fd = mkstemp(path);
+   if (fd < 0) {
+      perror("failed to create temporary file");
+      exit(2);
+   }
+   close(fd);
+   generate(c);
+   read_trace(decode_capture(c, 1, NULL), &ref);
+   read_trace(decode_capture(c, 0, NULL), &test);
+   read_trace(decode_capture(c, 1, path), &archived);
+   int entries;
+   int bad_entries = check_index(path, &entries);
+   unlink(path);
+
+   int i = 0;
+   int j = 0;
+   int diverge = 0;
+   long long lost = 0;
+   int locked = find_lock(&ref, &i, &test, &j);
+   int lock = locked ? i : ref.num;
+   lost = lock;
+   while (locked && i < ref.num && j < test.num) {
+      if (!strcmp(ref.lines[i], test.lines[j])) {
+         i++;
+         j++;
+         continue;
+      }
+      diverge++;
+      int start = i;
+      locked = find_lock(&ref, &i, &test, &j);
+      lost += (locked ? i : ref.num) - start;
+   }
+
+   // Decoding the archive must give exactly the reference
+   int differ = abs(ref.num - archived.num);
+   for (i = 0; i < ref.num && i < archived.num; i++) {
+      if (strcmp(ref.lines[i], archived.lines[i])) {
+         differ++;
+      }
+   }
+
+   printf("%-22s %8d %8d %8d %8lld %8d %8d %8d %8d %8d\n", c->name, ref.num, lock, diverge, lost, ref.fails, test.fails, differ, entries, bad_entries);
+   free_trace(&ref);
+   free_trace(&test);
+   free_trace(&archived);
+}
+
+int main(int argc, char *argv[]) {
+   if (argc > 1) {
+      max_cycles = atoi(argv[1]);
+   }
+   if (max_cycles <= 0) {
+      fprintf(stderr, "usage: %s [CYCLES]\n", argv[0]);
+      return 2;
+   }
+
+   arguments.idx_data  = 0;
+   arguments.idx_rnw   = BUS_GEN_BIT_RNW;
+   arguments.idx_rst   = BUS_GEN_BIT_RST;
+   arguments.idx_addr  = -1;
+   arguments.width     = 16;
+   text_columns = TEXT_HEX | TEXT_STATE;
+   arguments.range_hi  = LLONG_MAX;
+   sample_bytes = sizeof(uint16_t);
+   record_bytes = sizeof(uint16_t);
+   do_emulate = 1;
+
+   cycles = malloc(max_cycles * sizeof(bus_gen_cycle_t));
+   samples = malloc(max_cycles * 2 * 4 * sizeof(uint32_t));
+   if (!cycles || !samples) {
+      perror("failed to allocate capture buffers");
+      return 2;
+   }
+
+   printf("decode6502 check: %d cycles per capture\n\n", max_cycles);
+   printf("%-22s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "capture", "instrs", "lock", "diverge", "lost", "fail", "fail", "archive", "index", "index");
+   printf("%-22s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "", "", "", "", "", "sync", "no-sync", "differ", "entries", "bad");
+   for (int i = 0; i < NUM_CAPTURES; i++) {
+      check_capture(&corpus[i]);
+   }
+   return 0;
+}
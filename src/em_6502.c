@@ -38,7 +38,7 @@ const char default_state[] = "A=?? X=?? Y=?? SP=?? N=? V=? D=? I=? Z=? C=?";
 #define OFFSET_C  43
 #define OFFSET_FF 44
 
-static char buffer[80];
+static char buffer[EM_STATE_STRLEN];
 
 // 6502 registers: -1 means unknown
 static int A = -1;
@@ -153,6 +153,48 @@ void em_reset() {
    }
 }
 
+void em_invalidate() {
+   A = -1;
+   X = -1;
+   Y = -1;
+   S = -1;
+   N = -1;
+   V = -1;
+   D = -1;
+   I = -1;
+   Z = -1;
+   C = -1;
+   failflag = 0;
+}
+
+void em_save(int *state) {
+   state[0] = A;
+   state[1] = X;
+   state[2] = Y;
+   state[3] = S;
+   state[4] = N;
+   state[5] = V;
+   state[6] = D;
+   state[7] = I;
+   state[8] = Z;
+   state[9] = C;
+   state[10] = failflag;
+}
+
+void em_restore(const int *state) {
+   A = state[0];
+   X = state[1];
+   Y = state[2];
+   S = state[3];
+   N = state[4];
+   V = state[5];
+   D = state[6];
+   I = state[7];
+   Z = state[8];
+   C = state[9];
+   failflag = state[10];
+}
+
 static void write_hex1(char *buffer, int value) {
    *buffer = value + (value < 10 ? '0' : 'A' - 10);
 }
@@ -202,48 +244,63 @@ int em_get_S() {
    return S;
 }
 
-char *em_get_state() {
+char *em_format_state(char *buffer, const int *state) {
    strcpy(buffer, default_state);
-   if (A >= 0) {
-      write_hex2(buffer + OFFSET_A, A);
+   if (state[0] >= 0) {
+      write_hex2(buffer + OFFSET_A, state[0]);
    }
-   if (X >= 0) {
-      write_hex2(buffer + OFFSET_X, X);
+   if (state[1] >= 0) {
+      write_hex2(buffer + OFFSET_X, state[1]);
    }
-   if (Y >= 0) {
-      write_hex2(buffer + OFFSET_Y, Y);
+   if (state[2] >= 0) {
+      write_hex2(buffer + OFFSET_Y, state[2]);
    }
-   if (S >= 0) {
-      write_hex2(buffer + OFFSET_S, S);
+   if (state[3] >= 0) {
+      write_hex2(buffer + OFFSET_S, state[3]);
    }
-   if (N >= 0) {
-      buffer[OFFSET_N] = '0' + N;
+   if (state[4] >= 0) {
+      buffer[OFFSET_N] = '0' + state[4];
    }
-   if (V >= 0) {
-      buffer[OFFSET_V] = '0' + V;
+   if (state[5] >= 0) {
+      buffer[OFFSET_V] = '0' + state[5];
    }
-   if (D >= 0) {
-      buffer[OFFSET_D] = '0' + D;
+   if (state[6] >= 0) {
+      buffer[OFFSET_D] = '0' + state[6];
    }
-   if (I >= 0) {
-      buffer[OFFSET_I] = '0' + I;
+   if (state[7] >= 0) {
+      buffer[OFFSET_I] = '0' + state[7];
    }
-   if (Z >= 0) {
-      buffer[OFFSET_Z] = '0' + Z;
+   if (state[8] >= 0) {
+      buffer[OFFSET_Z] = '0' + state[8];
    }
-   if (C >= 0) {
-      buffer[OFFSET_C] = '0' + C;
+   if (state[9] >= 0) {
+      buffer[OFFSET_C] = '0' + state[9];
    }
-   if (failflag) {
+   if (state[10]) {
       sprintf(buffer + OFFSET_FF, " prediction failed");
    }
+   return buffer;
+}
+
+char *em_get_state() {
+   int state[EM_STATE_SIZE];
+   em_save(state);
+   em_format_state(buffer, state);
    failflag = 0;
    return buffer;
 }
 
+int em_get_fail() {
+   return failflag;
+}
+
+void em_clear_fail() {
+   failflag = 0;
+}
+
 
 static void op_ADC(int operand) {
-   if (A >= 0 && C >= 0) {
+   if (A >= 0 && C >= 0 && D >= 0) {
       if (D == 1) {
          // Decimal mode ADC
          int al;
@@ -439,6 +496,8 @@ static void op_CMP(int operand) {
       int tmp = A - operand;
       C = tmp >= 0;
       set_NZ(tmp);
+   } else {
+      set_NZC_unknown();
    }
 }
 
@@ -447,6 +506,8 @@ static void op_CPX(int operand) {
       int tmp = X - operand;
       C = tmp >= 0;
       set_NZ(tmp);
+   } else {
+      set_NZC_unknown();
    }
 }
 
@@ -455,6 +516,8 @@ static void op_CPY(int operand) {
       int tmp = Y - operand;
       C = tmp >= 0;
       set_NZ(tmp);
+   } else {
+      set_NZC_unknown();
    }
 }
 
@@ -696,7 +759,7 @@ static void op_RTI(int operand) {
 }
 
 static void op_SBC(int operand) {
-   if (A >= 0 && C >= 0) {
+   if (A >= 0 && C >= 0 && D >= 0) {
       if (D == 1) {
          // Decimal mode SBC
          if (c02) {
@@ -1387,10 +1450,15 @@ static InstrType instr_table_6502[] = {
 
 static char ILLEGAL[] = "???";
 
+// The table in use; a copy, so that em_init() can be called again with
+// different settings
+static InstrType instr_table_current[256];
+
 void em_init(int support_c02, int support_undocumented) {
    int i;
    c02 = support_c02;
-   instr_table = support_c02 ? instr_table_65c02 : instr_table_6502;
+   memcpy(instr_table_current, support_c02 ? instr_table_65c02 : instr_table_6502, sizeof(instr_table_current));
+   instr_table = instr_table_current;
    InstrType *instr = instr_table;
    for (i = 0; i < 256; i++) {
       // Remove the undocumented instructions, if not supported
@@ -5,6 +5,8 @@ void em_init(int support_c02, int support_undocumented);
 
 void em_reset();
 
+void em_invalidate();
+
 void em_interrupt(int operand);
 
 int em_get_N();
@@ -29,6 +31,26 @@ int em_get_S();
 
 char *em_get_state();
 
+// Whether a state prediction has failed since em_get_state() (or
+// em_clear_fail()) was last called
+int em_get_fail();
+
+void em_clear_fail();
+
+// The emulated state as EM_STATE_SIZE values (A X Y S N V D I Z C and the
+// prediction failed flag), so decoding can be resumed part way through
+#define EM_STATE_SIZE 11
+
+void em_save(int *state);
+
+void em_restore(const int *state);
+
+// Format a saved state as em_get_state() does, into buffer (at least
+// EM_STATE_STRLEN bytes)
+#define EM_STATE_STRLEN 80
+
+char *em_format_state(char *buffer, const int *state);
+
 typedef enum {
    IMP,
    IMPA,
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <argp.h>
+
+#include "em_6502.h"
+#include "capture.h"
+#include "bus_gen.h"
+
+// Cycles converted to samples at a time
+#define CHUNK_CYCLES 4096
+
+// Cycles reset is held low for
+#define RESET_HOLD 8
+
+// Maximum number of interrupts or resets of each kind
+#define MAX_EVENTS 1024
+
+// The event kinds
+#define EV_IRQ   0
+#define EV_NMI   1
+#define EV_RESET 2
+#define NUM_EV   3
+
+// ====================================================================
+// Argp processing
+// ====================================================================
+
+const char *argp_program_version = "gen6502 0.1";
+
+const char *argp_program_bug_address = "<dave@hoglet.com>";
+
+static char doc[] = "\n\
+Generator of synthetic 6502/65C02 capture files, for testing decode6502.\n\
+\n\
+PROGRAM (a binary image, loaded at --load) is run on a cycle level model of\n\
+the CPU, starting with a reset, and the bus activity is written to stdout as\n\
+16 bit samples with decode6502's default bit assignments, or to FILE with a\n\
+capture header (see src/capture.h) with --output. If PROGRAM is omitted,\n\
+memory is filled with random valid opcodes (--random, default seed 1).\n\
+\n\
+--start sets the reset vector (default the load address, unless the image\n\
+covers the vectors). Each cycle is output as --oversample samples per phase\n\
+of phi2 (default 4), or with --oversample=0 as a single sample without phi2.\n\
+\n\
+--rdy=PERCENT holds rdy low for 1-3 extra cycles before that percentage of\n\
+cycles (only reads on the 6502), and --master stretches accesses to the\n\
+1MHz bus as the BBC Master does. --irq, --nmi and --reset take a comma\n\
+separated list of cycles, and the event happens at the first instruction\n\
+boundary from each. e.g.\n\
+   gen6502 --c02 --rdy=5 --irq=1000,50000 --output=test.cap prog.bin\n\
+   decode6502 test.cap\n\
+";
+
+static char args_doc[] = "[PROGRAM]";
+
+static struct argp_option options[] = {
+   { "c02",          'c',        0,                   0, "Emulate a 65C02 rather than a 6502"},
+   { "cycles",       'n',      "N",                   0, "The number of cycles to generate (default 1000000)"},
+   { "oversample",    1,       "N",                   0, "Samples per phase of phi2 (default 4), or 0 for no phi2"},
+   { "rdy",           2, "PERCENT",                   0, "Percentage of cycles stretched with rdy low"},
+   { "master",        3,        0,                    0, "Stretch 1MHz bus accesses as on the BBC Master"},
+   { "irq",           4,  "CYCLES",                   0, "Assert IRQ at these cycles"},
+   { "nmi",           5,  "CYCLES",                   0, "Assert NMI at these cycles"},
+   { "reset",         6,  "CYCLES",                   0, "Reset at these cycles"},
+   { "load",          7,    "ADDR",                   0, "The hex load address of PROGRAM (default 1000)"},
+   { "start",         8,    "ADDR",                   0, "The hex reset vector"},
+   { "random",        9,    "SEED",                   0, "Fill memory with random opcodes first"},
+   { "seed",         10,    "SEED",                   0, "The seed for rdy stretching (default 1)"},
+   { "output",       'o',    "FILE",                  0, "Write a capture file with a header to FILE"},
+   { 0 }
+};
+
+struct arguments {
+   int c02;
+   long long cycles;
+   int oversample;
+   int rdy;
+   int master;
+   long long events[NUM_EV][MAX_EVENTS];
+   int num_events[NUM_EV];
+   int load;
+   int start;
+   int random;
+   int seed;
+   char *output;
+   char *program;
+} arguments;
+
+static int compare_cycles(const void *a, const void *b) {
+   long long x = *(const long long *) a;
+   long long y = *(const long long *) b;
+   return (x > y) - (x < y);
+}
+
+// Parse a comma separated list of cycles, returning non-zero if invalid
+static int parse_events(char *arg, int ev) {
+   char *end;
+   while (*arg) {
+      long long cycle = strtoll(arg, &end, 10);
+      if (end == arg || cycle < 0 || arguments.num_events[ev] == MAX_EVENTS) {
+         return 1;
+      }
+      arguments.events[ev][arguments.num_events[ev]++] = cycle;
+      arg = (*end == ',') ? end + 1 : end;
+      if (*end && *end != ',') {
+         return 1;
+      }
+   }
+   qsort(arguments.events[ev], arguments.num_events[ev], sizeof(long long), compare_cycles);
+   return 0;
+}
+
+static int parse_addr(const char *arg) {
+   char *end;
+   long addr = strtol(arg, &end, 16);
+   return (*arg && !*end && addr >= 0 && addr <= 0xffff) ? addr : -1;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+   struct arguments *arguments = state->input;
+   switch (key) {
+   case 'c':
+      arguments->c02 = 1;
+      break;
+   case 'n':
+      arguments->cycles = atoll(arg);
+      if (arguments->cycles <= 0) {
+         argp_error(state, "cycles must be positive");
+      }
+      break;
+   case   1:
+      arguments->oversample = atoi(arg);
+      if (arguments->oversample != 0 && (arguments->oversample < 2 || arguments->oversample > 64)) {
+         argp_error(state, "oversample must be 0 or 2 to 64");
+      }
+      break;
+   case   2:
+      arguments->rdy = atoi(arg);
+      if (arguments->rdy < 0 || arguments->rdy > 100) {
+         argp_error(state, "rdy percentage must be 0 to 100");
+      }
+      break;
+   case   3:
+      arguments->master = 1;
+      break;
+   case   4:
+   case   5:
+   case   6:
+      if (parse_events(arg, key - 4)) {
+         argp_error(state, "bad list of cycles");
+      }
+      break;
+   case   7:
+   case   8:
+      if (parse_addr(arg) < 0) {
+         argp_error(state, "bad address");
+      }
+      if (key == 7) {
+         arguments->load = parse_addr(arg);
+      } else {
+         arguments->start = parse_addr(arg);
+      }
+      break;
+   case   9:
+      arguments->random = atoi(arg);
+      break;
+   case  10:
+      arguments->seed = atoi(arg);
+      break;
+   case 'o':
+      arguments->output = arg;
+      break;
+   case ARGP_KEY_ARG:
+      if (state->arg_num > 0) {
+         argp_error(state, "multiple program arguments");
+      }
+      arguments->program = arg;
+      break;
+   default:
+      return ARGP_ERR_UNKNOWN;
+   }
+   return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+// ====================================================================
+// Output
+// ====================================================================
+
+// chunk[0] is the cycle before the buffered ones, if have_prev
+static bus_gen_cycle_t chunk[CHUNK_CYCLES + 1];
+static int chunk_len;
+static int have_prev;
+static uint16_t samples[CHUNK_CYCLES * 128];
+static capture_writer_t writer;
+
+// Convert the buffered cycles to samples and write them, keeping the last
+// cycle as the one before the next chunk
+static void flush_cycles() {
+   int num = bus_gen_samples(samples, have_prev ? &chunk[0] : NULL, chunk + 1, chunk_len, arguments.oversample);
+   if (arguments.output) {
+      capture_write_samples(&writer, samples, num);
+   } else if (fwrite(samples, sizeof(uint16_t), num, stdout) != num) {
+      perror("failed to write samples");
+      exit(1);
+   }
+   if (chunk_len) {
+      chunk[0] = chunk[chunk_len];
+      have_prev = 1;
+   }
+   chunk_len = 0;
+}
+
+static void emit(void *user, const bus_gen_cycle_t *cycle) {
+   chunk[++chunk_len] = *cycle;
+   if (chunk_len == CHUNK_CYCLES) {
+      flush_cycles();
+   }
+}
+
+// ====================================================================
+// Main program
+// ====================================================================
+
+static bus_gen_cpu_t cpu;
+
+static void load_program(bus_gen_cpu_t *cpu) {
+   FILE *file = fopen(arguments.program, "rb");
+   if (file == NULL) {
+      perror("failed to open program");
+      exit(1);
+   }
+   int len = fread(cpu->mem + arguments.load, 1, 0x10000 - arguments.load, file);
+   fclose(file);
+   if (arguments.start < 0 && arguments.load + len < 0xFFFE) {
+      arguments.start = arguments.load;
+   }
+}
+
+int main(int argc, char *argv[]) {
+   arguments.cycles = 1000000;
+   arguments.oversample = 4;
+   arguments.load = BUS_GEN_ORIGIN;
+   arguments.start = -1;
+   arguments.random = -1;
+   arguments.seed = 1;
+   argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+   em_init(arguments.c02, 0);
+   bus_gen_cpu_init(&cpu, arguments.c02, emit, NULL);
+   cpu.rdy_percent = arguments.rdy;
+   cpu.master = arguments.master;
+   cpu.random = arguments.seed;
+
+   if (arguments.random < 0 && !arguments.program) {
+      arguments.random = 1;
+   }
+   if (arguments.random >= 0) {
+      bus_gen_cpu_randomize(&cpu, arguments.random);
+   }
+   if (arguments.program) {
+      load_program(&cpu);
+   }
+   if (arguments.start >= 0) {
+      cpu.mem[0xFFFC] = arguments.start & 0xff;
+      cpu.mem[0xFFFD] = arguments.start >> 8;
+   }
+
+   if (arguments.output) {
+      capture_header_t hdr;
+      hdr.width = 16;
+      hdr.encoding = CAPTURE_ENC_RLE;
+      hdr.pins[CAPTURE_PIN_DATA] = 0;
+      hdr.pins[CAPTURE_PIN_RNW]  = BUS_GEN_BIT_RNW;
+      hdr.pins[CAPTURE_PIN_SYNC] = BUS_GEN_BIT_SYNC;
+      hdr.pins[CAPTURE_PIN_RDY]  = BUS_GEN_BIT_RDY;
+      hdr.pins[CAPTURE_PIN_PHI2] = arguments.oversample ? BUS_GEN_BIT_PHI2 : CAPTURE_UNCONNECTED;
+      hdr.pins[CAPTURE_PIN_RST]  = BUS_GEN_BIT_RST;
+      hdr.pins[CAPTURE_PIN_ADDR] = CAPTURE_UNCONNECTED;
+      hdr.cpu = arguments.c02 ? CAPTURE_CPU_65C02 : CAPTURE_CPU_6502;
+      // Master (decode6502's machine 1) or unspecified
+      hdr.machine = arguments.master ? 1 : CAPTURE_UNSPECIFIED;
+      // As if the CPU were clocked at 2MHz
+      hdr.sample_rate = arguments.oversample ? 4000000 * arguments.oversample : 2000000;
+      hdr.index_count = 0;
+      hdr.index_offset = 0;
+      if (capture_writer_open(&writer, arguments.output, &hdr)) {
+         return 1;
+      }
+   }
+
+   int next[NUM_EV] = { 0, 0, 0 };
+   bus_gen_cpu_reset(&cpu, RESET_HOLD);
+   while (cpu.cycles < arguments.cycles) {
+      int reset = 0;
+      for (int ev = 0; ev < NUM_EV; ev++) {
+         while (next[ev] < arguments.num_events[ev] && arguments.events[ev][next[ev]] <= cpu.cycles) {
+            next[ev]++;
+            if (ev == EV_IRQ) {
+               cpu.irq = 1;
+            } else if (ev == EV_NMI) {
+               cpu.nmi = 1;
+            } else {
+               reset = 1;
+            }
+         }
+      }
+      if (reset) {
+         bus_gen_cpu_reset(&cpu, RESET_HOLD);
+      } else {
+         bus_gen_cpu_step(&cpu);
+      }
+   }
+   flush_cycles();
+
+   if (arguments.output) {
+      return capture_writer_close(&writer);
+   }
+   return 0;
+}
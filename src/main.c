@@ -1,20 +1,114 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <argp.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "em_6502.h"
+#include "capture.h"
+#include "record.h"
+
+#ifdef FX2PIPE
+#include "../fx2pipe/fx2pipe/fx2capture.h"
+#endif
 
 // Sync-less decoder queue depth (samples)
 // (min of 3 needed to reliably detect interrupts)
 #define DEPTH 3
 
-int sample_count = 0;
+long long sample_count = 0;
+
+// Incremented whenever samples are lost (e.g. dropped in real-time mode), so
+// that each decoder stage can discard any partially decoded state
+int gap_count = 0;
+
+// FIFO overflows reported by fx2pipe: samples may be missing anywhere in
+// lo..hi-1, so the decoders are restarted at hi
+typedef struct {
+   long long lo;
+   long long hi;
+   int events;
+} overflow_t;
+
+overflow_t *overflows = NULL;
+int num_overflows = 0;
+int max_overflows = 0;
+
+// The next overflow to process, and the sample count at which to do so
+int overflow_idx = 0;
+long long overflow_at = LLONG_MAX;
+
+// Whether the marker for overflows[overflow_idx] has been output
+int overflow_marked = 0;
 
 #define BUFSIZE 8192
 
-uint16_t buffer[BUFSIZE];
+// Capture samples are 16, 32 or 64 bits wide (--width), and are held in a
+// 64 bit value while being decoded
+typedef uint64_t sample_t;
+
+int sample_bytes = sizeof(uint16_t);
+
+// Input records are single samples, or (sample, run length - 1) pairs with --rle
+int record_bytes = sizeof(uint16_t);
+
+// Real-time mode: default interval between output flushes (ms)
+#define RT_FLUSH_MS 20
+
+// Real-time mode: pipe size requested from the kernel, to give the capture
+// side some slack while the decoder catches up
+#define RT_PIPE_SIZE (1024 * 1024)
+
+// Default interval between progress reports (ms)
+#define PROGRESS_MS 250
+
+// Room for BUFSIZE records of any width
+uint64_t buffer[2 * BUFSIZE];
+
+// The capture is also written out in the documented capture format (--archive)
+capture_writer_t archive;
+int archiving = 0;
+
+// Samples per second, from the capture file header (0 if unknown)
+uint32_t sample_rate = 0;
+
+// File offset of the first record, i.e. the size of any header
+long long data_start = 0;
+
+// File offset just past the last record: a seek index may follow the
+// records (-1 if they run to the end of the file)
+long long data_end = -1;
+
+// The capture file header, for its seek index (index_count is 0 if there is
+// no header or no index)
+capture_header_t input_header;
+
+// File offset of the record at the start of buffer (file input only)
+long long input_offset = 0;
+
+// Instructions decoded so far, and bus cycles passed to the decoders
+long long instr_number = 0;
+long long cycle_number = 0;
+
+// Set to stop decoding, once past the end of the --range (or --cycle-range
+// or --sample-range)
+int stop = 0;
 
 // Whether to emulate each decoded instruction, to track additional state (registers and flags)
 int do_emulate = 0;
@@ -41,7 +135,19 @@ const char *argp_program_bug_address = "<dave@hoglet.com>";
 static char doc[] = "\n\
 Decoder for 6502/65C02 logic analyzer capture files.\n\
 \n\
-FILENAME must be a binary capture file with 16 bit samples.\n\
+FILENAME must be a binary capture file with 16 bit samples, or 32/64 bit\n\
+samples with --width (e.g. from fx2pipe -W).\n\
+\n\
+With --rle the input is run-length encoded instead (e.g. from fx2pipe -R):\n\
+each record is a sample followed by the run length minus one, both of the\n\
+sample width. With phi2 connected only the run boundaries need decoding.\n\
+\n\
+A capture file may also start with a header (see src/capture.h), in which\n\
+case the sample width and encoding are taken from it, as are the pin mapping,\n\
+cpu and machine type unless given on the command line. --archive writes such\n\
+a file, run-length encoded, with the settings in use and an index of places\n\
+to start decoding (resets and SYNC), e.g. to convert a capture:\n\
+   decode6502 --archive=OUT.cap [options] FILENAME > /dev/null\n\
 \n\
 If FILENAME is omitted, stdin is read instead.\n\
 \n\
@@ -52,6 +158,7 @@ The default bit assignments for the input signals are:\n\
  -  rdy: bit 10\n\
  - phi2: bit 11\n\
  -  rst: bit 14\n\
+ - addr: unconnected (assumes 16 consecutive bits)\n\
 \n\
 To specify that an input is unconnected, include the option with an empty\n\
 BITNUM. e.g. --sync=\n\
@@ -64,7 +171,83 @@ If rdy is not connected a value of '1' is assumed.\n\
 If sync is not connected a heuristic based decoder is used. This works well,\n\
 but can take several instructions to lock onto the instruction stream.\n\
 Use of sync, is preferred.\n\
-";
+\n\
+If addr is connected, the PC of each instruction is taken from the address\n\
+bus rather than predicted, and the sync-less decoder detects page crossings\n\
+from the effective addresses rather than from the emulated index registers.\n\
+\n\
+In real-time mode (--realtime) input is decoded as soon as it arrives and\n\
+output is flushed at least every MS milliseconds (default 20). If decoding\n\
+falls more than --max-lag samples behind the capture (default half of the\n\
+input pipe), whole chunks are dropped and a gap marker is output. Dropped\n\
+chunks are still written to the --archive file, so it can be decoded in full\n\
+afterwards.\n\
+\n\
+With --gaps, FIFO overflows recorded by fx2pipe (-gaps=FILE) are honoured:\n\
+a gap marker is output where samples may be missing, and the decoder state\n\
+is reset once past the affected range.\n\
+\n\
+--range=N-M outputs only instructions N to M (counting from 0),\n\
+--cycle-range=X-Y only those starting in bus cycles X to Y, and\n\
+--sample-range=S-E only those whose opcode fetch is in samples S to E;\n\
+either end may be omitted. Without an index the capture is decoded from the\n\
+start, except that a sync decode with --sample-range starts at the last\n\
+place before S listed in the capture file's own index (see src/capture.h),\n\
+if it has one. The decoders start afresh there, as after a gap, so the\n\
+instruction and cycle numbers count from there.\n\
+\n\
+--index=FILE writes a snapshot of the decoder state every --index-interval\n\
+instructions (default 100000) to FILE. Later runs with a range and the same\n\
+FILE read it instead, and jump to the last snapshot before the range, e.g.\n\
+   decode6502 --index=cap.idx cap.bin > /dev/null\n\
+   decode6502 --index=cap.idx --range=12000000-12000100 cap.bin\n\
+\n\
+--stats prints counts of samples, phi2 edges, cycles stalled by rdy, bus\n\
+cycles, instructions, interrupts, resets, emulator and pc prediction\n\
+failures on stderr at exit, with the time spent in each stage: input\n\
+(reading, or waiting for, the capture), extract (sample scanning and rdy),\n\
+decode (the bus cycle decoders), emulate and output. With --stats=MS a\n\
+progress line is also printed every MS milliseconds.\n\
+\n\
+--progress reports the samples decoded, how far through the capture file\n\
+that is, the current sample and instruction rates and the estimated time\n\
+remaining on stderr, every MS milliseconds (default 250). fx2pipe reports\n\
+its own transfer statistics instead.\n\
+\n\
+--text, --profile, --trace, --heatmap and --watch are further outputs of\n\
+the same decode, so that one pass over a capture can produce several\n\
+results. Each runs on its own thread, as does the text output on stdout\n\
+(unless --debug is given), fed with batches of records. All honour --range,\n\
+--cycle-range and --sample-range.\n\
+\n\
+--text=[COLS:]FILE writes the text output to FILE as well, with the columns\n\
+given by the letters of their options (any of h, y, t and s) rather than\n\
+those of stdout, e.g. --text=hs:state.txt --text=y:cycles.txt; it may be\n\
+given several times. --profile=FILE writes the number of times each address\n\
+was executed, and the bus cycles spent there, and --trace=FILE writes each\n\
+instruction as a binary record (see src/record.h).\n\
+\n\
+With addr connected, --heatmap=FILE writes the number of instruction\n\
+fetches, other reads and writes of each address, and --watch=LO[-HI]\n\
+reports each access to the addresses LO to HI (in hex) on stderr, with the\n\
+instruction making it; --watch may be given several times.\n\
+\n\
+Each instruction is timed from the sample of its opcode fetch to that of\n\
+the next instruction, so the duration includes any cycles stretched by rdy.\n\
+--time shows the start in microseconds from the start of the capture, and\n\
+needs the sample rate, from the capture header or --sample-rate. The trace\n\
+records hold the start sample, time and duration.\n\
+"
+#ifdef FX2PIPE
+"\n\
+With --fx2pipe the capture is taken directly from an FX2 device in-process\n\
+rather than from FILENAME. ARGS are fx2pipe options separated by spaces,\n\
+e.g. --fx2pipe=\"-d=0 -ifclk=x\" or --fx2pipe=\"-sim=FILE\" to replay a\n\
+capture file through fx2pipe's simulated device. FIFO overflows reported\n\
+by the FX2 are then handled as with --gaps.\n\
+"
+#endif
+;
 
 static char args_doc[] = "[FILENAME]";
 
@@ -75,16 +258,54 @@ static struct argp_option options[] = {
    { "rdy",            4, "BITNUM", OPTION_ARG_OPTIONAL, "The bit number for rdy, blank if unconnected"},
    { "phi2",           5, "BITNUM", OPTION_ARG_OPTIONAL, "The bit number for phi2, blank if unconnected"},
    { "rst",            6, "BITNUM", OPTION_ARG_OPTIONAL, "The bit number for rst, blank if unconnected"},
+   { "addr",          11, "BITNUM", OPTION_ARG_OPTIONAL, "The start bit number for addr, blank if unconnected"},
+   { "width",         10,   "BITS",                   0, "The sample width: 16 (default), 32 or 64"},
+   { "rle",           12,        0,                   0, "The input is run-length encoded (e.g. from fx2pipe -R)"},
+   { "archive",       13,    "FILE",                  0, "Also write the capture to FILE with a header, run-length encoded"},
    { "machine",      'm', "MACHINE",                  0, "Enable machine specific behaviour"},
    { "state",        's',        0,                   0, "Show register/flag state."},
    { "hex",          'h',        0,                   0, "Show hex bytes of instruction."},
    { "cycles",       'y',        0,                   0, "Show number of bus cycles."},
+   { "time",         't',        0,                   0, "Show the start time of each instruction (us)."},
    { "c02",          'c',        0,                   0, "Enable 65C02 mode."},
    { "undocumented", 'u',        0,                   0, "Enable undocumented 6502 opcodes (currently incomplete)"},
    { "debug",        'd',  "LEVEL",                   0, "Sets debug level (0 1 or 2)"},
+   { "realtime",     'r',     "MS", OPTION_ARG_OPTIONAL, "Enable real-time mode, flushing output every MS ms"},
+   { "max-lag",        7, "SAMPLES",                  0, "Real-time mode: drop input once this far behind"},
+   { "gaps",           9,    "FILE",                  0, "Reset the decoder at FIFO overflows listed in FILE"},
+   { "index",         14,    "FILE",                  0, "Write decoder snapshots to FILE, or seek using it"},
+   { "index-interval",15,       "N",                  0, "Instructions between index snapshots"},
+   { "range",         16,     "N-M",                  0, "Output only instructions N to M"},
+   { "cycle-range",   17,     "X-Y",                  0, "Output only instructions starting in cycles X to Y"},
+   { "stats",         18,      "MS", OPTION_ARG_OPTIONAL, "Print decoder statistics on stderr at exit, and every MS ms"},
+   { "progress",      19,      "MS", OPTION_ARG_OPTIONAL, "Report progress on stderr every MS ms (default 250)"},
+   { "profile",       20,    "FILE",                  0, "Write instruction counts and cycles by address to FILE"},
+   { "trace",         21,    "FILE",                  0, "Write a binary instruction trace to FILE"},
+   { "sample-rate",   22,      "HZ",                  0, "The sample rate, if not in the capture header"},
+   { "text",          23, "[COLS:]FILE",              0, "Also write the text output to FILE, with columns COLS (of hyts)"},
+   { "heatmap",       24,    "FILE",                  0, "Write bus cycle counts by address to FILE (needs addr)"},
+   { "watch",         25,  "LO[-HI]",                 0, "Report accesses to addresses LO to HI (hex) on stderr (needs addr)"},
+   { "sample-range",  26,     "S-E",                  0, "Output only instructions fetched in samples S to E"},
+#ifdef FX2PIPE
+   { "fx2pipe",        8,   "ARGS", OPTION_ARG_OPTIONAL, "Capture in-process from an FX2 device"},
+#endif
    { 0 }
 };
 
+// Columns of the text output, besides the pc and the instruction
+#define TEXT_HEX    0x01
+#define TEXT_CYCLES 0x02
+#define TEXT_TIME   0x04
+#define TEXT_STATE  0x08
+
+// Units of --range, --cycle-range and --sample-range
+#define RANGE_INSTR  0
+#define RANGE_CYCLE  1
+#define RANGE_SAMPLE 2
+
+#define MAX_TEXT    8
+#define MAX_WATCH   16
+
 struct arguments {
    int idx_data;
    int idx_rnw;
@@ -92,19 +313,113 @@ struct arguments {
    int idx_rdy;
    int idx_phi2;
    int idx_rst;
+   int idx_addr;
+   int width;
+   int rle;
+   char *archive;
    int machine;
    int show_state;
    int show_cycles;
+   int show_time;
    int show_hex;
    int c02;
    int undocumented;
    int debug;
+   int realtime;
+   int max_lag;
+   char *gaps;
+   char *index;
+   long long index_interval;
+   // Instruction (or bus cycle, or sample) range to output
+   long long range_lo;
+   long long range_hi;
+   int range_unit;
+   int stats;
+   int progress;
+   uint32_t sample_rate;
+   char *profile;
+   char *trace;
+   // --text outputs, and their TEXT_* columns
+   char *text[MAX_TEXT];
+   int text_columns[MAX_TEXT];
+   int num_text;
+   char *heatmap;
+   // --watch address ranges
+   int watch_lo[MAX_WATCH];
+   int watch_hi[MAX_WATCH];
+   int num_watch;
+   int fx2pipe;
+   char *fx2pipe_args;
    char *filename;
+   // The option keys given on the command line
+   char given[128];
 } arguments;
 
+// Whether an option (by key) was given on the command line
+#define GIVEN(key) (arguments.given[key])
+
+// Parse a range START[-END], where either end may be omitted
+static int parse_range(const char *arg, long long *lo, long long *hi) {
+   char *end;
+   *lo = 0;
+   *hi = LLONG_MAX;
+   if (*arg != '-') {
+      *lo = strtoll(arg, &end, 10);
+      if (end == arg) {
+         return -1;
+      }
+      arg = end;
+   }
+   if (*arg == '-' && *++arg) {
+      *hi = strtoll(arg, &end, 10);
+      if (end == arg) {
+         return -1;
+      }
+      arg = end;
+   }
+   return (*arg || *hi < *lo) ? -1 : 0;
+}
+
+// Parse the columns of a text output, as the letters of their options (h,
+// y, t and s), from the first len characters of arg
+static int parse_columns(const char *arg, int len) {
+   static const char letters[] = "hyts";
+   static const int columns[] = { TEXT_HEX, TEXT_CYCLES, TEXT_TIME, TEXT_STATE };
+   int ret = 0;
+   for (int i = 0; i < len; i++) {
+      const char *l = strchr(letters, arg[i]);
+      if (!l || !*l) {
+         return -1;
+      }
+      ret |= columns[l - letters];
+   }
+   return ret;
+}
+
+// Parse an address range LO[-HI], in hex
+static int parse_addr_range(const char *arg, int *lo, int *hi) {
+   char *end;
+   *lo = strtol(arg, &end, 16);
+   if (end == arg) {
+      return -1;
+   }
+   *hi = *lo;
+   if (*end == '-') {
+      arg = end + 1;
+      *hi = strtol(arg, &end, 16);
+      if (end == arg) {
+         return -1;
+      }
+   }
+   return (*end || *lo < 0 || *hi > 0xffff || *hi < *lo) ? -1 : 0;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
    int i;
    struct arguments *arguments = state->input;
+   if (key >= 0 && key < sizeof(arguments->given)) {
+      arguments->given[key] = 1;
+   }
    switch (key) {
    case   1:
       arguments->idx_data = atoi(arg);
@@ -139,6 +454,19 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
          arguments->idx_rst = -1;
       }
       break;
+   case  11:
+      if (arg && strlen(arg) > 0) {
+         arguments->idx_addr = atoi(arg);
+      } else {
+         arguments->idx_addr = -1;
+      }
+      break;
+   case  10:
+      arguments->width = atoi(arg);
+      if (arguments->width != 16 && arguments->width != 32 && arguments->width != 64) {
+         argp_error(state, "sample width must be 16, 32 or 64");
+      }
+      break;
    case 'c':
       if (arguments->undocumented) {
          argp_error(state, "undocumented and c02 flags mutually exclusive");
@@ -156,9 +484,70 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       }
       argp_error(state, "unsupported machine type");
       break;
+   case   7:
+      arguments->max_lag = atoi(arg);
+      break;
+   case  12:
+      arguments->rle = 1;
+      break;
+   case  13:
+      arguments->archive = arg;
+      break;
+   case   9:
+      arguments->gaps = arg;
+      break;
+   case  14:
+      arguments->index = arg;
+      break;
+   case  15:
+      arguments->index_interval = atoll(arg);
+      if (arguments->index_interval <= 0) {
+         argp_error(state, "index interval must be positive");
+      }
+      break;
+   case  16:
+   case  17:
+   case  26:
+      if (parse_range(arg, &arguments->range_lo, &arguments->range_hi)) {
+         argp_error(state, "bad range");
+      }
+      arguments->range_unit = (key == 16) ? RANGE_INSTR : (key == 17) ? RANGE_CYCLE : RANGE_SAMPLE;
+      break;
+   case  18:
+      arguments->stats = (arg && strlen(arg) > 0) ? atoi(arg) : 0;
+      if (arguments->stats < 0) {
+         argp_error(state, "stats interval must not be negative");
+      }
+      break;
+   case  19:
+      arguments->progress = (arg && strlen(arg) > 0) ? atoi(arg) : PROGRESS_MS;
+      if (arguments->progress <= 0) {
+         argp_error(state, "progress interval must be positive");
+      }
+      break;
+   case  20:
+      arguments->profile = arg;
+      break;
+   case  21:
+      arguments->trace = arg;
+      break;
+   case   8:
+      arguments->fx2pipe = 1;
+      arguments->fx2pipe_args = arg;
+      break;
    case 'd':
       arguments->debug = atoi(arg);
       break;
+   case 'r':
+      if (arg && strlen(arg) > 0) {
+         arguments->realtime = atoi(arg);
+      } else {
+         arguments->realtime = RT_FLUSH_MS;
+      }
+      if (arguments->realtime <= 0) {
+         argp_error(state, "real-time flush interval must be positive");
+      }
+      break;
    case 'h':
       arguments->show_hex = 1;
       break;
@@ -168,6 +557,43 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
    case 'y':
       arguments->show_cycles = 1;
       break;
+   case 't':
+      arguments->show_time = 1;
+      break;
+   case  23:
+      if (arguments->num_text == MAX_TEXT) {
+         argp_error(state, "too many text outputs");
+      }
+      arguments->text[arguments->num_text] = arg;
+      arguments->text_columns[arguments->num_text] = 0;
+      if (strchr(arg, ':')) {
+         int columns = parse_columns(arg, strchr(arg, ':') - arg);
+         if (columns < 0) {
+            argp_error(state, "text columns must be of h, y, t and s");
+         }
+         arguments->text[arguments->num_text] = strchr(arg, ':') + 1;
+         arguments->text_columns[arguments->num_text] = columns;
+      }
+      arguments->num_text++;
+      break;
+   case  24:
+      arguments->heatmap = arg;
+      break;
+   case  25:
+      if (arguments->num_watch == MAX_WATCH) {
+         argp_error(state, "too many watch ranges");
+      }
+      if (parse_addr_range(arg, &arguments->watch_lo[arguments->num_watch], &arguments->watch_hi[arguments->num_watch])) {
+         argp_error(state, "bad watch range");
+      }
+      arguments->num_watch++;
+      break;
+   case  22:
+      arguments->sample_rate = strtoul(arg, NULL, 10);
+      if (arguments->sample_rate == 0) {
+         argp_error(state, "sample rate must be positive");
+      }
+      break;
    case 'u':
       if (arguments->c02) {
          argp_error(state, "undocumented and c02 flags mutually exclusive");
@@ -181,6 +607,18 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       if (state->arg_num > 1) {
          argp_error(state, "multiple capture file arguments");
       }
+      if (arguments->fx2pipe && arguments->filename) {
+         argp_error(state, "capture file and fx2pipe are mutually exclusive");
+      }
+      if (arguments->given[16] + arguments->given[17] + arguments->given[26] > 1) {
+         argp_error(state, "range, cycle-range and sample-range are mutually exclusive");
+      }
+      if (arguments->index && (arguments->realtime || arguments->fx2pipe)) {
+         argp_error(state, "index needs a capture file, not real-time or fx2pipe input");
+      }
+      if (arguments->index && arguments->archive && (arguments->given[16] || arguments->given[17] || arguments->given[26])) {
+         argp_error(state, "archive needs the whole capture, so cannot seek using an index");
+      }
       break;
    default:
       return ARGP_ERR_UNKNOWN;
@@ -191,114 +629,254 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
 
 // ====================================================================
-// Analyze a complete instruction
+// Decoder statistics (--stats)
 // ====================================================================
 
-// TODO: all the pc prediction stuff could be pushed down into the emulation
+// The stages time is charged to
+#define STAGE_INPUT   0
+#define STAGE_EXTRACT 1
+#define STAGE_DECODE  2
+#define STAGE_EMULATE 3
+#define STAGE_OUTPUT  4
+#define NUM_STAGES    5
+
+const char *stage_names[] = {
+   "input",
+   "extract",
+   "decode",
+   "emulate",
+   "output"
+};
 
-// Predicted PC value
-int pc = -1;
+// Whether to count and time (--stats)
+int stats_on = 0;
+
+typedef struct {
+   long long samples;
+   long long phi2_edges;
+   long long rdy_stalls;
+   long long cycles;
+   long long interrupts;
+   long long resets;
+   long long em_fails;
+   long long pc_fails;
+   // Timestamp counter ticks spent in each stage
+   uint64_t ticks[NUM_STAGES];
+} stats_t;
+
+stats_t stats;
+
+// The stage being timed, and when it was entered
+static int stats_stage = STAGE_INPUT;
+static uint64_t stats_entered;
+
+// Timestamps at the start and of the last interval report, in ticks and ns
+static uint64_t stats_start_ticks;
+static long long stats_start_ns;
+static long long stats_last_ns;
+static long long stats_last_samples;
+
+static long long time_ns() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-static void analyze_instruction(int opcode, int op1, int op2, int read_accumulator, int write_accumulator, int intr_seen, int num_cycles, int rst_seen) {
+// The CPU timestamp counter where there is one (the conversion to seconds is
+// calibrated against the monotonic clock), otherwise the clock itself
+static inline uint64_t stats_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc();
+#else
+   return time_ns();
+#endif
+}
 
-   int offset;
-   char target[16];
+// Charge the time so far to the current stage and switch to another,
+// returning the previous one so it can be switched back to
+static inline int stats_switch(int stage) {
+   uint64_t now = stats_ticks();
+   int prev = stats_stage;
+   stats.ticks[prev] += now - stats_entered;
+   stats_entered = now;
+   stats_stage = stage;
+   return prev;
+}
 
-   // lookup the entry for the instruction
-   InstrType *instr = &instr_table[opcode];
+static void stats_init() {
+   memset(&stats, 0, sizeof(stats));
+   stats_on = 1;
+   stats_stage = STAGE_INPUT;
+   stats_start_ns = stats_last_ns = time_ns();
+   stats_start_ticks = stats_entered = stats_ticks();
+}
 
-   // For instructions that push the current address to the stack we
-   // can use the stacked address to determine the current PC
-   int newpc = -1;
-   if (intr_seen && opcode != 0x00) {
-      // IRQ/NMI/RST
-      newpc = (write_accumulator >> 8) & 0xffff;
-   } else if (opcode == 0x20) {
-      // JSR
-      newpc = (write_accumulator - 2) & 0xffff;
-   } else if (opcode == 0x00) {
-      // BRK
-      newpc = ((write_accumulator >> 8) - 2) & 0xffff;
+// Print a progress line if the interval has passed; called once per block
+// of input, so that the clock is not read per sample
+static void stats_interval() {
+   long long now = time_ns();
+   long long ms = (now - stats_last_ns) / 1000000;
+   if (ms < arguments.stats) {
+      return;
    }
+   long long total_ms = (now - stats_start_ns) / 1000000;
+   fprintf(stderr, "stats: %lld samples, %lld cycles, %lld instructions in %lld.%03ds (curr %.2f MS/s)\n",
+           stats.samples, stats.cycles, instr_number, total_ms / 1000, (int) (total_ms % 1000),
+           (stats.samples - stats_last_samples) / (ms * 1000.0));
+   stats_last_ns = now;
+   stats_last_samples = stats.samples;
+}
 
-   // Sanity check the current pc prediction has not gone awry
-   if (newpc >= 0) {
-      if (pc >= 0 && pc != newpc) {
-         printf("pc: prediction failed at %04X old pc was %04X\n", newpc, pc);
-         pc = newpc;
-      }
+// Print the summary at exit
+static void stats_report() {
+   stats_switch(stats_stage);
+   long long ns = time_ns() - stats_start_ns;
+   uint64_t ticks = stats_entered - stats_start_ticks;
+   double secs = ns / 1e9;
+   fprintf(stderr, "stats: %lld samples in %.3fs", stats.samples, secs);
+   if (ns > 10000000) {
+      fprintf(stderr, " (avg %.2f MS/s, %.2f Minstr/s)", stats.samples / (ns / 1e3), instr_number / (ns / 1e3));
+   }
+   fprintf(stderr, "\n");
+   fprintf(stderr, "stats:   phi2 edges     %14lld\n", stats.phi2_edges);
+   fprintf(stderr, "stats:   rdy stalls     %14lld\n", stats.rdy_stalls);
+   fprintf(stderr, "stats:   bus cycles     %14lld\n", stats.cycles);
+   fprintf(stderr, "stats:   instructions   %14lld\n", instr_number);
+   fprintf(stderr, "stats:   interrupts     %14lld\n", stats.interrupts);
+   fprintf(stderr, "stats:   resets         %14lld\n", stats.resets);
+   fprintf(stderr, "stats:   emulator fails %14lld\n", stats.em_fails);
+   fprintf(stderr, "stats:   pc fails       %14lld\n", stats.pc_fails);
+   for (int i = 0; i < NUM_STAGES; i++) {
+      fprintf(stderr, "stats:   %-8s %12.3fs %5.1f%%\n", stage_names[i],
+              ticks ? secs * stats.ticks[i] / ticks : 0.0,
+              ticks ? 100.0 * stats.ticks[i] / ticks : 0.0);
    }
+}
+
+// ====================================================================
+// Analyze a complete instruction
+// ====================================================================
+
+// TODO: all the pc prediction stuff could be pushed down into the emulation
+
+// Predicted PC value (or the actual one, if the address bus is captured)
+int pc = -1;
+
+// When each of the most recent bus cycles was decoded: its sample number,
+// and the number of cycles stretched by rdy so far
+#define TIMING_HISTORY 4
+
+typedef struct {
+   long long sample;
+   long long stalls;
+} cycle_time_t;
+
+static cycle_time_t cycle_times[TIMING_HISTORY];
+
+// The opcode fetch of the instruction being analyzed, valid if gap_count is
+// still instr_start_gap, and its bus cycle number (-1 if not known)
+static cycle_time_t instr_start;
+static int instr_start_gap = -1;
+static long long instr_start_cycle = -1;
+
+// The address, data and rnw of the most recent bus cycles, if they are
+// needed (--heatmap, --watch); long enough for the longest instruction on
+// top of the sync-less decoder's lag
+#define ACCESS_HISTORY 16
+
+typedef struct {
+   uint16_t addr;
+   uint8_t data;
+   uint8_t rnw;
+} bus_access_t;
+
+static int record_accesses = 0;
+static bus_access_t access_history[ACCESS_HISTORY];
+
+// The time of a sample in ns from the start of the capture; the sample rate
+// must be known. Integer arithmetic, so as not to lose precision however
+// long the capture is.
+static long long sample_ns(long long sample) {
+   return sample / sample_rate * 1000000000LL + sample % sample_rate * 1000000000LL / sample_rate;
+}
+
+// Long enough for any line of the text output
+#define TEXT_LINE   256
+
+// Whether the text output is written as each instruction is analyzed,
+// rather than by a consumer thread (always, with debug output, so that the
+// two stay in order), and its columns
+static int text_inline = 1;
+static int text_columns = 0;
+
+// Format a record as a line of the text output, with the TEXT_* columns
+// given; returns line
+static char *format_record(char *line, const instr_record_t *r, int columns) {
+   int offset;
+   char target[16];
+   InstrType *instr = &instr_table[r->opcode];
+   char *p = line;
 
-   if (pc < 0) {
-      printf("???? : ");
+   if (r->pc < 0) {
+      p += sprintf(p, "???? : ");
    } else {
-      printf("%04X : ", pc);
+      p += sprintf(p, "%04X : ", r->pc);
    }
 
-   int numchars = 0;
-   if (rst_seen) {
-      // Annotate a reset
-      if (arguments.show_hex) {
-         printf("         : ");
-      }
-      numchars = printf("RESET !!");
-      if (do_emulate) {
-         em_reset();
-      }
-   } else if (intr_seen && opcode != 0) {
-      // Annotate an interrupt
-      if (arguments.show_hex) {
-         printf("         : ");
-      }
-      numchars = printf("INTERRUPT !!");
-      if (do_emulate) {
-         em_interrupt(write_accumulator & 0xff);
+   char *start;
+   if (r->flags & (RECORD_RESET | RECORD_INTERRUPT)) {
+      // Annotate a reset or an interrupt
+      if (columns & TEXT_HEX) {
+         p += sprintf(p, "         : ");
       }
+      start = p;
+      p += sprintf(p, (r->flags & RECORD_RESET) ? "RESET !!" : "INTERRUPT !!");
    } else {
-      if (arguments.show_hex) {
+      if (columns & TEXT_HEX) {
          if (instr->len == 1) {
-            printf("%02X       : ", opcode);
+            p += sprintf(p, "%02X       : ", r->opcode);
          } else if (instr->len == 2) {
-            printf("%02X %02X    : ", opcode, op1);
+            p += sprintf(p, "%02X %02X    : ", r->opcode, r->op1);
          } else {
-            printf("%02X %02X %02X : ", opcode, op1, op2);
+            p += sprintf(p, "%02X %02X %02X : ", r->opcode, r->op1, r->op2);
          }
       }
       // Annotate a normal instruction
+      start = p;
       const char *mnemonic = instr->mnemonic;
       const char *fmt = instr->fmt;
       switch (instr->mode) {
       case IMP:
       case IMPA:
-         numchars = printf(fmt, mnemonic);
+         p += sprintf(p, fmt, mnemonic);
          break;
       case BRA:
          // Calculate branch target using op1 for normal branches
-         offset = (int8_t) op1;
-         if (pc < 0) {
+         offset = (int8_t) r->op1;
+         if (r->pc < 0) {
             if (offset < 0) {
                sprintf(target, "pc-%d", -offset);
             } else {
                sprintf(target,"pc+%d", offset);
             }
          } else {
-            sprintf(target, "%04X", pc + 2 + offset);
+            sprintf(target, "%04X", r->pc + 2 + offset);
          }
-         numchars = printf(fmt, mnemonic, target);
+         p += sprintf(p, fmt, mnemonic, target);
          break;
       case ZPR:
          // Calculate branch target using op2 for BBR/BBS
-         offset = (int8_t) op2;
-         if (pc < 0) {
+         offset = (int8_t) r->op2;
+         if (r->pc < 0) {
             if (offset < 0) {
                sprintf(target, "pc-%d", -offset);
             } else {
                sprintf(target,"pc+%d", offset);
             }
          } else {
-            sprintf(target, "%04X", pc + 3 + offset);
+            sprintf(target, "%04X", r->pc + 3 + offset);
          }
-         numchars = printf(fmt, mnemonic, op1, target);
+         p += sprintf(p, fmt, mnemonic, r->op1, target);
          break;
       case IMM:
       case ZP:
@@ -307,67 +885,214 @@ static void analyze_instruction(int opcode, int op1, int op2, int read_accumulat
       case INDX:
       case INDY:
       case IND:
-         numchars = printf(fmt, mnemonic, op1);
+         p += sprintf(p, fmt, mnemonic, r->op1);
          break;
       case ABS:
       case ABSX:
       case ABSY:
       case IND16:
       case IND1X:
-         numchars = printf(fmt, mnemonic, op1, op2);
+         p += sprintf(p, fmt, mnemonic, r->op1, r->op2);
          break;
       }
+   }
 
-      // Emulate the instruction
-      if (do_emulate) {
-         if (instr->emulate) {
-            int operand;
-            if (instr->optype == WRITEOP) {
-               // the operand is the value being written (STA/STX/STY/PHP/PHA/PHX/PHY/BRK)
-               operand = write_accumulator & 0xff;
-            } else if (instr->optype == BRANCHOP) {
-               // the operand is true if branch taken
-               operand = (num_cycles != 2);
-            } else if (opcode == 0x40) {
-               // RTI: the operand (flags) is the first read cycle of three
-               operand = (read_accumulator >> 16) & 0xff;
-            } else if (instr->mode == IMM) {
-               // Immediate addressing mode: the operand is the 2nd byte of the instruction
-               operand = op1;
-            } else if (instr->decimalcorrect && (em_get_D() == 1)) {
-               // read operations on the C02 that have an extra cycle added
-               operand = (read_accumulator >> 8) & 0xff;
-            } else if (instr->optype == TSBTRBOP) {
-               // For TSB/TRB, the operand is the last-but-one read, followed by a dummy read
-               operand = (read_accumulator >> 8) & 0xff;
-            } else {
-               // read operations in general, use the most recent read
-               operand = read_accumulator & 0xff;
-            }
-            instr->emulate(operand);
-         }
+   if (columns & (TEXT_CYCLES | TEXT_TIME | TEXT_STATE)) {
+      // Pad opcode to 14 characters, to match python
+      while (p - start < 14) {
+         *p++ = ' ';
       }
    }
 
-   if ((arguments.show_cycles || (arguments.show_state))) {
-      // Pad opcode to 14 characters, to match python
-      while (numchars++ < 14) {
-         printf(" ");
+   if (columns & TEXT_CYCLES) {
+      p += sprintf(p, " : %d", r->cycles);
+   }
+
+   if (columns & TEXT_TIME) {
+      if (r->time >= 0) {
+         p += sprintf(p, " : %lld.%03lld", (long long) r->time / 1000, (long long) r->time % 1000);
+      } else {
+         p += sprintf(p, " : ?");
+      }
+   }
+
+   if (columns & TEXT_STATE) {
+      int state[EM_STATE_SIZE];
+      for (int i = 0; i < RECORD_STATE_SIZE; i++) {
+         state[i] = r->state[i];
+      }
+      state[RECORD_STATE_SIZE] = (r->flags & RECORD_EM_FAIL) != 0;
+      p += sprintf(p, " : ");
+      p += strlen(em_format_state(p, state));
+   }
+
+   *p++ = '\n';
+   *p = 0;
+   return line;
+}
+
+// Number of instruction record consumers (--profile, --trace, the text
+// output and so on)
+static int num_consumers = 0;
+
+static void emit_record(const instr_record_t *r, long long first_cycle, long long end_cycle);
+static void emit_note(const char *fmt, ...);
+static void flush_output();
+
+// ADDR is the address of the opcode fetch, or -1 if not captured
+static void analyze_instruction(int opcode, int op1, int op2, int read_accumulator, int write_accumulator, int intr_seen, int num_cycles, int rst_seen, int addr) {
+
+   // lookup the entry for the instruction
+   InstrType *instr = &instr_table[opcode];
+
+   instr_number++;
+
+   int stage = stats_on ? stats_switch(STAGE_OUTPUT) : 0;
+
+   // RECORD_* flags for consumers
+   int flags = 0;
+
+   // The instruction ends at the opcode fetch of the next one, which the
+   // sync-less decoder is DEPTH - 1 cycles behind; the start and duration
+   // are in samples, and stretch is the cycles with rdy low
+   long long start = -1;
+   int duration = 0;
+   int stretch = 0;
+   long long first_cycle = -1;
+   long long end_cycle = stats.cycles - ((arguments.idx_sync < 0) ? DEPTH - 1 : 0);
+   if (end_cycle > 0) {
+      cycle_time_t *end = &cycle_times[end_cycle % TIMING_HISTORY];
+      if (instr_start_gap == gap_count) {
+         start = instr_start.sample;
+         duration = end->sample - start;
+         stretch = end->stalls - instr_start.stalls;
+         first_cycle = instr_start_cycle;
+      }
+      instr_start = *end;
+      instr_start_gap = gap_count;
+      instr_start_cycle = end_cycle;
+   }
+
+   // For instructions that push the current address to the stack we
+   // can use the stacked address to determine the current PC
+   int newpc = -1;
+   if (addr >= 0) {
+      // No need to predict anything
+      pc = addr;
+   } else if (intr_seen && opcode != 0x00) {
+      // IRQ/NMI/RST
+      newpc = (write_accumulator >> 8) & 0xffff;
+   } else if (opcode == 0x20) {
+      // JSR
+      newpc = (write_accumulator - 2) & 0xffff;
+   } else if (opcode == 0x00) {
+      // BRK
+      newpc = ((write_accumulator >> 8) - 2) & 0xffff;
+   }
+
+   // Sanity check the current pc prediction has not gone awry
+   if (newpc >= 0) {
+      if (pc >= 0 && pc != newpc) {
+         emit_note("pc: prediction failed at %04X old pc was %04X\n", newpc, pc);
+         pc = newpc;
+         stats.pc_fails++;
+         flags |= RECORD_PC_FAIL;
+      }
+   }
+
+   if (rst_seen) {
+      stats.resets++;
+      flags |= RECORD_RESET;
+      if (do_emulate) {
+         em_reset();
+      }
+   } else if (intr_seen && opcode != 0) {
+      stats.interrupts++;
+      flags |= RECORD_INTERRUPT;
+      if (do_emulate) {
+         em_interrupt(write_accumulator & 0xff);
+      }
+   } else if (do_emulate && instr->emulate) {
+      // Emulate the instruction
+      int operand;
+      if (instr->optype == WRITEOP) {
+         // the operand is the value being written (STA/STX/STY/PHP/PHA/PHX/PHY/BRK)
+         operand = write_accumulator & 0xff;
+      } else if (instr->optype == BRANCHOP) {
+         // the operand is true if branch taken
+         operand = (num_cycles != 2);
+      } else if (opcode == 0x40) {
+         // RTI: the operand (flags) is the first read cycle of three
+         operand = (read_accumulator >> 16) & 0xff;
+      } else if (instr->mode == IMM) {
+         // Immediate addressing mode: the operand is the 2nd byte of the instruction
+         operand = op1;
+      } else if (instr->decimalcorrect && (em_get_D() == 1)) {
+         // read operations on the C02 that have an extra cycle added
+         operand = (read_accumulator >> 8) & 0xff;
+      } else if (instr->optype == TSBTRBOP) {
+         // For TSB/TRB, the operand is the last-but-one read, followed by a dummy read
+         operand = (read_accumulator >> 8) & 0xff;
+      } else {
+         // read operations in general, use the most recent read
+         operand = read_accumulator & 0xff;
+      }
+      if (stats_on) {
+         stats_switch(STAGE_EMULATE);
+         instr->emulate(operand);
+         stats_switch(STAGE_OUTPUT);
+      } else {
+         instr->emulate(operand);
       }
    }
 
-   if (arguments.show_cycles) {
-      printf(" : %d", num_cycles);
+   // Reported with the instruction (or interrupt) that failed, as -s did
+   if (do_emulate && em_get_fail()) {
+      stats.em_fails++;
+      flags |= RECORD_EM_FAIL;
+      em_clear_fail();
+   }
+
+   // Summarise the instruction, for the text output and the consumers
+   instr_record_t rec;
+   memset(&rec, 0, sizeof(instr_record_t));
+   rec.instr = instr_number - 1;
+   rec.pc = pc;
+   rec.opcode = opcode;
+   rec.op1 = op1;
+   rec.op2 = op2;
+   rec.cycles = num_cycles;
+   rec.flags = flags;
+   rec.stretch = stretch > 0xffff ? 0xffff : stretch;
+   rec.sample = start;
+   rec.time = (start >= 0 && sample_rate) ? sample_ns(start) : -1;
+   rec.duration = duration;
+   if (do_emulate) {
+      int em[EM_STATE_SIZE];
+      em_save(em);
+      for (int i = 0; i < RECORD_STATE_SIZE; i++) {
+         rec.state[i] = em[i];
+      }
+   } else {
+      for (int i = 0; i < RECORD_STATE_SIZE; i++) {
+         rec.state[i] = -1;
+      }
    }
 
-   if (arguments.show_state) {
-      printf(" : %s", em_get_state());
+   if (text_inline) {
+      char line[TEXT_LINE];
+      fputs(format_record(line, &rec, text_columns), stdout);
    }
 
-   printf("\n");
+   if (num_consumers) {
+      emit_record(&rec, first_cycle, end_cycle);
+   }
 
    // Look for control flow changes and update the PC
-   if (opcode == 0x40 || opcode == 0x00 || opcode == 0x6c || opcode == 0x7c || intr_seen || rst_seen) {
+   if (addr >= 0) {
+      // The next opcode fetch will tell
+      pc = -1;
+   } else if (opcode == 0x40 || opcode == 0x00 || opcode == 0x6c || opcode == 0x7c || intr_seen || rst_seen) {
       // RTI, BRK, INTR, JMP (ind), JMP (ind, X), IRQ/NMI/RST
       pc = ((read_accumulator & 0xFF00) >> 8) | ((read_accumulator & 0x00FF) << 8);
    } else if (opcode == 0x20 || opcode == 0x4c) {
@@ -379,11 +1104,11 @@ static void analyze_instruction(int opcode, int op1, int op2, int read_accumulat
    } else if (pc < 0) {
       // PC value is not known yet, everything below this point is relative
       pc = -1;
-   } else if (opcode == 0x80) {
+   } else if (opcode == 0x80 && arguments.c02) {
       // BRA
       pc += ((int8_t)(op1)) + 2;
       pc &= 0xffff;
-   } else if (((opcode & 0x0f) == 0x0f) && (num_cycles != 5)) {
+   } else if (((opcode & 0x0f) == 0x0f) && arguments.c02 && (num_cycles != 5)) {
       // BBR/BBS: op2 if taken
       pc += ((int8_t)(op2)) + 3;
       pc &= 0xffff;
@@ -396,13 +1121,30 @@ static void analyze_instruction(int opcode, int op1, int op2, int read_accumulat
       pc += instr->len;
       pc &= 0xffff;
    }
+
+   if (stats_on) {
+      stats_switch(stage);
+   }
 }
 
 // ====================================================================
 // Sync-less bus cycle decoder
 // ====================================================================
 
-void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q) {
+// Whether an indexed read from BASE crosses a page, from the addresses of
+// the cycle which reads the effective address if not (ADDR) and the one
+// after (NEXT). When crossing a page, the 6502 reads from the wrong page (low
+// byte wrapped), and the 65C02 re-reads the last operand byte (at LAST),
+// before reading the effective address. The effective address could be LAST
+// itself, but then the next cycle is not off the base page.
+static int page_crossed(int addr, int next, int base, int last) {
+   if (arguments.c02) {
+      return addr == last && (next >> 8) != (base >> 8);
+   }
+   return ((addr >> 8) != (base >> 8)) || ((addr & 0xff) < (base & 0xff));
+}
+
+void decode_cycle_without_sync(int *bus_data_q, int *bus_addr_q, int *pin_rnw_q, int *pin_rst_q) {
 
    // Count of the 6502 bus cycles
    static int cyclenum             = 0;
@@ -421,8 +1163,22 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
    static int opcount              = 0;
    static int rst_seen             = 0;
    static int intr_seen            = 0;
+   static int opcode_addr          = -1;
+
+   // Discard the partially decoded instruction if samples have been lost
+   static int last_gap_count       = 0;
+   if (last_gap_count != gap_count) {
+      last_gap_count = gap_count;
+      last_cyclenum  = cyclenum;
+      opcode         = -1;
+      bus_cycle      = 0;
+      cycle_count    = 0;
+      rst_seen       = 0;
+      intr_seen      = 0;
+   }
 
    int bus_data = *bus_data_q;
+   int bus_addr = *bus_addr_q;
    int pin_rnw = *pin_rnw_q;
    int pin_rst = *pin_rst_q;
 
@@ -444,7 +1200,7 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
       op1 = bus_data;
    }
 
-   if (bus_cycle == ((opcode == 0x20) ? 5 : ((opcode & 0x0f) == 0x0f) ? 4 : 2) && opcount >= 2) {
+   if (bus_cycle == ((opcode == 0x20) ? 5 : ((opcode & 0x0f) == 0x0f && arguments.c02) ? 4 : 2) && opcount >= 2) {
       op2 = bus_data;
    }
 
@@ -458,8 +1214,13 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
       // Applies to INDY, but need to exclude stores
       if ((instr->mode == INDY) && (instr->optype == READOP)) {
          int index = em_get_Y();
-         if (index >= 0) {
-            int base = ((read_accumulator & 0xFF00) >> 8) | ((read_accumulator & 0x00FF) << 8);
+         int base = ((read_accumulator & 0xFF00) >> 8) | ((read_accumulator & 0x00FF) << 8);
+         if (bus_addr >= 0) {
+            // This cycle reads the effective address unless crossing a page
+            if (page_crossed(bus_addr, *(bus_addr_q + 1), base, (opcode_addr + 1) & 0xffff)) {
+               cycle_count++;
+            }
+         } else if (index >= 0) {
             if ((base & 0xff00) != ((base + index) & 0xff00)) {
                cycle_count++;
             }
@@ -475,8 +1236,13 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
          // 65C02: Need to exclude DEC/INC, which are 7 cycles regardless
          if ((opcode != 0xDE) && (opcode != 0xFE) && (arguments.c02 || ((opcode != 0x1E) && (opcode != 0x3E) && (opcode != 0x5E) && (opcode != 0x7E)))) {
             int index = (instr->mode == ABSX) ? em_get_X() : em_get_Y();
-            if (index >= 0) {
-               int base = op1 + (op2 << 8);
+            int base = op1 + (op2 << 8);
+            if (bus_addr >= 0) {
+               // The next cycle reads the effective address unless crossing a page
+               if (page_crossed(*(bus_addr_q + 1), *(bus_addr_q + 2), base, (opcode_addr + 2) & 0xffff)) {
+                  cycle_count++;
+               }
+            } else if (index >= 0) {
                if ((base & 0xff00) != ((base + index) & 0xff00)) {
                   cycle_count++;
                }
@@ -498,7 +1264,7 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
    //
 
    if (bus_cycle == 4) {
-      if ((opcode & 0x0f) == 0x0f) {
+      if ((opcode & 0x0f) == 0x0f && arguments.c02) {
          int operand = (read_accumulator >> 8) & 0xff;
          // invert operand for BBR
          if (opcode <= 0x80) {
@@ -522,7 +1288,7 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
 
    // Account for extra cycles in a branch
    if (bus_cycle == 1) {
-      if (((opcode & 0x1f) == 0x10) || (opcode == 0x80)) {
+      if (((opcode & 0x1f) == 0x10) || (opcode == 0x80 && arguments.c02)) {
          // Default to backards branches taken, forward not taken
          int taken = ((int8_t)op1) < 0;
          switch (opcode) {
@@ -606,11 +1372,11 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
                      new_phase = 0;
                   }
                   if (mhz1_phase != new_phase) {
-                     printf("correcting 1MHz phase\n");
+                     emit_note("correcting 1MHz phase\n");
                      mhz1_phase = new_phase;
                   }
                } else {
-                  printf("fail: 1MHz access not extended as expected\n");
+                  emit_note("fail: 1MHz access not extended as expected\n");
                }
             }
             // Correct cycle count based on expected cycle stretching behaviour
@@ -645,12 +1411,18 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
    if (bus_cycle == cycle_count) {
       // Analyze the  previous instrucution
       if (opcode >= 0) {
-         analyze_instruction(opcode, op1, op2, read_accumulator, write_accumulator, intr_seen, cyclenum - last_cyclenum, rst_seen);
+         analyze_instruction(opcode, op1, op2, read_accumulator, write_accumulator, intr_seen, cyclenum - last_cyclenum, rst_seen, opcode_addr);
          rst_seen = 0;
          intr_seen = 0;
       }
       last_cyclenum  = cyclenum;
 
+      // With the address bus, the PC of the new instruction is known now
+      opcode_addr = bus_addr;
+      if (bus_addr >= 0) {
+         pc = bus_addr;
+      }
+
       // Re-initialize the state for the new instruction
       opcode            = bus_data;
       op1               = 0;
@@ -681,21 +1453,31 @@ void decode_cycle_without_sync(int *bus_data_q, int *pin_rnw_q, int *pin_rst_q)
    cyclenum++;
 }
 
-void lookahead_decode_cycle_without_sync(int bus_data, int pin_rnw, int pin_rst) {
+void lookahead_decode_cycle_without_sync(int bus_data, int bus_addr, int pin_rnw, int pin_rst) {
    static int bus_data_q[DEPTH];
+   static int bus_addr_q[DEPTH];
    static int pin_rnw_q[DEPTH];
    static int pin_rst_q[DEPTH];
    static int fill = 0;
 
+   // Discard the queued samples if samples have been lost
+   static int last_gap_count = 0;
+   if (last_gap_count != gap_count) {
+      last_gap_count = gap_count;
+      fill = 0;
+   }
+
    bus_data_q[fill] = bus_data;
+   bus_addr_q[fill] = bus_addr;
    pin_rnw_q[fill] = pin_rnw;
    pin_rst_q[fill] = pin_rst;
    if (fill < DEPTH - 1) {
       fill++;
    } else {
-      decode_cycle_without_sync(bus_data_q, pin_rnw_q, pin_rst_q);
+      decode_cycle_without_sync(bus_data_q, bus_addr_q, pin_rnw_q, pin_rst_q);
       for (int i = 0; i < DEPTH - 1; i++) {
          bus_data_q[i] = bus_data_q[i + 1];
+         bus_addr_q[i] = bus_addr_q[i + 1];
          pin_rnw_q[i] = pin_rnw_q[i + 1];
          pin_rst_q[i] = pin_rst_q[i + 1];
       }
@@ -706,7 +1488,7 @@ void lookahead_decode_cycle_without_sync(int bus_data, int pin_rnw, int pin_rst)
 // Sync-based bus cycle decoder
 // ====================================================================
 
-void decode_cycle_with_sync(int bus_data, int pin_rnw, int pin_sync, int pin_rst) {
+void decode_cycle_with_sync(int bus_data, int bus_addr, int pin_rnw, int pin_sync, int pin_rst) {
 
    // Count of the 6502 bus cycles
    static int cyclenum             = 0;
@@ -725,6 +1507,17 @@ void decode_cycle_with_sync(int bus_data, int pin_rnw, int pin_sync, int pin_rst
    static int write_accumulator    = 0;
    static int last_pin_rst         = 1;
    static int rst_seen             = 0;
+   static int opcode_addr          = -1;
+
+   // Discard the partially decoded instruction if samples have been lost
+   static int last_gap_count       = 0;
+   if (last_gap_count != gap_count) {
+      last_gap_count = gap_count;
+      last_cyclenum  = cyclenum;
+      opcode         = -1;
+      last_pin_rst   = 1;
+      rst_seen       = 0;
+   }
 
    if (pin_rst == 1) {
 
@@ -740,13 +1533,14 @@ void decode_cycle_with_sync(int bus_data, int pin_rnw, int pin_sync, int pin_rst
 
          // Analyze the  previous instrucution
          if (opcode >= 0) {
-            analyze_instruction(opcode, op1, op2, read_accumulator, write_accumulator, write_count == 3, cyclenum - last_cyclenum, rst_seen);
+            analyze_instruction(opcode, op1, op2, read_accumulator, write_accumulator, write_count == 3, cyclenum - last_cyclenum, rst_seen, opcode_addr);
             rst_seen = 0;
          }
          last_cyclenum  = cyclenum;
 
          bus_cycle         = 0;
          opcode            = bus_data;
+         opcode_addr       = bus_addr;
          opcount           = instr_table[opcode].len - 1;
          write_count       = 0;
          read_accumulator  = 0;
@@ -761,7 +1555,7 @@ void decode_cycle_with_sync(int bus_data, int pin_rnw, int pin_sync, int pin_rst
       } else if (bus_cycle == 1 && opcount >= 1) {
          op1 = bus_data;
 
-      } else if (bus_cycle == ((opcode == 0x20) ? 5 : ((opcode & 0x0f) == 0x0f) ? 4 : 2) && opcount >= 2 && write_count < 3) {
+      } else if (bus_cycle == ((opcode == 0x20) ? 5 : ((opcode & 0x0f) == 0x0f && arguments.c02) ? 4 : 2) && opcount >= 2 && write_count < 3) {
          // JSR     is <opcode> <op1> <dummp stack rd> <stack wr> <stack wr> <op2>
          // BBR/BBS is <opcode> <op1> <zp> <dummy> <op2> (<branch taken penalty>) (<page cross penatly)
          op2 = bus_data;
@@ -785,140 +1579,1625 @@ void decode_cycle_with_sync(int bus_data, int pin_rnw, int pin_sync, int pin_rst
 }
 
 // ====================================================================
-// Input file processing and bus cycle extraction
+// Lost sample handling
 // ====================================================================
 
-void decode(FILE *stream) {
+// Called when samples have been dropped from the capture stream, so that the
+// decoders restart cleanly on the far side of the gap
+void decode_gap(long long num_samples) {
+   emit_note("gap: %lld samples dropped\n", num_samples);
+   sample_count += num_samples;
+   gap_count++;
+   pc = -1;
+   if (do_emulate) {
+      em_invalidate();
+   }
+}
 
-   // Pin mappings into the 16 bit words
-   int idx_data  = arguments.idx_data;
-   int idx_rnw   = arguments.idx_rnw ;
-   int idx_sync  = arguments.idx_sync;
-   int idx_rdy   = arguments.idx_rdy ;
-   int idx_phi2  = arguments.idx_phi2;
-   int idx_rst   = arguments.idx_rst;
+// Record a FIFO overflow somewhere in capture bytes lo..hi-1
+void add_overflow(long long lo, long long hi, int events) {
+   if (num_overflows == max_overflows) {
+      max_overflows = max_overflows ? max_overflows * 2 : 16;
+      overflows = realloc(overflows, max_overflows * sizeof(overflow_t));
+      if (!overflows) {
+         perror("failed to allocate overflow list");
+         exit(1);
+      }
+   }
+   overflow_t *o = &overflows[num_overflows++];
+   o->lo = lo / sample_bytes;
+   o->hi = (hi + sample_bytes - 1) / sample_bytes;
+   o->events = events;
+   if (!overflow_marked && overflow_idx == num_overflows - 1) {
+      overflow_at = o->lo;
+   }
+}
 
-   // Pin values
-   int bus_data  =  0;
-   int pin_rnw   =  0;
-   int pin_sync  =  0;
-   int pin_rdy   =  1;
-   int pin_phi2  =  0;
-   int pin_rst   =  1;
+// Load the FIFO overflow records written by fx2pipe -gaps=FILE
+int load_overflows(const char *filename) {
+   FILE *f = fopen(filename, "r");
+   if (f == NULL) {
+      perror("failed to open gaps file");
+      return 1;
+   }
+   char line[256];
+   while (fgets(line, sizeof(line), f)) {
+      long long lo;
+      long long hi;
+      int events;
+      if (line[0] == '#') {
+         continue;
+      }
+      if (sscanf(line, "%lld %lld %d", &lo, &hi, &events) != 3 || hi < lo) {
+         fprintf(stderr, "bad line in gaps file: %s", line);
+         fclose(f);
+         return 1;
+      }
+      add_overflow(lo, hi, events);
+   }
+   fclose(f);
+   return 0;
+}
 
-   int num;
+// Called when sample_count reaches overflow_at
+static void process_overflow() {
+   overflow_t *o = &overflows[overflow_idx];
+   if (!overflow_marked) {
+      emit_note("gap: %d FIFO overflow(s) in samples %lld..%lld\n", o->events, o->lo, o->hi - 1);
+      overflow_marked = 1;
+      overflow_at = o->hi;
+   } else {
+      // Anything decoded since the gap is suspect, so start over
+      gap_count++;
+      pc = -1;
+      if (do_emulate) {
+         em_invalidate();
+      }
+      overflow_marked = 0;
+      overflow_idx++;
+      overflow_at = (overflow_idx < num_overflows) ? overflows[overflow_idx].lo : LLONG_MAX;
+   }
+}
 
-   // The previous sample of the 16-bit capture (async sampling only)
-   uint16_t sample       = -1;
-   uint16_t last_sample  = -1;
-   uint16_t last2_sample = -1;
+// ====================================================================
+// Input file processing and bus cycle extraction
+// ====================================================================
 
-   // The previous sample of phi2 (async sampling only)
-   int last_phi2 = -1;
+// Pin values
+static int bus_data  =  0;
+static int bus_addr  = -1;
+static int pin_rnw   =  0;
+static int pin_sync  =  0;
+static int pin_rdy   =  1;
+static int pin_phi2  =  0;
+static int pin_rst   =  1;
 
-   while ((num = fread(buffer, sizeof(uint16_t), BUFSIZE, stream)) > 0) {
+// The current sample of the capture, and the previous two (async sampling only)
+static sample_t sample       = -1;
+static sample_t last_sample  = -1;
+static sample_t last2_sample = -1;
 
-      uint16_t *sampleptr = &buffer[0];
+// The previous sample of phi2 (async sampling only)
+static int last_phi2 = -1;
 
-      while (num-- > 0) {
+static int last_gap_count = 0;
 
-         // The current 16-bit capture sample, and the previous two
-         last2_sample = last_sample;
-         last_sample  = sample;
-         sample       = *sampleptr++;
+// The sample position in run-length encoded input: the file offset of the
+// current record, the number of its first sample, and the number of its
+// samples which have already been decoded when resuming from a snapshot
+static long long run_offset = 0;
+static long long run_start = 0;
+static long long run_skip = 0;
 
-         // TODO: fix the hard coded values!!!
-         if (arguments.debug >= 2) {
-            printf("%d %02x %x %x %x %x\n", sample_count, sample&255, (sample >> 8)&1,  (sample >> 9)&1,  (sample >> 10)&1,  (sample >> 11)&1  );
-         }
-         sample_count++;
+// Whether each bus cycle needs tracking (--index or a range)
+static int tracking = 0;
+
+static void track_cycle();
+
+// Decode a single sample; all of the state is preserved between calls
+static inline void decode_sample(sample_t next) {
+
+   // Pin mappings into the sample words
+   int idx_data  = arguments.idx_data;
+   int idx_rnw   = arguments.idx_rnw ;
+   int idx_sync  = arguments.idx_sync;
+   int idx_rdy   = arguments.idx_rdy ;
+   int idx_phi2  = arguments.idx_phi2;
+   int idx_rst   = arguments.idx_rst;
+   int idx_addr  = arguments.idx_addr;
+
+   // Act on FIFO overflows reported by fx2pipe
+   while (sample_count >= overflow_at) {
+      process_overflow();
+   }
+
+   // Forget the sample history if samples have been lost
+   if (last_gap_count != gap_count) {
+      last_gap_count = gap_count;
+      sample       = -1;
+      last_sample  = -1;
+      last2_sample = -1;
+      last_phi2    = -1;
+   }
+
+   // The current capture sample, and the previous two
+   last2_sample = last_sample;
+   last_sample  = sample;
+   sample       = next;
+
+   // TODO: fix the hard coded values!!!
+   if (arguments.debug >= 2) {
+      printf("%lld %02x %x %x %x %x\n", sample_count, (int) (sample&255), (int) (sample >> 8)&1,  (int) (sample >> 9)&1,  (int) (sample >> 10)&1,  (int) (sample >> 11)&1  );
+   }
+   sample_count++;
+   stats.samples++;
+
+   // Phi2 is optional
+   // - if asynchronous capture is used, it must be connected
+   // - if synchronous capture is used, it must not connected
+   if (idx_phi2 < 0) {
+
+      // If Phi2 is not present, use the pins directly
+      bus_data = (sample >> idx_data) & 255;
+      if (idx_addr >= 0) {
+         bus_addr = (sample >> idx_addr) & 0xffff;
+      }
+      pin_rnw = (sample >> idx_rnw ) & 1;
+      if (idx_sync >= 0) {
+         pin_sync = (sample >> idx_sync) & 1;
+      }
+      if (idx_rdy >= 0) {
+         pin_rdy = (sample >> idx_rdy) & 1;
+      }
+      if (idx_rst >= 0) {
+         pin_rst = (sample >> idx_rst) & 1;
+      }
 
-         // Phi2 is optional
-         // - if asynchronous capture is used, it must be connected
-         // - if synchronous capture is used, it must not connected
-         if (idx_phi2 < 0) {
+   } else {
+
+      // If Phi2 is present, look for an edge
+      pin_phi2 = (sample >> idx_phi2) & 1;
+      if (pin_phi2 == last_phi2) {
+         // wait for more samples
+         return;
+      }
+      last_phi2 = pin_phi2;
+      stats.phi2_edges++;
 
-            // If Phi2 is not present, use the pins directly
-            bus_data = (sample >> idx_data) & 255;
-            pin_rnw = (sample >> idx_rnw ) & 1;
-            if (idx_sync >= 0) {
-               pin_sync = (sample >> idx_sync) & 1;
+      if (pin_phi2) {
+         // sample control signals (and the address) just after rising edge of Phi2
+         if (idx_addr >= 0) {
+            bus_addr = (sample >> idx_addr) & 0xffff;
+         }
+         pin_rnw = (sample >> idx_rnw ) & 1;
+         if (idx_sync >= 0) {
+            pin_sync = (sample >> idx_sync) & 1;
+         }
+         if (idx_rst >= 0) {
+            pin_rst = (sample >> idx_rst) & 1;
+         }
+         // wait for more samples
+         return;
+      } else {
+         if (idx_rdy >= 0) {
+            pin_rdy = (last_sample >> idx_rdy) & 1;
+         }
+         // TODO: try to rationalize this!
+         if (arguments.machine == MACHINE_ELK) {
+            // Data bus sampling for the Elk
+            if (pin_rnw) {
+               // sample read data just before falling edge of Phi2
+               bus_data = last_sample & 255;
+            } else {
+               // sample write data one cycle earlier
+               bus_data = last_sample & 255;
             }
-            if (idx_rdy >= 0) {
-               pin_rdy = (sample >> idx_rdy) & 1;
+         } else if (arguments.machine == MACHINE_MASTER) {
+            // Data bus sampling for the Master
+            if (pin_rnw) {
+               // sample read data just before falling edge of Phi2
+               bus_data = last_sample & 255;
+            } else {
+               // sample write data one cycle earlier
+               bus_data = last2_sample & 255;
             }
-            if (idx_rst >= 0) {
-               pin_rst = (sample >> idx_rst) & 1;
+         } else {
+            // Data bus sampling for the Beeb, one cycle later
+            if (pin_rnw) {
+               // sample read data just after falling edge of Phi2
+               bus_data = sample & 255;
+            } else {
+               // sample write data one cycle earlier
+               bus_data = last_sample & 255;
             }
+         }
+      }
+   }
 
-         } else {
+   // Ignore the cycle if RDY is low
+   if (pin_rdy == 0) {
+      stats.rdy_stalls++;
+      return;
+   }
+   stats.cycles++;
+   cycle_time_t *t = &cycle_times[stats.cycles % TIMING_HISTORY];
+   t->sample = sample_count - 1;
+   t->stalls = stats.rdy_stalls;
+   if (record_accesses) {
+      bus_access_t *a = &access_history[stats.cycles % ACCESS_HISTORY];
+      a->addr = bus_addr;
+      a->data = bus_data;
+      a->rnw = pin_rnw;
+   }
+
+   int stage = stats_on ? stats_switch(STAGE_DECODE) : 0;
+   if (idx_sync < 0) {
+      lookahead_decode_cycle_without_sync(bus_data, bus_addr, pin_rnw, pin_rst);
+   } else {
+      decode_cycle_with_sync(bus_data, bus_addr, pin_rnw, pin_sync, pin_rst);
+   }
+   if (stats_on) {
+      stats_switch(stage);
+   }
+
+   if (tracking) {
+      track_cycle();
+   }
+}
+
+// Read the sample (or run length) at ptr
+static inline sample_t read_sample(const uint8_t *ptr) {
+   switch (sample_bytes) {
+   case 2:
+      return *(const uint16_t *) ptr;
+   case 4:
+      return *(const uint32_t *) ptr;
+   default:
+      return *(const uint64_t *) ptr;
+   }
+}
+
+// Decode a block of samples; samples can be supplied in arbitrarily sized chunks
+void decode_samples(const void *samples, int num) {
+   const uint8_t *sampleptr = samples;
+   while (num-- > 0 && !stop) {
+      decode_sample(read_sample(sampleptr));
+      sampleptr += sample_bytes;
+   }
+}
+
+// Decode a block of run-length encoded samples (--rle, e.g. from fx2pipe -R).
+// Each record is a sample followed by its run length minus one, both of the
+// sample width. A run can only contain a phi2 edge at its first sample, so
+// with phi2 connected the rest of the run just advances the sample history.
+void decode_runs(const void *records, int num) {
+   const uint8_t *recptr = records;
+   while (num-- > 0 && !stop) {
+      sample_t next = read_sample(recptr);
+      sample_t repeat = read_sample(recptr + sample_bytes);
+      run_offset = input_offset + (recptr - (const uint8_t *) records);
+      run_start = sample_count;
+      recptr += 2 * sample_bytes;
+      if (run_skip) {
+         // Resuming part way through this run, after the last sample decoded
+         // (which was identical), so just the rest of it remains
+         run_start -= run_skip;
+         repeat -= run_skip - 1;
+         run_skip = 0;
+      } else {
+         decode_sample(next);
+      }
+      if (arguments.idx_phi2 < 0) {
+         // One bus cycle per sample
+         while (repeat-- > 0 && !stop) {
+            decode_sample(next);
+         }
+      } else if (repeat > 0) {
+         last2_sample = (repeat > 1) ? sample : last_sample;
+         last_sample  = sample;
+         sample_count += repeat;
+         stats.samples += repeat;
+      }
+   }
+}
+
+// Number of samples in a block of records
+static long long count_samples(const void *records, int num) {
+   if (!arguments.rle) {
+      return num;
+   }
+   const uint8_t *recptr = records;
+   long long count = 0;
+   while (num-- > 0) {
+      count += read_sample(recptr + sample_bytes) + 1;
+      recptr += 2 * sample_bytes;
+   }
+   return count;
+}
+
+// Append a block of input records to the --archive file
+static void archive_records(const void *records, int num) {
+   if (arguments.rle) {
+      capture_write_runs(&archive, records, num);
+   } else {
+      capture_write_samples(&archive, records, num);
+   }
+}
+
+// Decode a block of input records (samples, or runs of samples with --rle)
+void decode_records(const void *records, int num) {
+   int stage = stats_on ? stats_switch(STAGE_EXTRACT) : 0;
+   if (archiving) {
+      archive_records(records, num);
+   }
+   if (arguments.rle) {
+      decode_runs(records, num);
+   } else {
+      decode_samples(records, num);
+   }
+   if (stats_on) {
+      stats_switch(stage);
+      if (arguments.stats > 0) {
+         stats_interval();
+      }
+   }
+}
+
+// Progress reporting (--progress): the size of the capture file (0 if not
+// known), the offset decoding started from, and the time and counts at the
+// start and at the last report
+static long long progress_size = 0;
+static long long progress_offset = 0;
+static long long progress_start_ns = 0;
+static long long progress_last_ns = 0;
+static long long progress_start_samples = 0;
+static long long progress_start_instrs = 0;
+static long long progress_last_samples = 0;
+static long long progress_last_instrs = 0;
+
+static void progress_init(FILE *stream) {
+   struct stat st;
+   if (!arguments.realtime && fstat(fileno(stream), &st) == 0 && S_ISREG(st.st_mode)) {
+      progress_size = st.st_size;
+   }
+   progress_offset = input_offset;
+   progress_start_ns = progress_last_ns = time_ns();
+   progress_start_samples = progress_last_samples = stats.samples;
+   progress_start_instrs = progress_last_instrs = instr_number;
+}
+
+// Report progress once the interval has passed, or at the end if final. This
+// is called once per block of input, so the clock is not read per sample.
+static void progress_update(int final) {
+   long long now = time_ns();
+   long long ns = now - progress_last_ns;
+   if (!final && ns < arguments.progress * 1000000LL) {
+      return;
+   }
+   char line[128];
+   int n = snprintf(line, sizeof(line), "progress: %lld samples", stats.samples);
+   long long total = progress_size - progress_offset;
+   long long done = input_offset - progress_offset;
+   if (total > 0) {
+      n += snprintf(line + n, sizeof(line) - n, " (%.1f%%)", 100.0 * done / total);
+   }
+   // The current rates, or the averages at the end
+   long long samples = stats.samples - progress_last_samples;
+   long long instrs = instr_number - progress_last_instrs;
+   if (final) {
+      samples = stats.samples - progress_start_samples;
+      instrs = instr_number - progress_start_instrs;
+      ns = now - progress_start_ns;
+   }
+   if (ns > 0) {
+      n += snprintf(line + n, sizeof(line) - n, ", %.2f MS/s, %.2f Minstr/s", samples * 1e3 / ns, instrs * 1e3 / ns);
+   }
+   if (!final && total > 0 && done > 0) {
+      long long secs = (now - progress_start_ns) / 1e9 * (total - done) / done;
+      n += snprintf(line + n, sizeof(line) - n, ", ETA %lld:%02lld:%02lld", secs / 3600, secs / 60 % 60, secs % 60);
+   }
+   // Overwrite the line on a terminal, in the manner of fx2pipe
+   if (isatty(2)) {
+      fprintf(stderr, "\r%-79s%s", line, final ? "\n" : "");
+   } else {
+      fprintf(stderr, "%s\n", line);
+   }
+   progress_last_ns = now;
+   progress_last_samples = stats.samples;
+   progress_last_instrs = instr_number;
+}
+
+// How much of want bytes at file offset pos can be read without reading past
+// the last record
+static int input_limit(long long pos, int want) {
+   if (data_end >= 0 && pos + want > data_end) {
+      return (pos < data_end) ? data_end - pos : 0;
+   }
+   return want;
+}
+
+// Decode the stream, after the first len bytes which are already in buffer
+void decode(FILE *stream, int len) {
+   uint8_t *rawbuf = (uint8_t *) buffer;
+   int n;
+   while (!stop && ((n = fread(rawbuf + len, 1, input_limit(input_offset + len, BUFSIZE * record_bytes - len), stream)) > 0 || len >= record_bytes)) {
+      len += n;
+      int num = len / record_bytes;
+      decode_records(buffer, num);
+      input_offset += num * record_bytes;
+      len -= num * record_bytes;
+      memmove(rawbuf, rawbuf + num * record_bytes, len);
+      if (arguments.progress) {
+         progress_update(0);
+      }
+   }
+}
 
-            // If Phi2 is present, look for an edge
-            pin_phi2 = (sample >> idx_phi2) & 1;
-            if (pin_phi2 == last_phi2) {
-               // continue for more samples
+static long long time_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Real-time variant of decode(), for use with a live capture (e.g. from
+// fx2pipe). Whatever input is available is decoded immediately, output is
+// flushed on a timer rather than when the stdio buffer fills, and if the
+// decoder falls too far behind whole chunks are dropped so the capture side
+// never stalls. The first carry bytes of input are already in buffer.
+void decode_realtime(int fd, int carry) {
+   char *rawbuf = (char *) buffer;
+   long long dropped = 0;
+   int is_pipe = 0;
+   int max_lag = 0;
+   long long pos = input_offset + carry;
+   struct stat st;
+
+   if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+      // Try to enlarge the pipe, it's fine if this fails
+      fcntl(fd, F_SETPIPE_SZ, RT_PIPE_SIZE);
+      int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+      if (pipe_size > 0) {
+         is_pipe = 1;
+         max_lag = (arguments.max_lag > 0) ? arguments.max_lag * record_bytes : pipe_size / 2;
+      }
+   }
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+   // Output is flushed on a timer, so use a large output buffer
+   setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+   long long last_flush = time_ms();
+
+   while (!stop) {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int rv = poll(&pfd, 1, arguments.realtime);
+      if (rv < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("poll failed");
+         break;
+      }
+      if (rv > 0) {
+         int n = read(fd, rawbuf + carry, input_limit(pos, BUFSIZE * record_bytes - carry));
+         if (n > 0) {
+            pos += n;
+         }
+         if (n == 0) {
+            // Only a short input can leave whole records behind
+            decode_records(buffer, carry / record_bytes);
+            break;
+         }
+         if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
                continue;
             }
-            last_phi2 = pin_phi2;
+            perror("read failed");
+            break;
+         }
+         n += carry;
+         int num = n / record_bytes;
+         carry = n % record_bytes;
+         // Drop the whole chunk if too much input is still queued up
+         int backlog;
+         if (is_pipe && ioctl(fd, FIONREAD, &backlog) == 0 && backlog > max_lag) {
+            dropped += count_samples(buffer, num);
+            // Only the decoder skips the chunk, the archive stays complete
+            // so that it can be decoded in full later
+            if (archiving) {
+               archive_records(buffer, num);
+            }
+         } else {
+            if (dropped) {
+               decode_gap(dropped);
+               dropped = 0;
+            }
+            decode_records(buffer, num);
+         }
+         // Keep any trailing partial sample for the next read
+         if (carry) {
+            memmove(rawbuf, rawbuf + n - carry, carry);
+         }
+      }
+      long long now = time_ms();
+      if (now - last_flush >= arguments.realtime) {
+         flush_output();
+         last_flush = now;
+      }
+      if (arguments.progress) {
+         progress_update(0);
+      }
+   }
+   if (dropped) {
+      decode_gap(dropped);
+   }
+   fflush(stdout);
+}
 
-            if (pin_phi2) {
-               // sample control signals just after rising edge of Phi2
-               pin_rnw = (sample >> idx_rnw ) & 1;
-               if (idx_sync >= 0) {
-                  pin_sync = (sample >> idx_sync) & 1;
-               }
-               if (idx_rst >= 0) {
-                  pin_rst = (sample >> idx_rst) & 1;
-               }
-               // continue for more samples
-               continue;
-            } else {
-               if (idx_rdy >= 0) {
-                  pin_rdy = (last_sample >> idx_rdy) & 1;
-               }
-               // TODO: try to rationalize this!
-               if (arguments.machine == MACHINE_ELK) {
-                  // Data bus sampling for the Elk
-                  if (pin_rnw) {
-                     // sample read data just before falling edge of Phi2
-                     bus_data = last_sample & 255;
-                  } else {
-                     // sample write data one cycle earlier
-                     bus_data = last_sample & 255;
-                  }
-               } else if (arguments.machine == MACHINE_MASTER) {
-                  // Data bus sampling for the Master
-                  if (pin_rnw) {
-                     // sample read data just before falling edge of Phi2
-                     bus_data = last_sample & 255;
-                  } else {
-                     // sample write data one cycle earlier
-                     bus_data = last2_sample & 255;
-                  }
+#ifdef FX2PIPE
+
+// In-process capture: fx2pipe hands over each completed USB transfer
+// buffer in place, so there is no pipe (and no copy) in between
+static int fx2pipe_sink(void *user, const void *buf, size_t len) {
+   static int carry = 0;
+   const uint8_t *bytes = buf;
+   long long *last_flush = user;
+   uint8_t *rawbuf = (uint8_t *) buffer;
+   if (carry || ((uintptr_t) bytes % sample_bytes)) {
+      // Slow path: re-align via the sample buffer
+      while (len > 0) {
+         int n = BUFSIZE * record_bytes - carry;
+         if (n > len) {
+            n = len;
+         }
+         memcpy(rawbuf + carry, bytes, n);
+         bytes += n;
+         len -= n;
+         n += carry;
+         carry = n % record_bytes;
+         decode_records(buffer, n / record_bytes);
+         if (carry) {
+            memmove(rawbuf, rawbuf + n - carry, carry);
+         }
+      }
+   } else {
+      decode_records(bytes, len / record_bytes);
+      carry = len % record_bytes;
+      if (carry) {
+         memcpy(rawbuf, bytes + len - carry, carry);
+      }
+   }
+   if (arguments.realtime) {
+      long long now = time_ms();
+      if (now - *last_flush >= arguments.realtime) {
+         flush_output();
+         *last_flush = now;
+      }
+   }
+   return stop;
+}
+
+// FIFO overflows are reported from the same thread as the data
+static void fx2pipe_gap_sink(void *user, long long lo, long long hi, int events) {
+   add_overflow(lo, hi, events);
+}
+
+// Run an in-process capture, with ARGS being fx2pipe options
+int decode_fx2pipe(char *args) {
+   char *argv[64];
+   int argc = 0;
+   argv[argc++] = "fx2pipe";
+   if (args) {
+      char *tok = strtok(args, " \t");
+      while (tok && argc < 63) {
+         argv[argc++] = tok;
+         tok = strtok(NULL, " \t");
+      }
+   }
+   argv[argc] = NULL;
+   long long last_flush = time_ms();
+   int ret = fx2_capture_gaps(argc, argv, fx2pipe_sink, fx2pipe_gap_sink, &last_flush);
+   fflush(stdout);
+   return ret;
+}
+
+#endif
+
+// ====================================================================
+// Decoder snapshots (--index) and instruction ranges
+// ====================================================================
+
+// Everything needed to resume decoding at the start of an instruction: the
+// input position just after its opcode fetch, the sample decoder state at
+// that point, and the emulator state (before the instruction executes).
+// The bus cycle decoders are reset, and the opcode fetch replayed into them.
+typedef struct {
+   long long instr;       // instruction number
+   long long cycle;       // bus cycle number of the opcode fetch
+   long long sample;      // number of the next sample to decode
+   long long offset;      // file offset of the record holding that sample
+   long long skip;        // samples of that record already decoded (--rle)
+   int pc;
+   int em[EM_STATE_SIZE];
+   sample_t samples[3];   // sample, last_sample and last2_sample
+   int last_phi2;
+   int pins[7];           // bus_data, bus_addr, rnw, sync, rdy, phi2 and rst
+} snapshot_t;
+
+// The most recent bus cycles, as the sync-less decoder lags behind
+#define HISTORY 4
+
+static snapshot_t history[HISTORY];
+
+static long long last_instr_number = 0;
+
+// Index being written, and the instruction number of the next snapshot
+static FILE *index_file = NULL;
+static long long next_snapshot = 0;
+
+// The kind of capture index entry decoding was started at, until its first
+// bus cycle (0 if none)
+static int seek_kind = 0;
+
+// Whether output is being discarded (before the start of the range)
+static int quiet = 0;
+static int saved_stdout = -1;
+
+// Discard output until the start of the range: the consumers are not handed
+// anything meanwhile, and inline text output is pointed elsewhere
+static void set_quiet(int on) {
+   if (on == quiet) {
+      return;
+   }
+   if (text_inline) {
+      fflush(stdout);
+      if (on) {
+         int fd = open("/dev/null", O_WRONLY);
+         saved_stdout = dup(1);
+         dup2(fd, 1);
+         close(fd);
+      } else {
+         dup2(saved_stdout, 1);
+         close(saved_stdout);
+      }
+   }
+   quiet = on;
+}
+
+// Record the state after the current bus cycle
+static void save_cycle(snapshot_t *s) {
+   s->cycle = cycle_number;
+   s->sample = sample_count;
+   if (arguments.rle) {
+      s->offset = run_offset;
+      s->skip = sample_count - run_start;
+   } else {
+      s->offset = data_start + sample_count * sample_bytes;
+      s->skip = 0;
+   }
+   s->samples[0] = sample;
+   s->samples[1] = last_sample;
+   s->samples[2] = last2_sample;
+   s->last_phi2 = last_phi2;
+   s->pins[0] = bus_data;
+   s->pins[1] = bus_addr;
+   s->pins[2] = pin_rnw;
+   s->pins[3] = pin_sync;
+   s->pins[4] = pin_rdy;
+   s->pins[5] = pin_phi2;
+   s->pins[6] = pin_rst;
+}
+
+// The settings an index depends on, so a mismatched one can be detected
+static void index_settings(char *buf, FILE *stream) {
+   struct stat st;
+   long long size = (fstat(fileno(stream), &st) == 0) ? st.st_size : 0;
+   // FIFO overflows reset the decoders, so they matter too
+   long long gaps = 0;
+   for (int i = 0; i < num_overflows; i++) {
+      gaps = gaps * 31 + overflows[i].lo * 7 + overflows[i].hi;
+   }
+   sprintf(buf, "# capture %lld bytes from %lld, width %d, rle %d, pins %d %d %d %d %d %d %d, machine %d, c02 %d, undocumented %d, gaps %d/%llx\n",
+           size, data_start, arguments.width, arguments.rle,
+           arguments.idx_data, arguments.idx_rnw, arguments.idx_sync, arguments.idx_rdy,
+           arguments.idx_phi2, arguments.idx_rst, arguments.idx_addr,
+           arguments.machine, arguments.c02, arguments.undocumented, num_overflows, gaps);
+}
+
+static int create_index(const char *filename, FILE *stream) {
+   char settings[256];
+   index_file = fopen(filename, "w");
+   if (index_file == NULL) {
+      perror("failed to create index file");
+      return 1;
+   }
+   index_settings(settings, stream);
+   fprintf(index_file, "# decode6502 index, every %lld instructions\n", arguments.index_interval);
+   fputs(settings, index_file);
+   fprintf(index_file, "# instr cycle sample offset skip pc A X Y S N V D I Z C failed sample last_sample last2_sample last_phi2 data addr rnw sync rdy phi2 rst\n");
+   next_snapshot = arguments.index_interval;
+   return 0;
+}
+
+static void write_snapshot(const snapshot_t *s) {
+   fprintf(index_file, "%lld %lld %lld %lld %lld %d", s->instr, s->cycle, s->sample, s->offset, s->skip, s->pc);
+   for (int i = 0; i < EM_STATE_SIZE; i++) {
+      fprintf(index_file, " %d", s->em[i]);
+   }
+   for (int i = 0; i < 3; i++) {
+      fprintf(index_file, " %"PRIx64, s->samples[i]);
+   }
+   fprintf(index_file, " %d", s->last_phi2);
+   for (int i = 0; i < 7; i++) {
+      fprintf(index_file, " %d", s->pins[i]);
+   }
+   fprintf(index_file, "\n");
+}
+
+static int read_snapshot(const char *line, snapshot_t *s) {
+   int n;
+   if (sscanf(line, "%lld %lld %lld %lld %lld %d%n", &s->instr, &s->cycle, &s->sample, &s->offset, &s->skip, &s->pc, &n) != 6) {
+      return -1;
+   }
+   line += n;
+   for (int i = 0; i < EM_STATE_SIZE; i++) {
+      if (sscanf(line, "%d%n", &s->em[i], &n) != 1) {
+         return -1;
+      }
+      line += n;
+   }
+   for (int i = 0; i < 3; i++) {
+      if (sscanf(line, "%"SCNx64"%n", &s->samples[i], &n) != 1) {
+         return -1;
+      }
+      line += n;
+   }
+   if (sscanf(line, "%d%n", &s->last_phi2, &n) != 1) {
+      return -1;
+   }
+   line += n;
+   for (int i = 0; i < 7; i++) {
+      if (sscanf(line, "%d%n", &s->pins[i], &n) != 1) {
+         return -1;
+      }
+      line += n;
+   }
+   return 0;
+}
+
+// The position of the instruction starting at a snapshot, in the units of the
+// range
+static long long range_pos(const snapshot_t *s) {
+   switch (arguments.range_unit) {
+   case RANGE_CYCLE:
+      return s->cycle;
+   case RANGE_SAMPLE:
+      // The sample of the opcode fetch, as in the trace records
+      return s->sample - 1;
+   default:
+      return s->instr;
+   }
+}
+
+// Find the last snapshot in the index before the start of the range. Returns
+// 1 if there is one, 0 if not (or there is no index yet), or -1 on error
+static int find_snapshot(const char *filename, FILE *stream, snapshot_t *best) {
+   char settings[256];
+   char line[512];
+   int found = 0;
+   FILE *f = fopen(filename, "r");
+   if (f == NULL) {
+      return 0;
+   }
+   index_settings(settings, stream);
+   int ok = fgets(line, sizeof(line), f) && fgets(line, sizeof(line), f) && !strcmp(line, settings);
+   if (!ok) {
+      fprintf(stderr, "index file %s is for a different capture file or options\n", filename);
+      fclose(f);
+      return -1;
+   }
+   while (fgets(line, sizeof(line), f)) {
+      snapshot_t s;
+      if (line[0] == '#') {
+         continue;
+      }
+      if (read_snapshot(line, &s) < 0) {
+         fprintf(stderr, "bad line in index file: %s", line);
+         fclose(f);
+         return -1;
+      }
+      if (range_pos(&s) > arguments.range_lo) {
+         break;
+      }
+      *best = s;
+      found = 1;
+   }
+   fclose(f);
+   return found;
+}
+
+// Called at the start of each instruction (bar the first, as that is only
+// noticed by the decoders once it has finished)
+static void instruction_started(const snapshot_t *s) {
+   long long pos = range_pos(s);
+   if (pos > arguments.range_hi) {
+      stop = 1;
+   } else if (quiet && pos >= arguments.range_lo) {
+      set_quiet(0);
+   }
+   if (index_file && s->instr >= next_snapshot) {
+      snapshot_t snap = *s;
+      snap.instr = instr_number;
+      snap.pc = pc;
+      em_save(snap.em);
+      write_snapshot(&snap);
+      next_snapshot += arguments.index_interval;
+   }
+}
+
+static void track_cycle() {
+   save_cycle(&history[cycle_number % HISTORY]);
+   cycle_number++;
+   if (seek_kind) {
+      // The first bus cycle after seeking using the capture index; at a
+      // SYNC entry, the opcode fetch of the first instruction
+      snapshot_t *s = &history[(cycle_number - 1) % HISTORY];
+      if (seek_kind == CAPTURE_INDEX_SYNC) {
+         instr_start = cycle_times[stats.cycles % TIMING_HISTORY];
+         instr_start_gap = gap_count;
+         instr_start_cycle = stats.cycles;
+      }
+      seek_kind = 0;
+      s->instr = instr_number;
+      instruction_started(s);
+   } else if (instr_number != last_instr_number) {
+      // The cycle starting the new instruction; the sync-less decoder has
+      // just analyzed the cycle DEPTH - 1 cycles ago
+      int lag = (arguments.idx_sync < 0) ? DEPTH - 1 : 0;
+      snapshot_t *s = &history[(cycle_number - 1 - lag) % HISTORY];
+      last_instr_number = instr_number;
+      s->instr = instr_number;
+      instruction_started(s);
+   }
+}
+
+// Resume decoding from a snapshot, with the input positioned at s->offset
+static void resume(const snapshot_t *s) {
+   // Restart the bus cycle decoders, and replay the opcode fetch
+   gap_count++;
+   instr_start.sample = s->sample - 1;
+   instr_start.stalls = stats.rdy_stalls;
+   instr_start_gap = gap_count;
+   instr_start_cycle = -1;
+   bus_data = s->pins[0];
+   bus_addr = s->pins[1];
+   pin_rnw  = s->pins[2];
+   pin_sync = s->pins[3];
+   pin_rdy  = s->pins[4];
+   pin_phi2 = s->pins[5];
+   pin_rst  = s->pins[6];
+   if (arguments.idx_sync < 0) {
+      lookahead_decode_cycle_without_sync(bus_data, bus_addr, pin_rnw, pin_rst);
+   } else {
+      decode_cycle_with_sync(bus_data, bus_addr, pin_rnw, pin_sync, pin_rst);
+   }
+
+   // The sample history is kept across the gap
+   last_gap_count = gap_count;
+   sample       = s->samples[0];
+   last_sample  = s->samples[1];
+   last2_sample = s->samples[2];
+   last_phi2    = s->last_phi2;
+   sample_count = s->sample;
+   run_skip     = s->skip;
+   input_offset = s->offset;
+
+   history[s->cycle % HISTORY] = *s;
+   cycle_number = s->cycle + 1;
+   instr_number = s->instr;
+   last_instr_number = instr_number;
+   pc = s->pc;
+   em_restore(s->em);
+
+   // Skip any FIFO overflows which are already past
+   while (overflow_idx < num_overflows && overflows[overflow_idx].hi <= sample_count) {
+      overflow_idx++;
+   }
+   overflow_at = (overflow_idx < num_overflows) ? overflows[overflow_idx].lo : LLONG_MAX;
+
+   instruction_started(s);
+}
+
+// Start a sync decode at the last entry of the capture file's own index at
+// or before the start of the --sample-range, if there is one. Nothing of the
+// decoder state is known there, so it starts afresh as after a gap; at a
+// reset entry, the decoder is told rst was low until then. Returns 0 on
+// success
+static int seek_capture_index(FILE *stream, int *len) {
+   struct stat st;
+   if (fstat(fileno(stream), &st) || !S_ISREG(st.st_mode)) {
+      return 0;
+   }
+   capture_index_t *index;
+   int num = capture_read_index(fileno(stream), &input_header, &index);
+   if (num < 0) {
+      return 1;
+   }
+   const capture_index_t *e = NULL;
+   for (int i = 0; i < num && index[i].sample <= arguments.range_lo; i++) {
+      if (index[i].kind == CAPTURE_INDEX_SYNC || index[i].kind == CAPTURE_INDEX_RESET) {
+         e = &index[i];
+      }
+   }
+   if (e && e->sample > 0) {
+      if (fseeko(stream, e->offset, SEEK_SET)) {
+         perror("failed to seek capture file");
+         free(index);
+         return 1;
+      }
+      if (arguments.debug >= 1) {
+         // On stderr, as stdout is quiet until the range starts
+         fprintf(stderr, "capture index: starting at sample %"PRIu64" (%s)\n", e->sample,
+                (e->kind == CAPTURE_INDEX_RESET) ? "reset" : "sync");
+      }
+      // Any bytes read already are before the entry
+      *len = 0;
+      input_offset = e->offset;
+      sample_count = e->sample;
+      gap_count++;
+      pc = -1;
+      if (do_emulate) {
+         em_invalidate();
+      }
+      if (e->kind == CAPTURE_INDEX_RESET) {
+         decode_cycle_with_sync(bus_data, bus_addr, pin_rnw, 0, 0);
+      }
+      seek_kind = e->kind;
+      // Skip any FIFO overflows which are already past
+      while (overflow_idx < num_overflows && overflows[overflow_idx].hi <= sample_count) {
+         overflow_idx++;
+      }
+      overflow_at = (overflow_idx < num_overflows) ? overflows[overflow_idx].lo : LLONG_MAX;
+   }
+   free(index);
+   return 0;
+}
+
+// Set up --index and the output range; seeks the stream if there is a
+// suitable snapshot, or failing that a suitable capture index entry.
+// Returns 0 on success
+static int setup_tracking(FILE *stream, int *len) {
+   int ranged = GIVEN(16) || GIVEN(17) || GIVEN(26);
+   tracking = ranged || arguments.index;
+   if (arguments.range_lo > 0) {
+      set_quiet(1);
+   }
+   if (arguments.index && ranged) {
+      snapshot_t s;
+      int found = find_snapshot(arguments.index, stream, &s);
+      if (found < 0) {
+         return 1;
+      }
+      if (found) {
+         if (fseeko(stream, s.offset, SEEK_SET)) {
+            perror("failed to seek capture file");
+            return 1;
+         }
+         // Any bytes read already are before the snapshot
+         *len = 0;
+         resume(&s);
+         return 0;
+      }
+      if (access(arguments.index, F_OK) == 0) {
+         // Nothing before the range to jump to
+         return 0;
+      }
+   }
+   if (arguments.index) {
+      return create_index(arguments.index, stream);
+   }
+   if (GIVEN(26) && arguments.idx_sync >= 0 && input_header.index_count && !archiving && !arguments.realtime) {
+      return seek_capture_index(stream, len);
+   }
+   return 0;
+}
+
+// ====================================================================
+// Instruction record consumers (--profile, --trace, --text and so on)
+// ====================================================================
+
+// Each consumer runs on its own thread, and is handed the records in
+// batches. The batches come from a fixed pool and only return to it once
+// every consumer is done with them, so a slow consumer holds up decoding
+// rather than letting its queue grow.
+//
+// The text output is a consumer too, unless it is written inline (see
+// text_inline), so formatting it does not hold up decoding, and several
+// text outputs with different columns cost one decode. The other lines of
+// the text output (gap markers and the like) are passed along as notes,
+// each to be output before the record at its position in the batch.
+#define RECORD_BATCH  4096
+#define NUM_BATCHES   8
+#define MAX_CONSUMERS 16
+
+// Bus cycles kept per record (--heatmap, --watch); anything longer (a held
+// reset, say) has none
+#define MAX_ACCESSES  12
+
+#define MAX_NOTES     256
+#define NOTE_BYTES    16384
+
+typedef struct {
+   instr_record_t records[RECORD_BATCH];
+   int num;
+   // The bus cycles of each record, if record_accesses
+   uint8_t num_accesses[RECORD_BATCH];
+   bus_access_t accesses[RECORD_BATCH][MAX_ACCESSES];
+   // The notes, one after another, each with its terminating zero
+   int note_pos[MAX_NOTES];
+   int num_notes;
+   char notes[NOTE_BYTES];
+   int note_bytes;
+   // Consumers still to process the batch
+   int refs;
+} record_batch_t;
+
+typedef struct consumer {
+   void (*consume)(struct consumer *c, const record_batch_t *batch);
+   // Called once all the records have been consumed; returns non-zero on error
+   int (*finish)(struct consumer *c);
+   FILE *file;
+   void *data;
+   // TEXT_* columns of a text output
+   int columns;
+   pthread_t thread;
+   // The batches queued for the consumer
+   record_batch_t *queue[NUM_BATCHES];
+   int head;
+   int count;
+} consumer_t;
+
+static consumer_t consumers[MAX_CONSUMERS];
+
+// Number of consumers which output the notes
+static int num_text = 0;
+
+static record_batch_t batches[NUM_BATCHES];
+static record_batch_t *free_batches[NUM_BATCHES];
+static int num_free = 0;
+
+// The batch being filled by the decoder
+static record_batch_t *filling = NULL;
+
+// Set once the last batch has been queued
+static int consumers_done = 0;
+
+// Protects the queues, the pool and consumers_done
+static pthread_mutex_t fanout_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fanout_cond = PTHREAD_COND_INITIALIZER;
+
+static void *consumer_thread(void *arg) {
+   consumer_t *c = arg;
+   pthread_mutex_lock(&fanout_lock);
+   while (1) {
+      while (!c->count && !consumers_done) {
+         pthread_cond_wait(&fanout_cond, &fanout_lock);
+      }
+      if (!c->count) {
+         break;
+      }
+      record_batch_t *batch = c->queue[c->head];
+      c->head = (c->head + 1) % NUM_BATCHES;
+      c->count--;
+      pthread_mutex_unlock(&fanout_lock);
+      c->consume(c, batch);
+      pthread_mutex_lock(&fanout_lock);
+      if (--batch->refs == 0) {
+         free_batches[num_free++] = batch;
+         pthread_cond_broadcast(&fanout_cond);
+      }
+   }
+   pthread_mutex_unlock(&fanout_lock);
+   return NULL;
+}
+
+// Queue the batch being filled for every consumer, and wait for a free one
+static void flush_records() {
+   pthread_mutex_lock(&fanout_lock);
+   filling->refs = num_consumers;
+   for (int i = 0; i < num_consumers; i++) {
+      consumer_t *c = &consumers[i];
+      c->queue[(c->head + c->count) % NUM_BATCHES] = filling;
+      c->count++;
+   }
+   pthread_cond_broadcast(&fanout_cond);
+   while (!num_free) {
+      pthread_cond_wait(&fanout_cond, &fanout_lock);
+   }
+   filling = free_batches[--num_free];
+   pthread_mutex_unlock(&fanout_lock);
+   filling->num = 0;
+   filling->num_notes = 0;
+   filling->note_bytes = 0;
+}
+
+// FIRST_CYCLE..END_CYCLE-1 are the bus cycles of the record (first_cycle is
+// -1 if not known)
+static void emit_record(const instr_record_t *r, long long first_cycle, long long end_cycle) {
+   // Outside the range, as for the text output
+   if (quiet) {
+      return;
+   }
+   filling->records[filling->num] = *r;
+   int n = 0;
+   if (record_accesses && first_cycle >= 0 && end_cycle - first_cycle <= MAX_ACCESSES) {
+      n = end_cycle - first_cycle;
+      for (int i = 0; i < n; i++) {
+         filling->accesses[filling->num][i] = access_history[(first_cycle + i) % ACCESS_HISTORY];
+      }
+   }
+   filling->num_accesses[filling->num] = n;
+   if (++filling->num == RECORD_BATCH) {
+      flush_records();
+   }
+}
+
+// Output a line of text other than an instruction, in order with them
+static void emit_note(const char *fmt, ...) {
+   if (quiet) {
+      return;
+   }
+   va_list ap;
+   if (text_inline) {
+      va_start(ap, fmt);
+      vprintf(fmt, ap);
+      va_end(ap);
+   }
+   if (num_text) {
+      char note[TEXT_LINE];
+      va_start(ap, fmt);
+      int len = vsnprintf(note, sizeof(note), fmt, ap) + 1;
+      va_end(ap);
+      if (len > sizeof(note)) {
+         len = sizeof(note);
+      }
+      if (filling->num_notes == MAX_NOTES || filling->note_bytes + len > NOTE_BYTES) {
+         flush_records();
+      }
+      filling->note_pos[filling->num_notes++] = filling->num;
+      memcpy(filling->notes + filling->note_bytes, note, len);
+      filling->note_bytes += len;
+   }
+}
+
+// Make sure everything decoded so far gets output (in real-time mode)
+static void flush_output() {
+   if (num_consumers && (filling->num || filling->num_notes)) {
+      flush_records();
+   }
+   if (text_inline) {
+      fflush(stdout);
+   }
+}
+
+// --text (and the text output on stdout, unless inline)
+
+static void text_consume(consumer_t *c, const record_batch_t *batch) {
+   char line[TEXT_LINE];
+   const char *note = batch->notes;
+   int n = 0;
+   for (int i = 0; i <= batch->num; i++) {
+      while (n < batch->num_notes && batch->note_pos[n] == i) {
+         fputs(note, c->file);
+         note += strlen(note) + 1;
+         n++;
+      }
+      if (i < batch->num) {
+         fputs(format_record(line, &batch->records[i], c->columns), c->file);
+      }
+   }
+   if (arguments.realtime) {
+      fflush(c->file);
+   }
+}
+
+static int text_finish(consumer_t *c) {
+   return ferror(c->file);
+}
+
+// --trace: the records as they are
+
+static void trace_consume(consumer_t *c, const record_batch_t *batch) {
+   fwrite(batch->records, sizeof(instr_record_t), batch->num, c->file);
+}
+
+static int trace_finish(consumer_t *c) {
+   return ferror(c->file);
+}
+
+static int trace_start(consumer_t *c) {
+   uint8_t hdr[RECORD_HEADER_SIZE];
+   memset(hdr, 0, sizeof(hdr));
+   memcpy(hdr, RECORD_MAGIC, RECORD_MAGIC_LEN);
+   hdr[8] = RECORD_HEADER_SIZE;
+   hdr[10] = sizeof(instr_record_t);
+   hdr[12] = RECORD_VERSION;
+   hdr[13] = arguments.c02 ? 1 : arguments.undocumented ? 2 : 0;
+   for (int i = 0; i < 4; i++) {
+      hdr[16 + i] = sample_rate >> (8 * i);
+   }
+   return fwrite(hdr, 1, sizeof(hdr), c->file) != sizeof(hdr);
+}
+
+// --profile: instructions and bus cycles by address
+
+typedef struct {
+   long long count[0x10000];
+   long long cycles[0x10000];
+   uint8_t opcode[0x10000];
+   long long unknown_count;
+   long long unknown_cycles;
+   long long intr_count;
+   long long intr_cycles;
+   long long total_cycles;
+} profile_t;
+
+static void profile_consume(consumer_t *c, const record_batch_t *batch) {
+   profile_t *p = c->data;
+   for (int i = 0; i < batch->num; i++) {
+      const instr_record_t *r = &batch->records[i];
+      if (r->flags & (RECORD_INTERRUPT | RECORD_RESET)) {
+         p->intr_count++;
+         p->intr_cycles += r->cycles;
+      } else if (r->pc < 0) {
+         p->unknown_count++;
+         p->unknown_cycles += r->cycles;
+      } else {
+         p->count[r->pc]++;
+         p->cycles[r->pc] += r->cycles;
+         p->opcode[r->pc] = r->opcode;
+      }
+      p->total_cycles += r->cycles;
+   }
+}
+
+static int profile_finish(consumer_t *c) {
+   profile_t *p = c->data;
+   double total = p->total_cycles ? p->total_cycles : 1;
+   fprintf(c->file, "addr : instr      %12s %12s %7s\n", "count", "cycles", "cycles%");
+   for (int addr = 0; addr < 0x10000; addr++) {
+      if (p->count[addr]) {
+         fprintf(c->file, "%04X : %-10s %12lld %12lld %6.2f%%\n", addr, instr_table[p->opcode[addr]].mnemonic,
+                 p->count[addr], p->cycles[addr], 100.0 * p->cycles[addr] / total);
+      }
+   }
+   if (p->unknown_count) {
+      fprintf(c->file, "???? : %-10s %12lld %12lld %6.2f%%\n", "", p->unknown_count, p->unknown_cycles, 100.0 * p->unknown_cycles / total);
+   }
+   if (p->intr_count) {
+      fprintf(c->file, "     : %-10s %12lld %12lld %6.2f%%\n", "intr/reset", p->intr_count, p->intr_cycles, 100.0 * p->intr_cycles / total);
+   }
+   free(p);
+   return ferror(c->file);
+}
+
+static int profile_start(consumer_t *c) {
+   c->data = calloc(1, sizeof(profile_t));
+   if (!c->data) {
+      perror("failed to allocate profile");
+      return 1;
+   }
+   return 0;
+}
+
+// Whether a bus cycle of a record reads one of the instruction's own bytes
+static int is_fetch(const instr_record_t *r, const bus_access_t *a) {
+   return a->rnw && r->pc >= 0 && !(r->flags & (RECORD_INTERRUPT | RECORD_RESET)) &&
+      ((a->addr - r->pc) & 0xffff) < instr_table[r->opcode].len;
+}
+
+// --heatmap: bus cycles by address, from the address bus
+
+typedef struct {
+   long long fetches[0x10000];
+   long long reads[0x10000];
+   long long writes[0x10000];
+} heatmap_t;
+
+static void heatmap_consume(consumer_t *c, const record_batch_t *batch) {
+   heatmap_t *h = c->data;
+   for (int i = 0; i < batch->num; i++) {
+      const instr_record_t *r = &batch->records[i];
+      for (int j = 0; j < batch->num_accesses[i]; j++) {
+         const bus_access_t *a = &batch->accesses[i][j];
+         if (!a->rnw) {
+            h->writes[a->addr]++;
+         } else if (is_fetch(r, a)) {
+            h->fetches[a->addr]++;
+         } else {
+            h->reads[a->addr]++;
+         }
+      }
+   }
+}
+
+static int heatmap_finish(consumer_t *c) {
+   heatmap_t *h = c->data;
+   fprintf(c->file, "addr : %12s %12s %12s\n", "fetches", "reads", "writes");
+   for (int addr = 0; addr < 0x10000; addr++) {
+      if (h->fetches[addr] || h->reads[addr] || h->writes[addr]) {
+         fprintf(c->file, "%04X : %12lld %12lld %12lld\n", addr, h->fetches[addr], h->reads[addr], h->writes[addr]);
+      }
+   }
+   free(h);
+   return ferror(c->file);
+}
+
+static int heatmap_start(consumer_t *c) {
+   c->data = calloc(1, sizeof(heatmap_t));
+   if (!c->data) {
+      perror("failed to allocate heatmap");
+      return 1;
+   }
+   return 0;
+}
+
+// --watch: accesses to the address ranges given, on stderr
+
+static void watch_consume(consumer_t *c, const record_batch_t *batch) {
+   for (int i = 0; i < batch->num; i++) {
+      const instr_record_t *r = &batch->records[i];
+      for (int j = 0; j < batch->num_accesses[i]; j++) {
+         const bus_access_t *a = &batch->accesses[i][j];
+         for (int k = 0; k < arguments.num_watch; k++) {
+            if (a->addr >= arguments.watch_lo[k] && a->addr <= arguments.watch_hi[k]) {
+               char pc_str[16];
+               if (r->pc < 0) {
+                  strcpy(pc_str, "????");
                } else {
-                  // Data bus sampling for the Beeb, one cycle later
-                  if (pin_rnw) {
-                     // sample read data just after falling edge of Phi2
-                     bus_data = sample & 255;
-                  } else {
-                     // sample write data one cycle earlier
-                     bus_data = last_sample & 255;
-                  }
+                  sprintf(pc_str, "%04X", r->pc);
                }
+               fprintf(c->file, "watch: instruction %lld at %s %s %02X %s %04X\n", (long long) r->instr, pc_str,
+                       !a->rnw ? "writes" : is_fetch(r, a) ? "fetches" : "reads", a->data, a->rnw ? "from" : "to", a->addr);
+               break;
             }
          }
+      }
+   }
+}
 
-         // Ignore the cycle if RDY is low
-         if (pin_rdy == 0)
-            continue;
+static int watch_finish(consumer_t *c) {
+   return ferror(c->file);
+}
 
-         if (idx_sync < 0) {
-            lookahead_decode_cycle_without_sync(bus_data, pin_rnw, pin_rst);
-         } else {
-            decode_cycle_with_sync(bus_data, pin_rnw, pin_sync, pin_rst);
-         }
+// Open FILE ("-" for stdout) for output; NULL on error
+static FILE *open_output(const char *filename) {
+   if (!strcmp(filename, "-")) {
+      return stdout;
+   }
+   FILE *file = fopen(filename, "w");
+   if (file == NULL) {
+      perror("failed to open output file");
+   }
+   return file;
+}
+
+// Start the thread of a consumer writing to FILE (closed at the end, unless
+// stdout or stderr); START may be NULL
+static int add_consumer(FILE *file, int (*start)(consumer_t *c),
+                        void (*consume)(consumer_t *c, const record_batch_t *batch),
+                        int (*finish)(consumer_t *c)) {
+   if (file == NULL) {
+      return 1;
+   }
+   consumer_t *c = &consumers[num_consumers];
+   memset(c, 0, sizeof(consumer_t));
+   c->file = file;
+   c->consume = consume;
+   c->finish = finish;
+   if (start && start(c)) {
+      return 1;
+   }
+   if (pthread_create(&c->thread, NULL, consumer_thread, c)) {
+      perror("failed to start consumer thread");
+      return 1;
+   }
+   num_consumers++;
+   return 0;
+}
+
+// Add a text output with the given columns
+static int add_text(FILE *file, int columns) {
+   if (add_consumer(file, NULL, text_consume, text_finish)) {
+      return 1;
+   }
+   consumers[num_consumers - 1].columns = columns;
+   num_text++;
+   return 0;
+}
+
+static int start_consumers() {
+   for (int i = 0; i < NUM_BATCHES; i++) {
+      free_batches[i] = &batches[i];
+   }
+   num_free = NUM_BATCHES - 1;
+   filling = free_batches[num_free];
+   filling->num = 0;
+   filling->num_notes = 0;
+   filling->note_bytes = 0;
+   if (!text_inline && add_text(stdout, text_columns)) {
+      return 1;
+   }
+   for (int i = 0; i < arguments.num_text; i++) {
+      if (add_text(open_output(arguments.text[i]), arguments.text_columns[i])) {
+         return 1;
+      }
+   }
+   if (arguments.profile && add_consumer(open_output(arguments.profile), profile_start, profile_consume, profile_finish)) {
+      return 1;
+   }
+   if (arguments.trace && add_consumer(open_output(arguments.trace), trace_start, trace_consume, trace_finish)) {
+      return 1;
+   }
+   if (arguments.heatmap && add_consumer(open_output(arguments.heatmap), heatmap_start, heatmap_consume, heatmap_finish)) {
+      return 1;
+   }
+   if (arguments.num_watch && add_consumer(stderr, NULL, watch_consume, watch_finish)) {
+      return 1;
+   }
+   return 0;
+}
+
+// Hand over the last records, and wait for the consumers to finish
+static int finish_consumers() {
+   int ret = 0;
+   if (filling->num || filling->num_notes) {
+      flush_records();
+   }
+   pthread_mutex_lock(&fanout_lock);
+   consumers_done = 1;
+   pthread_cond_broadcast(&fanout_cond);
+   pthread_mutex_unlock(&fanout_lock);
+   for (int i = 0; i < num_consumers; i++) {
+      consumer_t *c = &consumers[i];
+      pthread_join(c->thread, NULL);
+      int err = c->finish(c);
+      if (c->file == stdout || c->file == stderr) {
+         err |= fflush(c->file);
+      } else {
+         err |= fclose(c->file);
+      }
+      if (err) {
+         perror("failed to write output file");
+         ret = 2;
       }
    }
+   num_consumers = 0;
+   num_text = 0;
+   return ret;
+}
+
+// ====================================================================
+// Capture file header
+// ====================================================================
+
+// The pin mapping options in capture header order, and their option keys
+static int *const header_pins[CAPTURE_NUM_PINS] = {
+   &arguments.idx_data,
+   &arguments.idx_rnw,
+   &arguments.idx_sync,
+   &arguments.idx_rdy,
+   &arguments.idx_phi2,
+   &arguments.idx_rst,
+   &arguments.idx_addr
+};
+
+static const int header_keys[CAPTURE_NUM_PINS] = { 1, 2, 3, 4, 5, 6, 11 };
+
+// Read len bytes from fd, or fewer at end of file; -1 on error
+static int read_fully(int fd, uint8_t *buf, int len) {
+   int total = 0;
+   while (total < len) {
+      int n = read(fd, buf + total, len - total);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n < 0) {
+         perror("failed to read capture file");
+         return -1;
+      }
+      if (n == 0) {
+         break;
+      }
+      total += n;
+   }
+   return total;
+}
+
+// Take the sample format, pin mapping, cpu and machine type from the capture
+// file header, if there is one (options given on the command line take
+// precedence). Returns the number of bytes read which turned out to be
+// samples rather than a header, left at the start of buffer, or -1 on error
+static int read_header(int fd) {
+   uint8_t *rawbuf = (uint8_t *) buffer;
+   capture_header_t hdr;
+   int len = read_fully(fd, rawbuf, CAPTURE_MAGIC_LEN);
+   if (len < 0 || !capture_is_header(rawbuf, len)) {
+      return len;
+   }
+   int size = -1;
+   if (read_fully(fd, rawbuf + len, CAPTURE_HEADER_SIZE_V1 - len) == CAPTURE_HEADER_SIZE_V1 - len) {
+      size = capture_header_size(rawbuf);
+      if (size < 0) {
+         return -1;
+      }
+      // The rest of the header, including any fields of later versions
+      if (read_fully(fd, rawbuf + CAPTURE_HEADER_SIZE_V1, size - CAPTURE_HEADER_SIZE_V1) != size - CAPTURE_HEADER_SIZE_V1) {
+         size = -1;
+      }
+   }
+   if (size < 0) {
+      fprintf(stderr, "capture header: truncated\n");
+      return -1;
+   }
+   if (capture_parse_header(rawbuf, &hdr) < 0) {
+      return -1;
+   }
+   for (int i = 0; i < CAPTURE_NUM_PINS; i++) {
+      if (!GIVEN(header_keys[i]) && hdr.pins[i] != CAPTURE_UNSPECIFIED) {
+         *header_pins[i] = hdr.pins[i];
+      }
+   }
+   if (!GIVEN('c') && !GIVEN('u') && hdr.cpu != CAPTURE_UNSPECIFIED) {
+      arguments.c02 = (hdr.cpu == CAPTURE_CPU_65C02);
+      arguments.undocumented = (hdr.cpu == CAPTURE_CPU_6502_UND);
+   }
+   if (!GIVEN('m') && hdr.machine >= 0 && hdr.machine <= MACHINE_ELK) {
+      arguments.machine = hdr.machine;
+   }
+   arguments.width = hdr.width;
+   arguments.rle = (hdr.encoding == CAPTURE_ENC_RLE);
+   if (!GIVEN(22)) {
+      sample_rate = hdr.sample_rate;
+   }
+   data_start = size;
+   if (hdr.index_count) {
+      data_end = hdr.index_offset;
+   }
+   input_header = hdr;
+   if (arguments.debug >= 1) {
+      printf("capture header: version %d, %d bit samples%s, %"PRIu32" Hz, %"PRIu32" index entries\n",
+             rawbuf[CAPTURE_OFS_VERSION], hdr.width, arguments.rle ? " (run-length encoded)" : "",
+             hdr.sample_rate, hdr.index_count);
+   }
+   return 0;
+}
+
+// Create the --archive file, with a header describing the capture as decoded
+static int open_archive(const char *filename) {
+   capture_header_t hdr;
+   hdr.width = arguments.width;
+   hdr.encoding = CAPTURE_ENC_RLE;
+   for (int i = 0; i < CAPTURE_NUM_PINS; i++) {
+      hdr.pins[i] = *header_pins[i];
+   }
+   if (arguments.c02) {
+      hdr.cpu = CAPTURE_CPU_65C02;
+   } else if (arguments.undocumented) {
+      hdr.cpu = CAPTURE_CPU_6502_UND;
+   } else {
+      hdr.cpu = CAPTURE_CPU_6502;
+   }
+   hdr.machine = arguments.machine;
+   hdr.sample_rate = sample_rate;
+   if (capture_writer_open(&archive, filename, &hdr)) {
+      return 1;
+   }
+   archiving = 1;
+   return 0;
 }
 
 // ====================================================================
@@ -932,33 +3211,146 @@ int main(int argc, char *argv[]) {
    arguments.idx_rdy      = 10;
    arguments.idx_phi2     = 11;
    arguments.idx_rst      = 14;
+   arguments.idx_addr     = -1;
+   arguments.width        = 16;
+   arguments.rle          = 0;
+   arguments.archive      = NULL;
    arguments.machine      = MACHINE_DEFAULT;
    arguments.show_hex     = 0;
    arguments.show_state   = 0;
    arguments.show_cycles  = 0;
+   arguments.show_time    = 0;
    arguments.c02          = 0;
    arguments.undocumented = 0;
    arguments.debug        = 0;
+   arguments.realtime     = 0;
+   arguments.max_lag      = 0;
+   arguments.gaps         = NULL;
+   arguments.index        = NULL;
+   arguments.index_interval = 100000;
+   arguments.range_lo     = 0;
+   arguments.range_hi     = LLONG_MAX;
+   arguments.range_unit   = RANGE_INSTR;
+   arguments.stats        = 0;
+   arguments.progress     = 0;
+   arguments.sample_rate  = 0;
+   arguments.profile      = NULL;
+   arguments.trace        = NULL;
+   arguments.num_text     = 0;
+   arguments.heatmap      = NULL;
+   arguments.num_watch    = 0;
+   arguments.fx2pipe      = 0;
+   arguments.fx2pipe_args = NULL;
    arguments.filename     = NULL;
+   memset(arguments.given, 0, sizeof(arguments.given));
 
    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+   sample_rate = arguments.sample_rate;
+
+   FILE *stream = NULL;
+   int len = 0;
+   if (!arguments.fx2pipe) {
+      if (!arguments.filename || !strcmp(arguments.filename, "-")) {
+         stream = stdin;
+      } else {
+         stream = fopen(arguments.filename, "r");
+         if (stream == NULL) {
+            perror("failed to open capture file");
+            return 2;
+         }
+      }
+      len = read_header(fileno(stream));
+      if (len < 0) {
+         return 2;
+      }
+      input_offset = data_start;
+   }
+
+   text_columns = (arguments.show_hex ? TEXT_HEX : 0) | (arguments.show_cycles ? TEXT_CYCLES : 0) |
+      (arguments.show_time ? TEXT_TIME : 0) | (arguments.show_state ? TEXT_STATE : 0);
+   int all_columns = text_columns;
+   for (int i = 0; i < arguments.num_text; i++) {
+      all_columns |= arguments.text_columns[i];
+   }
+
+   if ((all_columns & TEXT_TIME) && !sample_rate) {
+      fprintf(stderr, "the sample rate is not known, so give --sample-rate\n");
+      return 2;
+   }
 
-   if (arguments.show_state || arguments.idx_sync < 0) {
+   if ((arguments.heatmap || arguments.num_watch) && arguments.idx_addr < 0) {
+      fprintf(stderr, "heatmap and watch need the address bus, so give --addr\n");
+      return 2;
+   }
+   record_accesses = arguments.heatmap || arguments.num_watch;
+
+   if (arguments.idx_addr >= 0 && arguments.idx_addr + 16 > arguments.width) {
+      fprintf(stderr, "addr does not fit in the sample width\n");
+      return 2;
+   }
+
+   sample_bytes = arguments.width / 8;
+   record_bytes = arguments.rle ? 2 * sample_bytes : sample_bytes;
+
+   if ((all_columns & TEXT_STATE) || arguments.idx_sync < 0) {
       do_emulate = 1;
    }
 
-   FILE *stream;
-   if (!arguments.filename || !strcmp(arguments.filename, "-")) {
-      stream = stdin;
-   } else {
-      stream = fopen(arguments.filename, "r");
-      if (stream == NULL) {
-         perror("failed to open capture file");
-         return 2;
-      }
+   // Debug output is printed as the decoder goes, so the text output must be
+   text_inline = (arguments.debug > 0);
+
+   if (arguments.gaps && load_overflows(arguments.gaps)) {
+      return 2;
+   }
+
+   if (arguments.archive && open_archive(arguments.archive)) {
+      return 2;
    }
+
+   int ret = 0;
    em_init(arguments.c02, arguments.undocumented);
-   decode(stream);
-   fclose(stream);
-   return 0;
+
+   if (setup_tracking(stream, &len)) {
+      return 2;
+   }
+   if (GIVEN(18)) {
+      stats_init();
+   }
+   if (start_consumers()) {
+      return 2;
+   }
+#ifdef FX2PIPE
+   if (arguments.fx2pipe) {
+      ret = decode_fx2pipe(arguments.fx2pipe_args);
+   }
+#endif
+   if (stream) {
+      if (arguments.progress) {
+         progress_init(stream);
+      }
+      if (arguments.realtime) {
+         decode_realtime(fileno(stream), len);
+      } else {
+         decode(stream, len);
+      }
+      if (arguments.progress) {
+         progress_update(1);
+      }
+      fclose(stream);
+   }
+   if (archiving && capture_writer_close(&archive)) {
+      ret = 2;
+   }
+   if (index_file && (ferror(index_file) | fclose(index_file))) {
+      perror("failed to write index file");
+      ret = 2;
+   }
+   if (num_consumers && finish_consumers()) {
+      ret = 2;
+   }
+   set_quiet(0);
+   if (stats_on) {
+      stats_report();
+   }
+   return ret;
 }
@@ -0,0 +1,88 @@
+#ifndef _INCLUDE_RECORD_H
+#define _INCLUDE_RECORD_H
+
+#include <inttypes.h>
+
+// ====================================================================
+// Instruction records and the trace file format
+// ====================================================================
+//
+// Each decoded instruction (or interrupt, or reset) is summarised in a
+// record, which decode6502 hands to every consumer (--profile, --trace,
+// --text and so on).
+//
+// --trace=FILE writes the records to FILE, after a 24 byte header:
+//
+//   offset  size  contents
+//        0     8  magic: "6502TRC" followed by 0x1a
+//        8     2  header size in bytes; the records start at this offset
+//       10     2  record size in bytes
+//       12     1  format version (2; version 1 has no fields from 16 on,
+//                 and records of 40 bytes)
+//       13     1  cpu (0 = 6502, 1 = 65C02, 2 = 6502 with undocumented
+//                 opcodes)
+//       14     2  reserved (zero)
+//       16     4  sample rate in Hz (0 if unknown)
+//       20     4  reserved (zero)
+//
+// followed by one record per instruction:
+//
+//   offset  size  contents
+//        0     8  instruction number (counting from 0)
+//        8     4  pc (-1 if not known)
+//       12     1  opcode
+//       13     1  first operand byte
+//       14     1  second operand byte
+//       15     1  bus cycles
+//       16     1  flags (RECORD_*)
+//       17     1  reserved (zero)
+//       18    20  emulated A, X, Y, S, N, V, D, I, Z and C after the
+//                 instruction, each 2 bytes (-1 if not known or not
+//                 emulated)
+//       38     2  cycles stretched by rdy during the instruction
+//       40     8  sample number of the opcode fetch (-1 if not known)
+//       48     8  the same in ns (-1 if not known, or the sample rate is not)
+//       56     4  duration in samples, to the next opcode fetch, including
+//                 any cycles stretched by rdy (0 if not known)
+//       60     4  reserved (zero)
+//
+// The sample of a bus cycle is the one it is decoded at: the falling edge
+// of phi2, or the sample itself without phi2.
+//
+// All values are little endian. Readers must use the record size from the
+// header, so that later versions can add fields.
+
+#define RECORD_MAGIC        "6502TRC\x1a"
+#define RECORD_MAGIC_LEN    8
+#define RECORD_HEADER_SIZE  24
+#define RECORD_VERSION      2
+
+// The record is an interrupt or a reset, rather than an instruction
+#define RECORD_INTERRUPT    0x01
+#define RECORD_RESET        0x02
+
+// The pc had to be corrected, or the emulator's prediction failed
+#define RECORD_PC_FAIL      0x04
+#define RECORD_EM_FAIL      0x08
+
+// Registers and flags in a record
+#define RECORD_STATE_SIZE   10
+
+typedef struct {
+   int64_t instr;
+   int32_t pc;
+   uint8_t opcode;
+   uint8_t op1;
+   uint8_t op2;
+   uint8_t cycles;
+   uint8_t flags;
+   uint8_t reserved1;
+   int16_t state[RECORD_STATE_SIZE];
+   uint16_t stretch;
+   int64_t sample;
+   int64_t time;
+   uint32_t duration;
+   uint32_t reserved2;
+} instr_record_t;
+
+#endif